@@ -48,10 +48,13 @@ endif (SOLARIS)
 
 # HEADER FILES
 check_include_file(assert.h HAVE_ASSERT_H)
+check_include_file(execinfo.h HAVE_EXECINFO_H)
 check_include_file(inttypes.h HAVE_INTTYPES_H)
 check_include_file(io.h HAVE_IO_H)
+check_include_file(linux/perf_event.h HAVE_LINUX_PERF_EVENT_H)
 check_include_file(malloc.h HAVE_MALLOC_H)
 check_include_file(memory.h HAVE_MEMORY_H)
+check_include_file(pthread.h HAVE_PTHREAD_H)
 check_include_file(setjmp.h HAVE_SETJMP_H)
 check_include_file(signal.h HAVE_SIGNAL_H)
 check_include_file(stdarg.h HAVE_STDARG_H)
@@ -61,8 +64,11 @@ check_include_file(stdio.h HAVE_STDIO_H)
 check_include_file(stdlib.h HAVE_STDLIB_H)
 check_include_file(string.h HAVE_STRING_H)
 check_include_file(strings.h HAVE_STRINGS_H)
+check_include_file(sys/mman.h HAVE_SYS_MMAN_H)
+check_include_file(sys/resource.h HAVE_SYS_RESOURCE_H)
 check_include_file(sys/stat.h HAVE_SYS_STAT_H)
 check_include_file(sys/types.h HAVE_SYS_TYPES_H)
+check_include_file(sys/wait.h HAVE_SYS_WAIT_H)
 check_include_file(time.h HAVE_TIME_H)
 check_include_file(unistd.h HAVE_UNISTD_H)
 
@@ -76,6 +82,7 @@ check_type_size(uintptr_t UINTPTR_T)
 # FUNCTIONS
 check_function_exists(calloc HAVE_CALLOC)
 check_function_exists(exit HAVE_EXIT)
+check_function_exists(fork HAVE_FORK)
 check_function_exists(fprintf HAVE_FPRINTF)
 check_function_exists(free HAVE_FREE)
 check_function_exists(longjmp HAVE_LONGJMP)
@@ -90,6 +97,14 @@ check_function_exists(strsignal HAVE_STRSIGNAL)
 check_function_exists(strcmp HAVE_STRCMP)
 check_function_exists(clock_gettime HAVE_CLOCK_GETTIME)
 
+if (HAVE_SIGNAL_H)
+    check_symbol_exists(sigaction signal.h HAVE_SIGACTION)
+endif (HAVE_SIGNAL_H)
+
+if (HAVE_EXECINFO_H)
+    check_symbol_exists(backtrace execinfo.h HAVE_BACKTRACE)
+endif (HAVE_EXECINFO_H)
+
 if (WIN32)
     check_function_exists(_vsnprintf_s HAVE__VSNPRINTF_S)
     check_function_exists(_vsnprintf HAVE__VSNPRINTF)
@@ -102,6 +117,11 @@ else (WIN32)
     check_function_exists(vsnprintf HAVE_VSNPRINTF)
 endif (WIN32)
 
+if (HAVE_PTHREAD_H AND NOT WIN32)
+    set(THREADS_PREFER_PTHREAD_FLAG ON)
+    find_package(Threads)
+endif ()
+
 find_library(RT_LIBRARY rt)
 if (RT_LIBRARY AND NOT LINUX AND NOT ANDROID)
     set(CMOCKA_REQUIRED_LIBRARIES ${RT_LIBRARY} CACHE INTERNAL "cmocka required system libraries")
@@ -124,6 +144,13 @@ int main(void) {
 }" HAVE_MSVC_THREAD_LOCAL_STORAGE)
 endif(WIN32)
 
+check_c_source_compiles("
+extern void *cmocka_weak_reference(void) __attribute__((weak));
+
+int main(void) {
+    return cmocka_weak_reference == 0 ? 0 : 1;
+}" HAVE_WEAK_REFERENCES)
+
 if (HAVE_TIME_H AND HAVE_STRUCT_TIMESPEC AND HAVE_CLOCK_GETTIME)
     if (RT_LIBRARY)
         set(CMAKE_REQUIRED_LIBRARIES ${RT_LIBRARY})
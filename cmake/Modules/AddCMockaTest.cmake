@@ -22,6 +22,7 @@
 #                   [COMPILE_OPTIONS opt1 opt2 ... optN]
 #                   [LINK_LIBRARIES lib1 lib2 ... libN]
 #                   [LINK_OPTIONS lopt1 lop2 .. loptN]
+#                   [WRAP_ALLOCATORS]
 #                  )
 #
 # ``target_name``:
@@ -40,6 +41,13 @@
 # ``LINK_OPTIONS``:
 #   Optional, expects one or more options to be passed to the linker
 #
+# ``WRAP_ALLOCATORS``:
+#   Optional, links the test with ``-Wl,--wrap`` for malloc, calloc, realloc,
+#   free, strdup, strndup, asprintf and vasprintf. Allocations of code which
+#   isn't compiled with UNIT_TESTING are then tracked by cmocka as well, so
+#   leaks in any object or static library of the test are reported. This
+#   requires a GNU compatible linker.
+#
 #
 # Example:
 #
@@ -71,6 +79,10 @@ endif()
 
 function(ADD_CMOCKA_TEST _TARGET_NAME)
 
+    set(options
+        WRAP_ALLOCATORS
+    )
+
     set(one_value_arguments
     )
 
@@ -82,7 +94,7 @@ function(ADD_CMOCKA_TEST _TARGET_NAME)
     )
 
     cmake_parse_arguments(_add_cmocka_test
-        ""
+        "${options}"
         "${one_value_arguments}"
         "${multi_value_arguments}"
         ${ARGN}
@@ -113,6 +125,20 @@ function(ADD_CMOCKA_TEST _TARGET_NAME)
         )
     endif()
 
+    if (_add_cmocka_test_WRAP_ALLOCATORS)
+        if (APPLE OR MSVC)
+            message(FATAL_ERROR
+                    "WRAP_ALLOCATORS is not supported by the linker of ${_TARGET_NAME}")
+        endif()
+
+        foreach(_wrap_symbol malloc calloc realloc free
+                             strdup strndup asprintf vasprintf)
+            set_property(TARGET ${_TARGET_NAME}
+                APPEND_STRING PROPERTY LINK_FLAGS " -Wl,--wrap=${_wrap_symbol}"
+            )
+        endforeach()
+    endif()
+
     add_test(${_TARGET_NAME}
         ${TARGET_SYSTEM_EMULATOR} ${_TARGET_NAME}
     )
@@ -1714,6 +1714,12 @@ void ignore_function_calls(#function);
  * }
  * @endcode
  *
+ * Most settings of the cmocka_set_*() functions can also be given in a
+ * CMOCKA_* environment variable. The environment is read once, when the first
+ * test group starts or a setting is used or set for the first time. A
+ * variable which is set always takes precedence: the setter of its setting
+ * has no effect, whether it is called before or after the first test group.
+ *
  * @{
  */
 
@@ -1834,19 +1840,19 @@ static inline void _unit_test_dummy(void **state) {
 
 
 /** Initializes a CMUnitTest structure. */
-#define cmocka_unit_test(f) { #f, f, NULL, NULL, NULL }
+#define cmocka_unit_test(f) { #f, f, NULL, NULL, NULL, NULL, NULL }
 
 /** Initializes a CMUnitTest structure with a setup function. */
-#define cmocka_unit_test_setup(f, setup) { #f, f, setup, NULL, NULL }
+#define cmocka_unit_test_setup(f, setup) { #f, f, setup, NULL, NULL, NULL, NULL }
 
 /** Initializes a CMUnitTest structure with a teardown function. */
-#define cmocka_unit_test_teardown(f, teardown) { #f, f, NULL, teardown, NULL }
+#define cmocka_unit_test_teardown(f, teardown) { #f, f, NULL, teardown, NULL, NULL, NULL }
 
 /**
  * Initialize an array of CMUnitTest structures with a setup function for a test
  * and a teardown function. Either setup or teardown can be NULL.
  */
-#define cmocka_unit_test_setup_teardown(f, setup, teardown) { #f, f, setup, teardown, NULL }
+#define cmocka_unit_test_setup_teardown(f, setup, teardown) { #f, f, setup, teardown, NULL, NULL, NULL }
 
 /**
  * Initialize a CMUnitTest structure with given initial state. It will be passed
@@ -1855,7 +1861,7 @@ static inline void _unit_test_dummy(void **state) {
  * @note If the group setup function initialized the state already, it won't be
  * overridden by the initial state defined here.
  */
-#define cmocka_unit_test_prestate(f, state) { #f, f, NULL, NULL, state }
+#define cmocka_unit_test_prestate(f, state) { #f, f, NULL, NULL, state, NULL, NULL }
 
 /**
  * Initialize a CMUnitTest structure with given initial state, setup and
@@ -1864,7 +1870,88 @@ static inline void _unit_test_dummy(void **state) {
  * @note If the group setup function initialized the state already, it won't be
  * overridden by the initial state defined here.
  */
-#define cmocka_unit_test_prestate_setup_teardown(f, setup, teardown, state) { #f, f, setup, teardown, state }
+#define cmocka_unit_test_prestate_setup_teardown(f, setup, teardown, state) { #f, f, setup, teardown, state, NULL, NULL }
+
+/**
+ * Initialize a CMUnitTest structure with an allocation budget. The test fails
+ * if it allocates more than the budget allows, see struct CMAllocBudget.
+ *
+ * @code
+ * static const struct CMAllocBudget no_allocs = { 0, 0 };
+ *
+ * const struct CMUnitTest tests[] = {
+ *     cmocka_unit_test_alloc_budget(test_lookup, &no_allocs),
+ * };
+ * @endcode
+ */
+#define cmocka_unit_test_alloc_budget(f, budget) { #f, f, NULL, NULL, NULL, budget, NULL }
+
+/**
+ * Initialize a CMUnitTest structure with a benchmark. The benchmark function
+ * gets the number of iterations to run, cmocka calibrates it so that a round
+ * takes about the time set with cmocka_set_benchmark(). After warm-up rounds
+ * the measured rounds are reported in ns/op with the minimum, the median and
+ * the standard deviation. The results are printed by the standard and the TAP
+ * output and added as properties of the test case to the XML output.
+ *
+ * @code
+ * static void bench_lookup(void **state, size_t iterations)
+ * {
+ *     size_t i;
+ *
+ *     for (i = 0; i < iterations; i++) {
+ *         struct entry *e = lookup(*state, "key");
+ *
+ *         cmocka_do_not_optimize(e);
+ *     }
+ * }
+ *
+ * const struct CMUnitTest tests[] = {
+ *     cmocka_unit_benchmark(bench_lookup),
+ * };
+ * @endcode
+ *
+ * @see cmocka_do_not_optimize
+ * @see cmocka_clobber_memory
+ */
+#define cmocka_unit_benchmark(f) { #f, NULL, NULL, NULL, NULL, NULL, f }
+
+/**
+ * Initialize a CMUnitTest structure with a benchmark, a setup and a teardown
+ * function. Either setup or teardown can be NULL. They are called once around
+ * all rounds of the benchmark.
+ */
+#define cmocka_unit_benchmark_setup_teardown(f, setup, teardown) { #f, NULL, setup, teardown, NULL, NULL, f }
+
+#ifdef DOXYGEN
+/**
+ * @brief Keep the compiler from optimizing away the computation of a value.
+ *
+ * The value is treated as if it was read, so the code producing it can't be
+ * removed from the loop of a benchmark.
+ *
+ * @param[in]  value  The lvalue to keep.
+ */
+void cmocka_do_not_optimize(value);
+
+/**
+ * @brief Keep the compiler from optimizing away writes to memory.
+ *
+ * All memory is treated as if it was read and written at this point, so
+ * stores before it are done and loads after it are repeated.
+ */
+void cmocka_clobber_memory(void);
+#else
+# if defined(__GNUC__) || defined(__clang__)
+#  define cmocka_do_not_optimize(value) \
+        __asm__ __volatile__("" : : "r"(&(value)) : "memory")
+#  define cmocka_clobber_memory() __asm__ __volatile__("" : : : "memory")
+# else
+#  define cmocka_do_not_optimize(value) \
+        _cmocka_do_not_optimize((const volatile void *)&(value))
+#  define cmocka_clobber_memory() _cmocka_do_not_optimize(NULL)
+# endif
+#endif
 
 #ifdef DOXYGEN
 /**
@@ -2012,11 +2099,23 @@ int cmocka_run_group_tests_name(const char *group_name,
  * tested by cmocka should replace calls to malloc(), calloc() and free() to
  * test_malloc(), test_calloc() and test_free() respectively. Each time a block
  * is deallocated using test_free() it is checked for corruption, if a corrupt
- * block is found a test failure is signalled. All blocks allocated using the
+ * block is found a test failure is signalled. Passing a pointer that was not
+ * returned by the test_*() allocation functions to test_free(), or freeing a
+ * block twice, also signals a test failure. All blocks allocated using the
  * test_*() allocation functions are tracked by the cmocka library. When a test
  * completes if any allocated blocks (memory leaks) remain they are reported
  * and a test failure is signalled.
  *
+ * Code which can't be compiled with UNIT_TESTING, e.g. a static library of a
+ * third party, can be tracked by linking the test with the GNU linker option
+ * `-Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=free` (plus strdup,
+ * strndup, asprintf and vasprintf if needed), or by passing WRAP_ALLOCATORS to
+ * add_cmocka_test(). cmocka provides the __wrap_*() functions, they route all
+ * allocations made while a test, setup or teardown function is running through
+ * test_malloc(). Blocks allocated elsewhere are passed on to the C library.
+ * The source location of these blocks is reported as "<wrapped allocator>",
+ * set CMOCKA_MALLOC_BACKTRACE to see where they have been allocated.
+ *
  * For simplicity cmocka currently executes all tests in one process. Therefore
  * all test cases in a test application share a single address space which
  * means memory corruption from a single test case could potentially cause the
@@ -2101,14 +2200,486 @@ void test_free(void *ptr);
 #define test_free(ptr) _test_free(ptr, __FILE__, __LINE__)
 #endif
 
+#ifdef DOXYGEN
+/**
+ * @brief Test function overriding aligned_alloc.
+ *
+ * The block is tracked like the ones returned by test_malloc(), so it is
+ * surrounded by guard blocks, reported if it leaks and must be freed with
+ * test_free(). Resizing it with test_realloc() keeps the alignment.
+ *
+ * @param[in]  alignment  The alignment of the returned pointer, a power of
+ *                        two.
+ *
+ * @param[in]  size       The bytes which should be allocated.
+ *
+ * @return A pointer to the allocated memory or NULL with errno set to EINVAL
+ *         if the alignment is not supported.
+ *
+ * @see aligned_alloc(3)
+ */
+void *test_aligned_alloc(size_t alignment, size_t size);
+#else
+#define test_aligned_alloc(alignment, size) \
+    _test_aligned_alloc(alignment, size, __FILE__, __LINE__)
+#endif
+
+#ifdef DOXYGEN
+/**
+ * @brief Test function overriding posix_memalign.
+ *
+ * @param[out] memptr     Where to store the pointer to the allocated memory.
+ *
+ * @param[in]  alignment  The alignment of the returned pointer, a power of
+ *                        two multiple of sizeof(void *).
+ *
+ * @param[in]  size       The bytes which should be allocated.
+ *
+ * @return 0 on success or EINVAL if the alignment is not supported.
+ *
+ * @see test_aligned_alloc()
+ * @see posix_memalign(3)
+ */
+int test_posix_memalign(void **memptr, size_t alignment, size_t size);
+#else
+#define test_posix_memalign(memptr, alignment, size) \
+    _test_posix_memalign(memptr, alignment, size, __FILE__, __LINE__)
+#endif
+
+#ifdef DOXYGEN
+/**
+ * @brief Test function overriding memalign.
+ *
+ * @param[in]  alignment  The alignment of the returned pointer, a power of
+ *                        two.
+ *
+ * @param[in]  size       The bytes which should be allocated.
+ *
+ * @return A pointer to the allocated memory or NULL on error.
+ *
+ * @see test_aligned_alloc()
+ * @see memalign(3)
+ */
+void *test_memalign(size_t alignment, size_t size);
+#else
+#define test_memalign(alignment, size) \
+    _test_memalign(alignment, size, __FILE__, __LINE__)
+#endif
+
 /* Redirect malloc, calloc and free to the unit test allocators. */
 #ifdef UNIT_TESTING
 #define malloc test_malloc
 #define realloc test_realloc
 #define calloc test_calloc
 #define free test_free
+#define aligned_alloc test_aligned_alloc
+#define posix_memalign test_posix_memalign
+#define memalign test_memalign
 #endif /* UNIT_TESTING */
 
+/**
+ * @brief Set the size of the guard blocks placed around each allocation.
+ *
+ * Every block returned by test_malloc() is surrounded by two guard blocks
+ * which are checked for corruption when the block is freed. A larger guard,
+ * e.g. a whole cache line, catches overflows which skip over the first few
+ * bytes past the end of a buffer. The size is rounded up to a multiple of
+ * the allocation alignment and only affects blocks allocated afterwards.
+ *
+ * The size can also be set with the environment variable
+ * CMOCKA_MALLOC_GUARD_SIZE, which takes precedence.
+ *
+ * @param[in]  size  The size of each guard block in bytes, 16 by default.
+ */
+void cmocka_set_malloc_guard_size(size_t size);
+
+/** Memory poisoning modes of the test allocators. */
+enum cm_malloc_poison {
+    /** Fill the whole block on allocation and on free (default). */
+    CM_MALLOC_POISON_FULL = 0,
+    /** Only write the guard blocks. */
+    CM_MALLOC_POISON_GUARDS,
+    /** Only fill the first and last cache line of the block. */
+    CM_MALLOC_POISON_CACHELINE,
+    /** Do not fill the blocks at all. */
+    CM_MALLOC_POISON_OFF,
+};
+
+/**
+ * @brief Set how memory handed out by the test allocators is poisoned.
+ *
+ * By default test_malloc() fills each block with a pattern so that code
+ * relying on uninitialized memory fails, and test_free() fills it with
+ * another pattern to catch use after free. For tests churning large buffers
+ * those fills can dominate the runtime. Guard checking and leak tracking
+ * stay active in every mode.
+ *
+ * The mode can also be set with the environment variable
+ * CMOCKA_MALLOC_POISON to FULL, GUARDS, CACHELINE or OFF, which takes
+ * precedence.
+ *
+ * @param[in]  mode  The poisoning mode from cm_malloc_poison.
+ */
+void cmocka_set_malloc_poison(enum cm_malloc_poison mode);
+
+/**
+ * @brief Keep freed blocks in a quarantine to detect use after free.
+ *
+ * Blocks freed with test_free() are filled with a pattern and held back in a
+ * FIFO instead of being returned to the system, until the total size of the
+ * quarantine exceeds the given budget. When a block leaves the quarantine,
+ * and at the end of each test, it is checked for modifications. A block
+ * written to after it was freed is reported with the location where it was
+ * allocated and where it was freed, and the test fails.
+ *
+ * The budget can also be set with the environment variable
+ * CMOCKA_MALLOC_QUARANTINE, which takes precedence.
+ *
+ * @param[in]  size  The quarantine budget in bytes, 0 (the default) disables
+ *                   the quarantine.
+ */
+void cmocka_set_malloc_quarantine(size_t size);
+
+/**
+ * @brief Record the call stack of allocations.
+ *
+ * The location recorded by test_malloc() is the place where the macro is
+ * expanded, which is always the same line for allocations made by a
+ * wrapper. With backtraces enabled, the call stack of sampled allocations is
+ * captured and shown in leak and corruption reports. Identical call stacks
+ * are stored only once.
+ *
+ * This is only supported on platforms providing backtrace(3). The sample
+ * rate can also be set with the environment variable CMOCKA_MALLOC_BACKTRACE,
+ * which takes precedence.
+ *
+ * @param[in]  sample_rate  Capture the call stack of one out of sample_rate
+ *                          allocations, 1 captures all of them and 0 (the
+ *                          default) disables backtraces.
+ */
+void cmocka_set_malloc_backtrace(unsigned int sample_rate);
+
+/**
+ * @brief Only fully check a sample of the allocations.
+ *
+ * Guard blocks, poisoning, the quarantine, guard pages and backtraces cost
+ * time on every allocation, which adds up for tests making millions of them.
+ * With sampling enabled, only one in period allocations, or one allocation
+ * per bytes allocated, gets these checks. Overflows and use after free of
+ * the other blocks go unnoticed. While the heap profile, a limit, an
+ * allocation region or an allocation budget needs them, they are still
+ * recorded with their allocation site. Otherwise they only get a small header
+ * and are counted: leaks of them are reported as a number of blocks and bytes
+ * without their sites, and freeing one twice is reported as an invalid free.
+ *
+ * The sampling is per thread and deterministic, the same test samples the
+ * same allocations in each run.
+ *
+ * These can also be set with the environment variables CMOCKA_MALLOC_SAMPLE
+ * and CMOCKA_MALLOC_SAMPLE_BYTES, which take precedence.
+ *
+ * @param[in]  period  Fully check one out of period allocations, 0 (the
+ *                     default) disables sampling by count.
+ *
+ * @param[in]  bytes   Fully check one allocation each time this many bytes
+ *                     have been allocated, 0 (the default) disables sampling
+ *                     by size.
+ */
+void cmocka_set_malloc_sampling(size_t period, size_t bytes);
+
+/**
+ * @brief Leave the checks of allocated blocks to a sanitizer.
+ *
+ * When cmocka is built with AddressSanitizer, the guard blocks of
+ * test_malloc() are poisoned with the sanitizer instead of being filled with
+ * a pattern and checked on free, so an overflow is reported at the faulting
+ * access, together with the cmocka allocation site of the block. Blocks are
+ * not filled on allocation and free and the quarantine is not used, as the
+ * sanitizer covers uninitialized reads and use after free itself. With
+ * MemorySanitizer, the fills are skipped as they would hide reads of
+ * uninitialized memory.
+ *
+ * This is enabled by default in sanitizer builds and has no effect
+ * otherwise. Disable it to test the checks of cmocka itself. It can also be
+ * set with the environment variable CMOCKA_MALLOC_SANITIZER, which takes
+ * precedence.
+ *
+ * @param[in]  enable  Zero to use the guard blocks and fills of cmocka.
+ */
+void cmocka_set_malloc_sanitizer(int enable);
+
+/**
+ * @brief List every leaked block in leak reports.
+ *
+ * Blocks leaked by a test are reported grouped by allocation site, and call
+ * stack if backtraces are enabled, with the number of blocks and bytes of
+ * the sites which leaked the most, followed by a summary. With details
+ * enabled, every leaked block is listed in addition, which can be a lot of
+ * output for a test leaking in a loop.
+ *
+ * This can also be enabled with the environment variable
+ * CMOCKA_MALLOC_LEAK_DETAILS=1, which takes precedence.
+ *
+ * @param[in]  enable  Non-zero to list every block, it is disabled by
+ *                     default.
+ */
+void cmocka_set_malloc_leak_details(int enable);
+
+/**
+ * @brief Profile the heap usage of each test.
+ *
+ * For every test, the number of allocations, the total and the peak number
+ * of bytes allocated, a histogram of the allocation sizes in powers of two and
+ * the allocation sites which allocated the most bytes are recorded. The
+ * profile is reported as properties of the test case in the XML output.
+ *
+ * The sites whose blocks were freed the most often are listed as well, to
+ * find code which would benefit from a pool or an arena. For each of them,
+ * the profile shows how many allocations had the size of the block freed
+ * last at the site, the number of reallocations and the longest chain of
+ * reallocations of one block, and the median lifetime of the freed blocks,
+ * measured in allocations made in between.
+ *
+ * Without the profile, allocations are only counted per site while a limit,
+ * an allocation region or an allocation budget needs it, which makes
+ * test_malloc() cheaper.
+ *
+ * This can also be enabled with the environment variable
+ * CMOCKA_HEAP_PROFILE=1, which takes precedence.
+ *
+ * @param[in]  enable  Non-zero to profile the heap, it is disabled by default.
+ */
+void cmocka_set_heap_profile(int enable);
+
+/**
+ * @brief Serve small allocations from slabs.
+ *
+ * Every test_malloc() needs room for the guard blocks and the block header
+ * next to the data. With slabs enabled, blocks of up to 4 KiB including this
+ * overhead are carved from larger chunks in power of two size classes and
+ * freed blocks are cached per thread, instead of going through malloc(3) each
+ * time. A block freed on another thread is handed back to the cache it came
+ * from. The layout of the guard blocks and the header is not changed. The
+ * chunks are released at once at the end of a test group.
+ *
+ * Memory checkers like valgrind don't see the individual blocks in a slab.
+ *
+ * This can also be enabled with the environment variable
+ * CMOCKA_MALLOC_SLAB=1, which takes precedence.
+ *
+ * @param[in]  enable  Non-zero to use slabs, they are disabled by default.
+ */
+void cmocka_set_malloc_slab(int enable);
+
+/**
+ * @brief Allocate the blocks of each test from an arena.
+ *
+ * With the arena enabled, the blocks allocated by a test, its setup and its
+ * teardown are carved one after another from a few large chunks instead of
+ * being registered one by one. Freeing a block only marks it, the leak check
+ * reads the list of blocks kept by the arena and all chunks are released at
+ * once when the test is finished. Blocks of the arena keep their guard
+ * blocks, but they are never served from slabs, placed at guard pages,
+ * sampled or handed to a sanitizer.
+ *
+ * Blocks of a test must not outlive it. Allocate data shared by the tests
+ * of a group in the group setup, which doesn't use the arena. Test groups
+ * running concurrently on different threads each have arenas of their own.
+ *
+ * This can also be enabled with the environment variable
+ * CMOCKA_MALLOC_ARENA=1, which takes precedence.
+ *
+ * @param[in]  enable  Non-zero to use arenas, they are disabled by default.
+ */
+void cmocka_set_malloc_arena(int enable);
+
+/** Placement of allocations next to an inaccessible guard page. */
+enum cm_malloc_page_guard {
+    /** Only use guard blocks (the default). */
+    CM_MALLOC_PAGE_GUARD_OFF = 0,
+    /** End the block at a guard page to catch overflows. */
+    CM_MALLOC_PAGE_GUARD_RIGHT,
+    /** Start the block after a guard page to catch underflows. */
+    CM_MALLOC_PAGE_GUARD_LEFT,
+};
+
+/**
+ * @brief Place large allocations next to an inaccessible guard page.
+ *
+ * Guard blocks are only checked when a block is freed, so an overflow is
+ * reported without the instruction which caused it, and not at all if the
+ * block leaks. In page guard mode each block of at least min_size bytes is
+ * mapped with mmap(2) next to a page which is made inaccessible, so an access
+ * past the end (or before the start) of the block faults immediately. The
+ * test fails with the faulting address and the location where the block was
+ * allocated. Freed blocks are unmapped.
+ *
+ * A right aligned block may be followed by a few bytes of padding to keep it
+ * aligned, these are checked like a guard block when it is freed.
+ *
+ * This is only supported on platforms providing mmap(2). The mode and the
+ * size can also be set with the environment variables
+ * CMOCKA_MALLOC_PAGE_GUARD=RIGHT|LEFT|OFF and
+ * CMOCKA_MALLOC_PAGE_GUARD_MIN_SIZE, which take precedence.
+ *
+ * @param[in]  mode      Where to place the guard page.
+ *
+ * @param[in]  min_size  The smallest allocation to place next to a guard
+ *                       page, as each of them costs at least two pages.
+ */
+void cmocka_set_malloc_page_guard(enum cm_malloc_page_guard mode,
+                                  size_t min_size);
+
+/**
+ * @brief Make the nth allocation of each test fail.
+ *
+ * The nth call to test_malloc(), test_calloc(), test_realloc() or one of the
+ * aligned allocators made by a test function returns NULL, so the handling
+ * of out of memory errors can be tested. Allocations made by setup and
+ * teardown functions are not counted.
+ *
+ * This can also be set with the environment variable CMOCKA_MALLOC_FAIL_NTH,
+ * which takes precedence.
+ *
+ * @param[in]  n  The allocation to fail, counting from 1. 0 (the default)
+ *                disables it.
+ *
+ * @see cmocka_malloc_failure_injected()
+ */
+void cmocka_set_malloc_fail_nth(size_t n);
+
+/**
+ * @brief Make allocations of each test fail at random.
+ *
+ * Each allocation made by a test function fails with the given probability.
+ * The sequence of failures is the same for every test and only depends on
+ * the seed, so a failing test can be reproduced.
+ *
+ * This can also be set with the environment variables
+ * CMOCKA_MALLOC_FAIL_PROBABILITY and CMOCKA_MALLOC_FAIL_SEED, which take
+ * precedence.
+ *
+ * @param[in]  probability  The probability of an allocation to fail, between
+ *                          0.0 (the default) and 1.0.
+ *
+ * @param[in]  seed         The seed of the random sequence.
+ */
+void cmocka_set_malloc_fail_probability(double probability, unsigned int seed);
+
+/**
+ * @brief Check every allocation of each test for out of memory handling.
+ *
+ * After a test passed, it is run again with its first allocation failing,
+ * then with its second allocation failing and so on, until it does not make
+ * that many allocations anymore or max_allocations is reached. The test
+ * fails with the first allocation whose failure made it fail or crash.
+ *
+ * Where fork(2) is available, each run happens in a child process, so a
+ * crash is contained, and as many children as there are processors run in
+ * parallel. Otherwise the runs happen one after the other in the test
+ * process.
+ *
+ * The test has to expect the failures, e.g.:
+ *
+ * @code
+ * static void test_parse(void **state)
+ * {
+ *     struct config *config = NULL;
+ *     int rc;
+ *
+ *     rc = parse_config("a = 1", &config);
+ *     if (rc == ENOMEM && cmocka_malloc_failure_injected()) {
+ *         return;
+ *     }
+ *     assert_int_equal(rc, 0);
+ *     free_config(config);
+ * }
+ * @endcode
+ *
+ * This can also be set with the environment variable
+ * CMOCKA_MALLOC_FAIL_SWEEP, which takes precedence.
+ *
+ * @param[in]  max_allocations  The number of allocations to fail one after
+ *                              the other, 0 (the default) disables the sweep.
+ */
+void cmocka_set_malloc_fail_sweep(size_t max_allocations);
+
+/**
+ * @brief Check whether an allocation of the running test has been failed.
+ *
+ * @return 1 if an allocation was made to fail by cmocka_set_malloc_fail_nth(),
+ *         cmocka_set_malloc_fail_probability() or
+ *         cmocka_set_malloc_fail_sweep(), 0 otherwise.
+ */
+int cmocka_malloc_failure_injected(void);
+
+/**
+ * @brief Limit the number of bytes a test may keep allocated.
+ *
+ * An allocation with test_malloc(), test_calloc(), test_realloc() or one of
+ * the aligned variants which would make the bytes allocated and not yet freed
+ * exceed a limit fails the test right away, at the location of the
+ * allocation, and the sites which allocated the most bytes are listed. This
+ * stops a runaway test before it makes the machine swap.
+ *
+ * The test limit counts the bytes allocated by the test function, the total
+ * limit counts all bytes allocated with cmocka, including those of the group
+ * and test fixtures. In the children of cmocka_set_malloc_fail_sweep(), the
+ * total limit is also applied to the data segment of the process with
+ * setrlimit(2), so memory not allocated through cmocka is capped as well.
+ *
+ * These can also be set with the environment variables
+ * CMOCKA_MALLOC_TEST_LIMIT and CMOCKA_MALLOC_LIMIT, which take precedence.
+ *
+ * @param[in]  test_limit   The maximum bytes allocated by a test, 0 (the
+ *                          default) for no limit.
+ *
+ * @param[in]  total_limit  The maximum bytes allocated overall, 0 (the
+ *                          default) for no limit.
+ */
+void cmocka_set_malloc_limit(size_t test_limit, size_t total_limit);
+
+/**
+ * @brief Start counting the allocations of a region of a test.
+ *
+ * The allocations made with test_malloc(), test_calloc() and test_realloc()
+ * until assert_alloc_region_end() are counted. This can be used to check that
+ * a hot path does not allocate once it has been warmed up.
+ *
+ * @code
+ * lookup(table, "warm up");
+ *
+ * cmocka_alloc_region_begin();
+ * lookup(table, "key");
+ * assert_alloc_region_end(0, 0);
+ * @endcode
+ *
+ * @see assert_alloc_region_end()
+ */
+void cmocka_alloc_region_begin(void);
+
+#ifdef DOXYGEN
+/**
+ * @brief Assert that a region allocated at most the given amount of memory.
+ *
+ * The function ends the region started by cmocka_alloc_region_begin(). If
+ * more allocations or bytes were allocated, it prints an error message listing
+ * the allocation sites of the region to standard error and terminates the
+ * test by calling fail().
+ *
+ * @param[in]  max_allocs  The maximum number of allocations, reallocations
+ *                         are counted as allocations.
+ *
+ * @param[in]  max_bytes   The maximum number of bytes allocated.
+ *
+ * @see cmocka_alloc_region_begin()
+ */
+void assert_alloc_region_end(size_t max_allocs, size_t max_bytes);
+#else
+#define assert_alloc_region_end(max_allocs, max_bytes) \
+    _assert_alloc_region_end(max_allocs, max_bytes, __FILE__, __LINE__)
+#endif
+
 /** @} */
 
 
@@ -2257,12 +2828,23 @@ typedef void (*CMUnitTestFunction)(void **state);
 /* Function prototype for setup and teardown functions. */
 typedef int (*CMFixtureFunction)(void **state);
 
+/* Function prototype for benchmark functions. */
+typedef void (*CMBenchmarkFunction)(void **state, size_t iterations);
+
+/* Allocations a test may make, only the test function itself is counted. */
+struct CMAllocBudget {
+    size_t max_allocs; /* Number of allocations, including reallocations. */
+    size_t max_bytes;  /* Number of bytes allocated. */
+};
+
 struct CMUnitTest {
     const char *name;
     CMUnitTestFunction test_func;
     CMFixtureFunction setup_func;
     CMFixtureFunction teardown_func;
     void *initial_state;
+    const struct CMAllocBudget *alloc_budget;
+    CMBenchmarkFunction benchmark_func;
 };
 
 /* Location within some source code. */
@@ -2436,6 +3018,16 @@ void* _test_realloc(void *ptr, const size_t size, const char* file, const int li
 void* _test_calloc(const size_t number_of_elements, const size_t size,
                    const char* file, const int line);
 void _test_free(void* const ptr, const char* file, const int line);
+void *_test_aligned_alloc(const size_t alignment, const size_t size,
+                          const char *file, const int line);
+int _test_posix_memalign(void **memptr, const size_t alignment,
+                         const size_t size, const char *file, const int line);
+void *_test_memalign(const size_t alignment, const size_t size,
+                     const char *file, const int line);
+void _assert_alloc_region_end(const size_t max_allocs,
+                              const size_t max_bytes,
+                              const char * const file,
+                              const int line);
 
 CMOCKA_NORETURN void _fail(const char * const file, const int line);
 
@@ -2443,6 +3035,8 @@ CMOCKA_NORETURN void _skip(const char * const file, const int line);
 
 CMOCKA_NORETURN void _stop(void);
 
+void _cmocka_do_not_optimize(const volatile void *ptr);
+
 /* Test runner */
 int _cmocka_run_group_tests(const char *group_name,
                             const struct CMUnitTest * const tests,
@@ -2517,6 +3111,178 @@ void cmocka_set_test_filter(const char *pattern);
  */
 void cmocka_set_skip_filter(const char *pattern);
 
+/**
+ * @brief Set the number and the length of the rounds of benchmarks.
+ *
+ * Each benchmark is first calibrated to run enough iterations that a round
+ * takes at least round_time microseconds. It then runs two warm-up rounds
+ * which are not measured, followed by the measured rounds.
+ *
+ * These can also be set with the environment variables
+ * CMOCKA_BENCHMARK_ROUNDS and CMOCKA_BENCHMARK_ROUND_TIME, which take
+ * precedence.
+ *
+ * @param[in]  rounds      The number of measured rounds, 0 keeps the default
+ *                         of 10.
+ *
+ * @param[in]  round_time  The minimum time of a round in microseconds, 0 keeps
+ *                         the default of 10000.
+ *
+ * @see cmocka_unit_benchmark
+ */
+void cmocka_set_benchmark(size_t rounds, size_t round_time);
+
+/**
+ * @brief Compare benchmarks with a baseline and save their results.
+ *
+ * The rounds of each benchmark are compared with the rounds of the same
+ * benchmark of the same group in the baseline file by a one-sided
+ * Mann-Whitney U test. The change of the median and the p-value are added
+ * to the output. A benchmark which is significantly slower, see
+ * cmocka_set_benchmark_threshold(), fails with the slowdown in the error
+ * message. Benchmarks without a baseline are not compared.
+ *
+ * The results of all benchmarks which have run are written to the save file,
+ * replacing its previous content. The baseline and the save file may be the
+ * same file, the baseline is read before the first result is saved.
+ *
+ * These can also be set with the environment variables
+ * CMOCKA_BENCHMARK_BASELINE and CMOCKA_BENCHMARK_SAVE, which take
+ * precedence.
+ *
+ * @param[in]  baseline_file  The file to compare with or NULL (the default).
+ *
+ * @param[in]  save_file      The file to save the results to or NULL (the
+ *                            default).
+ */
+void cmocka_set_benchmark_baseline(const char *baseline_file,
+                                   const char *save_file);
+
+/**
+ * @brief Set when a slowdown against the baseline fails a benchmark.
+ *
+ * A benchmark fails if its rounds are slower than the baseline with a
+ * p-value below alpha and its median is slower by more than the relative
+ * slowdown. The slowdown keeps changes which are consistent but too small to
+ * matter from failing the test.
+ *
+ * These can also be set with the environment variables
+ * CMOCKA_BENCHMARK_ALPHA and CMOCKA_BENCHMARK_SLOWDOWN, which take
+ * precedence.
+ *
+ * @param[in]  alpha     The significance level, 0.01 by default.
+ *
+ * @param[in]  slowdown  The relative slowdown of the median, 0.05 (5%) by
+ *                       default.
+ */
+void cmocka_set_benchmark_threshold(double alpha, double slowdown);
+
+/** Hardware performance counters, see cmocka_set_perf_counters(). */
+enum cm_perf_counter {
+    /** CPU cycles. */
+    CM_PERF_CYCLES = 0,
+    /** Retired instructions. */
+    CM_PERF_INSTRUCTIONS,
+    /** Mispredicted branches. */
+    CM_PERF_BRANCH_MISSES,
+    /** Level 1 data cache read misses. */
+    CM_PERF_L1D_MISSES,
+    /** Last level cache misses. */
+    CM_PERF_LLC_MISSES,
+};
+
+/**
+ * @brief Count hardware events of each test.
+ *
+ * The counters of enum cm_perf_counter are opened as a group with
+ * perf_event_open(2) around each test function, without its setup and
+ * teardown. Only user space events of the thread running the test are
+ * counted. If the counters had to share the hardware with other events, the
+ * counts are scaled up to the full run time of the test.
+ *
+ * The counts are added as perf.* properties of the test case to the XML
+ * output. Counters which are not available, e.g. in containers, virtual
+ * machines or on other systems than Linux, are left out without an error.
+ *
+ * This can also be enabled with the environment variable
+ * CMOCKA_PERF_COUNTERS=1, which takes precedence.
+ *
+ * @param[in]  enable  Non-zero to count events, it is disabled by default.
+ *
+ * @see assert_perf_counter_below()
+ */
+void cmocka_set_perf_counters(int enable);
+
+/**
+ * @brief Report the resources used by each test.
+ *
+ * The resource usage is sampled with getrusage(2) before the setup and after
+ * the teardown of each test. The user and system CPU time, the growth of the
+ * maximum resident set size, the minor and major page faults and the
+ * voluntary and involuntary context switches are added as rusage.*
+ * properties of the test case to the XML output. Where possible only the
+ * thread running the test is sampled, otherwise the whole process.
+ *
+ * This can also be enabled with the environment variable
+ * CMOCKA_RESOURCE_USAGE=1, which takes precedence.
+ *
+ * @param[in]  enable  Non-zero to report the resource usage, it is disabled
+ *                     by default.
+ */
+void cmocka_set_resource_usage(int enable);
+
+/**
+ * @brief Report the time spent in each phase of the tests.
+ *
+ * The time of each test is split into its setup, the test function, the
+ * verification after them (the leak check and the check for leftover
+ * expectations) and its teardown. The phases are printed after each test and
+ * added as time.* properties of the test case to the XML output. The time of
+ * the group setup and teardown is reported with the wall time of the group.
+ *
+ * All times are taken from a monotonic clock. The time of a test case in the
+ * XML output is its wall time including its fixtures, the time of a test
+ * suite is the wall time of the whole group.
+ *
+ * This can also be enabled with the environment variable
+ * CMOCKA_PHASE_TIMES=1, which takes precedence.
+ *
+ * @param[in]  enable  Non-zero to report the phases, it is disabled by
+ *                     default.
+ */
+void cmocka_set_phase_times(int enable);
+
+#ifdef DOXYGEN
+/**
+ * @brief Assert that a hardware counter of the running test is below a limit.
+ *
+ * The counter holds the events since the test function started. This passes
+ * if the counter is not available, see cmocka_set_perf_counters().
+ *
+ * @code
+ * static void test_parse(void **state)
+ * {
+ *     parse(*state);
+ *
+ *     assert_perf_counter_below(CM_PERF_INSTRUCTIONS, 100000);
+ * }
+ * @endcode
+ *
+ * @param[in]  counter  The counter of enum cm_perf_counter to check.
+ *
+ * @param[in]  max      The count which must not be reached.
+ */
+void assert_perf_counter_below(enum cm_perf_counter counter, uint64_t max);
+#else
+void _assert_perf_counter_below(enum cm_perf_counter counter,
+                                const char *counter_name,
+                                uint64_t max,
+                                const char * const file,
+                                const int line);
+#define assert_perf_counter_below(counter, max) \
+    _assert_perf_counter_below((counter), #counter, (max), __FILE__, __LINE__)
+#endif
+
 /** @} */
 
 #endif /* CMOCKA_H_ */
@@ -35,6 +35,37 @@
 #include <strings.h>
 #endif
 
+#ifdef HAVE_EXECINFO_H
+#include <execinfo.h>
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_SYS_RESOURCE_H
+#include <sys/resource.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef HAVE_SYS_WAIT_H
+#include <sys/wait.h>
+#endif
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+#include <errno.h>
 #include <stdint.h>
 #include <setjmp.h>
 #include <stdarg.h>
@@ -63,17 +94,95 @@
 #include <cmocka.h>
 #include <cmocka_private.h>
 
-/* Size of guard bytes around dynamically allocated blocks. */
+/* Builds instrumented by AddressSanitizer or MemorySanitizer. */
+#if defined(__has_feature)
+# if __has_feature(address_sanitizer)
+#  define CMOCKA_ASAN 1
+# endif
+# if __has_feature(memory_sanitizer)
+#  define CMOCKA_MSAN 1
+# endif
+#endif
+#if defined(__SANITIZE_ADDRESS__) && !defined(CMOCKA_ASAN)
+# define CMOCKA_ASAN 1
+#endif
+
+#ifdef CMOCKA_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+
+/* Hardware performance counters through perf_event_open(2). */
+#if defined(HAVE_LINUX_PERF_EVENT_H) && defined(SYS_perf_event_open)
+# define CMOCKA_PERF 1
+#endif
+
+/* Initial number of slots of the allocated blocks table. */
+#define MALLOC_TABLE_MIN_SIZE 64
+/*
+ * Number of shards of the allocated blocks registry, each with its own lock.
+ * NOTE: This must be 2^MALLOC_SHARD_BITS and match global_malloc_shards.
+ */
+#define MALLOC_SHARD_BITS 4
+#define MALLOC_SHARDS (1 << MALLOC_SHARD_BITS)
+
+/* Default size of guard bytes around dynamically allocated blocks. */
 #define MALLOC_GUARD_SIZE 16
+/* Upper limit for cmocka_set_malloc_guard_size(). */
+#define MALLOC_GUARD_SIZE_MAX 4096
 /* Pattern used to initialize guard blocks. */
 #define MALLOC_GUARD_PATTERN 0xEF
 /* Pattern used to initialize memory allocated with test_malloc(). */
 #define MALLOC_ALLOC_PATTERN 0xBA
 #define MALLOC_FREE_PATTERN 0xCD
+/* Bytes filled at each end of a block by CM_MALLOC_POISON_CACHELINE. */
+#define MALLOC_POISON_CACHELINE_SIZE 64
+/* Maximum number of frames recorded for the call stack of a block. */
+#define MALLOC_BACKTRACE_DEPTH 16
+/* Initial number of slots of the call stack table. */
+#define MALLOC_STACK_TABLE_MIN_SIZE 64
+/* Initial number of slots of the allocation site table. */
+#define MALLOC_SITE_TABLE_MIN_SIZE 64
+/* Number of allocation sites listed in a heap profile. */
+#define MALLOC_PROFILE_TOP_SITES 5
+/* Number of allocation sites listed in a leak report. */
+#define MALLOC_LEAK_TOP_SITES 10
+/* Number of power of two buckets of the allocation size histogram. */
+#define MALLOC_PROFILE_BUCKETS (sizeof(size_t) * 8 + 1)
+/* Number of power of two buckets of the block lifetime histogram. */
+#define MALLOC_LIFETIME_BUCKETS 16
+/* Blocks served by the slab allocator, from 64 (2^6) to 4096 (2^12) bytes. */
+#define MALLOC_SLAB_MIN_SHIFT 6
+#define MALLOC_SLAB_MAX_SHIFT 12
+#define MALLOC_SLAB_CLASSES (MALLOC_SLAB_MAX_SHIFT - MALLOC_SLAB_MIN_SHIFT + 1)
+/* Size of the chunks slabs are carved from. */
+#define MALLOC_SLAB_CHUNK_SIZE (64 * 1024)
+/* Size of the first and the largest chunk of a test arena, sizes double. */
+#define MALLOC_ARENA_MIN_CHUNK_SIZE (64 * 1024)
+#define MALLOC_ARENA_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+/* Maximum number of forked children of an allocation failure sweep. */
+#define MALLOC_FAIL_SWEEP_MAX_JOBS 64
 /* Alignment of allocated blocks.  NOTE: This must be base2. */
 #ifndef MALLOC_ALIGNMENT
 #define MALLOC_ALIGNMENT sizeof(size_t)
 #endif
+/* Mark the header of an allocated and of a freed thin block. */
+#define MALLOC_THIN_TAG ((uintptr_t)UINT64_C(0x5A17C0DE7E1B10C5))
+#define MALLOC_THIN_FREED_TAG ((uintptr_t)UINT64_C(0xF4EEDB10C5A17C0D))
+/* Chunks are found by windows of 2^MALLOC_CHUNK_WINDOW_SHIFT bytes. */
+#define MALLOC_CHUNK_WINDOW_SHIFT 16
+/* Initial number of slots of the chunk map. */
+#define MALLOC_CHUNK_MAP_MIN_SIZE 64
+/* Window of a removed chunk in the chunk map, no window numbers reach it. */
+#define MALLOC_CHUNK_REMOVED UINTPTR_MAX
+/*
+ * Thin blocks are told apart by reading the bytes before a pointer, which
+ * MemorySanitizer reports for blocks of other allocators.
+ */
+#ifdef CMOCKA_MSAN
+#define MALLOC_THIN_ENABLED 0
+#else
+#define MALLOC_THIN_ENABLED 1
+#endif
 
 /* Printf formatting for source code locations. */
 #define SOURCE_LOCATION_FORMAT "%s:%u"
@@ -86,16 +195,53 @@
 # define CMOCKA_THREAD
 #endif
 
-#ifdef HAVE_CLOCK_REALTIME
-#define CMOCKA_CLOCK_GETTIME(clock_id, ts) clock_gettime((clock_id), (ts))
+/*
+ * Locks of the allocation tracking, which is shared by all threads. Without
+ * thread support they compile to nothing.
+ */
+#if defined(_WIN32)
+# define CMOCKA_MUTEX SRWLOCK
+# define CMOCKA_MUTEX_INITIALIZER SRWLOCK_INIT
+# define CMOCKA_MUTEX_INIT(m) InitializeSRWLock(m)
+# define CMOCKA_MUTEX_DESTROY(m) (void)(m)
+# define CMOCKA_MUTEX_LOCK(m) AcquireSRWLockExclusive(m)
+# define CMOCKA_MUTEX_UNLOCK(m) ReleaseSRWLockExclusive(m)
+#elif defined(HAVE_PTHREAD_H)
+# define CMOCKA_MUTEX pthread_mutex_t
+# define CMOCKA_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+# define CMOCKA_MUTEX_INIT(m) pthread_mutex_init(m, NULL)
+# define CMOCKA_MUTEX_DESTROY(m) pthread_mutex_destroy(m)
+# define CMOCKA_MUTEX_LOCK(m) pthread_mutex_lock(m)
+# define CMOCKA_MUTEX_UNLOCK(m) pthread_mutex_unlock(m)
+#else
+# define CMOCKA_MUTEX int
+# define CMOCKA_MUTEX_INITIALIZER 0
+# define CMOCKA_MUTEX_INIT(m) (void)(m)
+# define CMOCKA_MUTEX_DESTROY(m) (void)(m)
+# define CMOCKA_MUTEX_LOCK(m) (void)(m)
+# define CMOCKA_MUTEX_UNLOCK(m) (void)(m)
+#endif
+
+/*
+ * Flags and pointers also read without the lock protecting them. Without the
+ * GCC builtins a plain access is used.
+ */
+#ifdef __GNUC__
+# define CMOCKA_ATOMIC_LOAD(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+# define CMOCKA_ATOMIC_STORE(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
 #else
-#define CMOCKA_CLOCK_GETTIME(clock_id, ts)
+# define CMOCKA_ATOMIC_LOAD(p) (*(p))
+# define CMOCKA_ATOMIC_STORE(p, v) (*(p) = (v))
 #endif
 
 #ifndef MAX
 #define MAX(a,b) ((a) < (b) ? (b) : (a))
 #endif
 
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
 /**
  * POSIX has sigsetjmp/siglongjmp, while Windows only has setjmp/longjmp.
  */
@@ -135,8 +281,30 @@ struct MallocBlockInfoData {
     void* block;              /* Address of the block returned by malloc(). */
     size_t allocated_size;    /* Total size of the allocated block. */
     size_t size;              /* Request block size. */
+    size_t guard_size;        /* Size of the guard block before the data. */
+    size_t tail_guard_size;   /* Size of the guard block after the data. */
+    size_t alignment;         /* Alignment of the returned pointer. */
     SourceLocation location;  /* Where the block was allocated. */
-    ListNode node;            /* Node within list of all allocated blocks. */
+    SourceLocation free_location; /* Where the block was freed. */
+    size_t stack;             /* Index of the allocation call stack or 0. */
+    struct MallocRun *run;    /* Run of the test group owning the block. */
+    size_t site;              /* Index of the allocation site or 0. */
+    uint64_t serial;          /* Allocation order, see check points. */
+    size_t arena_index;       /* Position in the blocks of the arena. */
+    size_t reallocs;          /* Number of times the block was resized. */
+    int slab_class;           /* Slab size class or -1 if from malloc(). */
+    struct MallocSlabCache *slab_cache; /* Slab cache the block came from. */
+    enum cm_malloc_page_guard page_guard; /* Placement next to a guard page. */
+    bool sampled;             /* Has guards and poisoning, see sampling. */
+    bool sanitized;           /* Guards left to the sanitizer, no fills. */
+    bool arena;               /* Carved from the arena of the test. */
+    bool arena_freed;         /* Freed, the arena reclaims it at once. */
+    bool accounted;           /* Counted in the heap counters of its run. */
+    /*
+     * Node within the blocks of the run, or the quarantine once freed. The
+     * arena keeps track of its blocks itself.
+     */
+    ListNode node;
 };
 
 typedef union {
@@ -144,9 +312,264 @@ typedef union {
     char *ptr;
 } MallocBlockInfo;
 
+/*
+ * Slot of the table indexing the blocks returned by test_malloc(). A slot
+ * with a NULL ptr is empty, a slot with a NULL data keeps the record of a
+ * freed block so a double free can be reported.
+ */
+typedef struct MallocBlockEntry {
+    const void *ptr;                   /* Pointer returned by test_malloc(). */
+    struct MallocBlockInfoData *data;  /* NULL once the block is freed. */
+    SourceLocation location;           /* Where the block was allocated. */
+    SourceLocation free_location;      /* Where the block was freed. */
+    bool quarantined;                  /* Freed, the memory is still held. */
+} MallocBlockEntry;
+
+/* Open addressing hash table of MallocBlockEntry, keyed by pointer. */
+typedef struct MallocBlockTable {
+    MallocBlockEntry *entries;
+    size_t size;  /* Number of slots, always a power of 2. */
+    size_t used;  /* Slots holding a live or a freed block. */
+    size_t live;  /* Slots holding a live block. */
+} MallocBlockTable;
+
+/* Shard of the registry of allocated blocks. */
+typedef struct MallocShard {
+    CMOCKA_MUTEX lock;
+    MallocBlockTable table;
+} MallocShard;
+
+/* Call stack captured when a block was allocated. */
+typedef struct MallocStack {
+    uint32_t hash;
+    unsigned int depth;
+    void *frames[MALLOC_BACKTRACE_DEPTH];
+} MallocStack;
+
+/*
+ * Interned call stacks. Blocks refer to a stack by its index, identical
+ * stacks are stored only once. Index 0 is reserved for "no stack".
+ */
+typedef struct MallocStackTable {
+    MallocStack *stacks;
+    size_t count;
+    size_t capacity;
+    size_t *slots;  /* Open addressing index of stacks, 0 is empty. */
+    size_t size;    /* Number of slots, always a power of 2. */
+} MallocStackTable;
+
+/* Allocation site, a source location and optionally a call stack. */
+typedef struct MallocSite {
+    SourceLocation location;
+    size_t stack;
+    uint32_t hash;
+    size_t allocations;  /* Allocations made by the current test. */
+    size_t bytes;        /* Bytes allocated by the current test. */
+    size_t region_allocations;  /* Allocations made in the current region. */
+    size_t region_bytes;        /* Bytes allocated in the current region. */
+    size_t leaked_blocks;       /* Scratch counters of a leak report. */
+    size_t leaked_bytes;
+    size_t frees;               /* Blocks freed by the current test. */
+    size_t same_size_pairs;     /* Allocations of the size freed last. */
+    size_t last_free_size;
+    size_t reallocs;            /* Reallocations made by the current test. */
+    size_t longest_realloc_chain;
+    /*
+     * Freed blocks by lifetime, counted in allocations made in between.
+     * Bucket n counts lifetimes in [2^(n-1), 2^n), the last one the rest.
+     */
+    size_t lifetimes[MALLOC_LIFETIME_BUCKETS];
+} MallocSite;
+
+/* Interned allocation sites, blocks refer to a site by its index. */
+typedef struct MallocSiteTable {
+    MallocSite *sites;
+    size_t count;
+    size_t capacity;
+    size_t *slots;  /* Open addressing index of sites, 0 is empty. */
+    size_t size;    /* Number of slots, always a power of 2. */
+} MallocSiteTable;
+
+/* Allocation site listed in a heap profile. */
+typedef struct MallocProfileSite {
+    SourceLocation location;
+    size_t allocations;
+    size_t bytes;
+} MallocProfileSite;
+
+/* Allocation site listed for the churn of its blocks in a heap profile. */
+typedef struct MallocChurnSite {
+    SourceLocation location;
+    size_t allocations;
+    size_t frees;
+    size_t same_size_pairs;
+    size_t reallocs;
+    size_t longest_realloc_chain;
+    size_t median_lifetime;  /* Upper bound of the median lifetime bucket. */
+} MallocChurnSite;
+
+/* Memory cmocka carves blocks from, see malloc_chunk_find(). */
+typedef struct MallocChunk {
+    const char *start;
+    const char *end;
+    struct MallocRun *arena_run;  /* Run of the arena, NULL for a slab. */
+    uint64_t arena_serial;        /* Which arena of the run, see MallocArena. */
+} MallocChunk;
+
+/* Chunk overlapping a window of memory. */
+typedef struct MallocChunkSlot {
+    uintptr_t window;  /* Window number plus one, 0 for an empty slot. */
+    MallocChunk chunk;
+} MallocChunkSlot;
+
+/*
+ * Open addressing index of all chunks by the windows they overlap. It is
+ * read without a lock: a slot is never reused once its chunk is removed, and
+ * a full map is replaced by a larger one and kept for readers which may still
+ * use it. Readers never touch the memory of a chunk through the map.
+ */
+typedef struct MallocChunkMap {
+    MallocChunkSlot *slots;
+    size_t size;       /* Number of slots, always a power of 2. */
+    size_t used;       /* Slots which are not empty, removed ones included. */
+    size_t live;
+    struct MallocChunkMap *replaced;
+} MallocChunkMap;
+
+/* Chunk of memory the blocks of a test arena are carved from. */
+typedef struct MallocArenaChunk {
+    struct MallocArenaChunk *next;
+    char *used;  /* End of the blocks carved so far. */
+    MallocChunk range;
+} MallocArenaChunk;
+
+/* Blocks of a test, dropped at once at its end, see MallocRun. */
+typedef struct MallocArena {
+    bool active;
+    uint64_t serial;            /* Number of arenas started in the run. */
+    size_t guard_size;          /* Guard size of all blocks of the arena. */
+    MallocArenaChunk *chunks;   /* The newest chunk first. */
+    size_t chunk_size;          /* Size of the newest regular chunk. */
+    /* All blocks in allocation order, see malloc_arena_realloc(). */
+    struct MallocBlockInfoData **blocks;
+    size_t num_blocks;
+    size_t max_blocks;
+} MallocArena;
+
+/* What a test did to the heap. */
+typedef struct MallocProfile {
+    size_t allocations;   /* Number of allocations. */
+    size_t total_bytes;   /* Sum of the allocated sizes. */
+    size_t peak_bytes;    /* Peak of the bytes allocated and not yet freed. */
+    /* Allocations by size, bucket n counts sizes in [2^(n-1), 2^n). */
+    size_t histogram[MALLOC_PROFILE_BUCKETS];
+    MallocProfileSite top_sites[MALLOC_PROFILE_TOP_SITES];
+    size_t num_top_sites;
+    /* Sites freeing the most blocks, candidates for pooling. */
+    MallocChurnSite churn_sites[MALLOC_PROFILE_TOP_SITES];
+    size_t num_churn_sites;
+} MallocProfile;
+
+/* Chunk of memory a slab size class is carved from. */
+typedef struct MallocSlabChunk {
+    struct MallocSlabChunk *next;
+    MallocChunk range;
+} MallocSlabChunk;
+
+/*
+ * Slab cache of a thread, see malloc_slab_cache(). Only the owning thread
+ * touches the first part, blocks freed by other threads are queued in the
+ * remote lists until the owner takes them back.
+ */
+typedef struct MallocSlabCache {
+    void *free_list[MALLOC_SLAB_CLASSES]; /* Freed blocks of each class. */
+    char *next[MALLOC_SLAB_CLASSES];      /* Unused part of the last chunk. */
+    char *end[MALLOC_SLAB_CLASSES];
+    MallocSlabChunk *chunks;               /* All chunks. */
+    size_t live;                           /* Blocks not handed back. */
+    CMOCKA_MUTEX remote_lock;
+    void *remote_list[MALLOC_SLAB_CLASSES];
+    size_t remote_count[MALLOC_SLAB_CLASSES];
+    bool orphaned;                         /* The owning thread has exited. */
+    struct MallocSlabCache *next_cache;    /* See global_malloc_slab_caches. */
+} MallocSlabCache;
+
+/*
+ * Header of an unsampled block nothing needs to look up, right before the
+ * pointer handed out, see malloc_thin_alloc(). Such a block is only counted
+ * by its run.
+ */
+typedef struct MallocThinHeader {
+    struct MallocRun *run;
+    MallocSlabCache *slab_cache;
+    size_t size;
+    int slab_class;
+    uintptr_t tag;  /* The pointer xor MALLOC_THIN_TAG while allocated. */
+} MallocThinHeader;
+
+/*
+ * Blocks, allocation sites and heap counters of one run of a test group, see
+ * malloc_run(). Groups running concurrently don't see each other's blocks.
+ */
+typedef struct MallocRun {
+    /* Protects all but the quarantine and the thin counters. */
+    CMOCKA_MUTEX lock;
+    struct MallocRun *parent;        /* Run of the thread before this one. */
+    struct MallocRun *older;         /* See global_malloc_newest_run. */
+    uint64_t serial;                 /* Serial number of the last block. */
+    ListNode blocks;                 /* Live blocks in allocation order. */
+    MallocSiteTable sites;
+    MallocProfile profile;           /* Heap counters of the running test. */
+    /* Bytes allocated and not yet freed, and their peak in the test. */
+    size_t live_bytes;
+    size_t peak_bytes;
+    size_t profile_start_bytes;
+    /*
+     * Allocations made since cmocka_alloc_region_begin(). The flag is also
+     * read without the lock, see malloc_run_accounting(), as is budget_active.
+     */
+    bool region_active;
+    size_t region_allocations;
+    size_t region_bytes;
+    bool limit_armed;
+    bool budget_active;              /* The test has an allocation budget. */
+    /* FIFO of freed blocks held back from libc to detect use after free. */
+    CMOCKA_MUTEX quarantine_lock;
+    ListNode quarantine;
+    size_t quarantine_bytes;
+    size_t quarantine_count;
+    /*
+     * Bytes of the live blocks of the arena, and of those counted in
+     * live_bytes. They are released along with the arena.
+     */
+    size_t arena_bytes;
+    size_t arena_accounted_bytes;
+    /* Arena of the running test of the group, see malloc_arena_begin(). */
+    CMOCKA_MUTEX arena_lock;
+    MallocArena arena;
+    /*
+     * References to the run, updated atomically: one of its test group until
+     * malloc_run_end() and one of each thin block. The last one releases it.
+     */
+    size_t refs;
+    size_t thin_bytes;               /* Bytes of the thin blocks. */
+    /* Leaked thin blocks already reported, they can't be freed. */
+    size_t thin_forgotten_blocks;
+    size_t thin_forgotten_bytes;
+} MallocRun;
+
+/* Heap state of a run, see check_point_allocated_blocks(). */
+typedef struct MallocCheckPoint {
+    uint64_t serial;
+    uint64_t arena_serial;
+    size_t arena_blocks;
+    size_t thin_blocks;
+    size_t thin_bytes;
+} MallocCheckPoint;
+
 /* State of each test. */
 typedef struct TestState {
-    const ListNode *check_point; /* Check point of the test if there's a */
+    MallocCheckPoint check_point; /* Check point of the test if there's a */
                                  /* setup function. */
     void *state;                 /* State associated with the test. */
 } TestState;
@@ -252,6 +675,15 @@ static void teardown_testing(const char *test_name);
 
 static uint32_t cm_get_output(void);
 
+/*
+ * Allocate from the C library. These bypass the test_malloc() bookkeeping and
+ * the __wrap_malloc() interposition.
+ */
+static void *libc_malloc(size_t size);
+static void *libc_calloc(size_t nmemb, size_t size);
+static void libc_free(void *ptr);
+static void *libc_realloc(void *ptr, size_t size);
+
 static int cm_error_message_enabled = 1;
 static CMOCKA_THREAD char *cm_error_message;
 
@@ -287,15 +719,291 @@ static CMOCKA_THREAD ListNode global_call_ordering_head;
 /* Location of last call ordering that was declared. */
 static CMOCKA_THREAD SourceLocation global_last_call_ordering_location;
 
-/* List of all currently allocated blocks. */
-static CMOCKA_THREAD ListNode global_allocated_blocks;
+/*
+ * Registry of all currently allocated blocks, shared by all threads. It is
+ * sharded by address, a block lives in the shard picked by malloc_shard().
+ */
+#define MALLOC_SHARD_INITIALIZER { .lock = CMOCKA_MUTEX_INITIALIZER }
+#define MALLOC_SHARD_INITIALIZER_4 \
+    MALLOC_SHARD_INITIALIZER, MALLOC_SHARD_INITIALIZER, \
+    MALLOC_SHARD_INITIALIZER, MALLOC_SHARD_INITIALIZER
+static MallocShard global_malloc_shards[MALLOC_SHARDS] = {
+    MALLOC_SHARD_INITIALIZER_4, MALLOC_SHARD_INITIALIZER_4,
+    MALLOC_SHARD_INITIALIZER_4, MALLOC_SHARD_INITIALIZER_4,
+};
+
+/* Run of the test group of this thread, NULL for threads started by a test. */
+static CMOCKA_THREAD MallocRun *global_malloc_run;
+/* Runs of the test groups in progress, linked from the newest one. */
+static CMOCKA_MUTEX global_malloc_runs_lock = CMOCKA_MUTEX_INITIALIZER;
+static MallocRun *global_malloc_newest_run;
+/* Run of the blocks allocated outside of any test group. */
+static MallocRun global_malloc_root_run = {
+    .lock = CMOCKA_MUTEX_INITIALIZER,
+    .blocks = {
+        .next = &global_malloc_root_run.blocks,
+        .prev = &global_malloc_root_run.blocks,
+    },
+    .quarantine_lock = CMOCKA_MUTEX_INITIALIZER,
+    .arena_lock = CMOCKA_MUTEX_INITIALIZER,
+    .refs = 1,
+    .quarantine = {
+        .next = &global_malloc_root_run.quarantine,
+        .prev = &global_malloc_root_run.quarantine,
+    },
+};
+
+/* Bytes allocated and not yet freed by all runs, see malloc_total_bytes(). */
+static size_t global_malloc_total_bytes;
+#ifndef __GNUC__
+/* Protects the counters updated with malloc_counter_add(). */
+static CMOCKA_MUTEX global_malloc_counter_lock = CMOCKA_MUTEX_INITIALIZER;
+#endif
+
+/* Call stacks of sampled allocations, shared by all runs. */
+static CMOCKA_MUTEX global_malloc_stack_lock = CMOCKA_MUTEX_INITIALIZER;
+static MallocStackTable global_malloc_stacks;
+static CMOCKA_THREAD unsigned int global_malloc_backtrace_countdown;
+
+/* Allocations and bytes left until the next fully tracked allocation. */
+static CMOCKA_THREAD size_t global_malloc_sample_countdown;
+static CMOCKA_THREAD size_t global_malloc_sample_bytes_left;
+
+/* Allocations of the running test, counted to decide which ones to fail. */
+static CMOCKA_THREAD bool global_malloc_fail_armed;
+static CMOCKA_THREAD size_t global_malloc_fail_count;
+static CMOCKA_THREAD bool global_malloc_fail_injected;
+static CMOCKA_THREAD uint64_t global_malloc_fail_random;
+
+/* Chunks of the slabs, looked up by any thread without a lock. */
+static CMOCKA_MUTEX global_malloc_chunk_lock = CMOCKA_MUTEX_INITIALIZER;
+static MallocChunkMap *global_malloc_chunk_map;
+
+/* Slab caches of all threads, a block may be freed by any thread. */
+static CMOCKA_MUTEX global_malloc_slab_lock = CMOCKA_MUTEX_INITIALIZER;
+static MallocSlabCache *global_malloc_slab_caches;
+static CMOCKA_THREAD MallocSlabCache *global_malloc_slab_cache;
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+static pthread_once_t global_malloc_slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t global_malloc_slab_key;
+#endif
+
+/* Limits of the bytes allocated by a test and overall, 0 for none. */
+static size_t global_malloc_test_limit;
+static size_t global_malloc_total_limit;
+
+/*
+ * Nesting depth of libc_*() calls, see __wrap_malloc(). This is volatile as
+ * the compiler assumes malloc() and free() don't look at it.
+ */
+static CMOCKA_THREAD volatile unsigned int global_malloc_wrap_depth;
 
 static uint32_t global_msg_output = CM_OUTPUT_STANDARD;
 
+static size_t global_malloc_guard_size = MALLOC_GUARD_SIZE;
+
+static enum cm_malloc_poison global_malloc_poison = CM_MALLOC_POISON_FULL;
+
+static size_t global_malloc_quarantine_size;
+
+static unsigned int global_malloc_backtrace_rate;
+
+static bool global_malloc_sanitizer = true;
+
+/* Fully track one in this many allocations or one per this many bytes. */
+static size_t global_malloc_sample_period;
+static size_t global_malloc_sample_bytes;
+
+static bool global_malloc_profile_enabled;
+
+static bool global_malloc_slab_enabled;
+
+static bool global_malloc_arena_enabled;
+
+static enum cm_malloc_page_guard global_malloc_page_guard;
+static size_t global_malloc_page_guard_min_size;
+
+static bool global_malloc_leak_details;
+
+/* Allocation failure injection, see cmocka_set_malloc_fail_nth(). */
+static size_t global_malloc_fail_nth;
+static double global_malloc_fail_probability;
+static unsigned int global_malloc_fail_seed;
+static size_t global_malloc_fail_sweep;
+
+/* Measured rounds of benchmarks and their minimum time in microseconds. */
+static size_t global_benchmark_rounds;
+static size_t global_benchmark_round_time;
+
+static bool global_perf_counters_enabled;
+
+static bool global_resource_usage_enabled;
+
+static bool global_phase_times_enabled;
+
+/* Baseline of benchmarks and when a slowdown against it fails the test. */
+static const char *global_benchmark_baseline_file;
+static const char *global_benchmark_save_file;
+static double global_benchmark_alpha = 0.01;
+static double global_benchmark_slowdown = 0.05;
+
 static const char *global_test_filter_pattern;
 
 static const char *global_skip_filter_pattern;
 
+/*
+ * Settings which can be given in the environment. A variable which is set
+ * takes precedence over the setter of its setting, see cm_load_env().
+ */
+enum cm_env_setting {
+    CM_ENV_MALLOC_GUARD_SIZE = 0,
+    CM_ENV_MALLOC_POISON,
+    CM_ENV_MALLOC_SANITIZER,
+    CM_ENV_MALLOC_QUARANTINE,
+    CM_ENV_MALLOC_SLAB,
+    CM_ENV_MALLOC_PAGE_GUARD,
+    CM_ENV_MALLOC_PAGE_GUARD_MIN_SIZE,
+    CM_ENV_MALLOC_BACKTRACE,
+    CM_ENV_MALLOC_SAMPLE,
+    CM_ENV_MALLOC_SAMPLE_BYTES,
+    CM_ENV_MALLOC_TEST_LIMIT,
+    CM_ENV_MALLOC_LIMIT,
+    CM_ENV_MALLOC_FAIL_NTH,
+    CM_ENV_MALLOC_FAIL_PROBABILITY,
+    CM_ENV_MALLOC_FAIL_SEED,
+    CM_ENV_MALLOC_FAIL_SWEEP,
+    CM_ENV_MALLOC_ARENA,
+    CM_ENV_MALLOC_LEAK_DETAILS,
+    CM_ENV_HEAP_PROFILE,
+    CM_ENV_PERF_COUNTERS,
+    CM_ENV_RESOURCE_USAGE,
+    CM_ENV_PHASE_TIMES,
+    CM_ENV_BENCHMARK_ROUNDS,
+    CM_ENV_BENCHMARK_ROUND_TIME,
+    CM_ENV_BENCHMARK_BASELINE,
+    CM_ENV_BENCHMARK_SAVE,
+    CM_ENV_BENCHMARK_ALPHA,
+    CM_ENV_BENCHMARK_SLOWDOWN,
+    CM_ENV_SETTINGS
+};
+
+/* How the value of an environment variable is parsed. */
+enum cm_env_type {
+    CM_ENV_TYPE_SIZE,
+    CM_ENV_TYPE_UINT,
+    CM_ENV_TYPE_BOOL,
+    CM_ENV_TYPE_DOUBLE,
+    CM_ENV_TYPE_STRING,
+    CM_ENV_TYPE_POISON,
+    CM_ENV_TYPE_PAGE_GUARD,
+};
+
+static const struct {
+    const char *name;
+    enum cm_env_type type;
+    void *value;
+} cm_env_settings[CM_ENV_SETTINGS] = {
+    [CM_ENV_MALLOC_GUARD_SIZE] = {
+        "CMOCKA_MALLOC_GUARD_SIZE", CM_ENV_TYPE_SIZE,
+        &global_malloc_guard_size },
+    [CM_ENV_MALLOC_POISON] = {
+        "CMOCKA_MALLOC_POISON", CM_ENV_TYPE_POISON,
+        &global_malloc_poison },
+    [CM_ENV_MALLOC_SANITIZER] = {
+        "CMOCKA_MALLOC_SANITIZER", CM_ENV_TYPE_BOOL,
+        &global_malloc_sanitizer },
+    [CM_ENV_MALLOC_QUARANTINE] = {
+        "CMOCKA_MALLOC_QUARANTINE", CM_ENV_TYPE_SIZE,
+        &global_malloc_quarantine_size },
+    [CM_ENV_MALLOC_SLAB] = {
+        "CMOCKA_MALLOC_SLAB", CM_ENV_TYPE_BOOL,
+        &global_malloc_slab_enabled },
+    [CM_ENV_MALLOC_PAGE_GUARD] = {
+        "CMOCKA_MALLOC_PAGE_GUARD", CM_ENV_TYPE_PAGE_GUARD,
+        &global_malloc_page_guard },
+    [CM_ENV_MALLOC_PAGE_GUARD_MIN_SIZE] = {
+        "CMOCKA_MALLOC_PAGE_GUARD_MIN_SIZE", CM_ENV_TYPE_SIZE,
+        &global_malloc_page_guard_min_size },
+    [CM_ENV_MALLOC_BACKTRACE] = {
+        "CMOCKA_MALLOC_BACKTRACE", CM_ENV_TYPE_UINT,
+        &global_malloc_backtrace_rate },
+    [CM_ENV_MALLOC_SAMPLE] = {
+        "CMOCKA_MALLOC_SAMPLE", CM_ENV_TYPE_SIZE,
+        &global_malloc_sample_period },
+    [CM_ENV_MALLOC_SAMPLE_BYTES] = {
+        "CMOCKA_MALLOC_SAMPLE_BYTES", CM_ENV_TYPE_SIZE,
+        &global_malloc_sample_bytes },
+    [CM_ENV_MALLOC_TEST_LIMIT] = {
+        "CMOCKA_MALLOC_TEST_LIMIT", CM_ENV_TYPE_SIZE,
+        &global_malloc_test_limit },
+    [CM_ENV_MALLOC_LIMIT] = {
+        "CMOCKA_MALLOC_LIMIT", CM_ENV_TYPE_SIZE,
+        &global_malloc_total_limit },
+    [CM_ENV_MALLOC_FAIL_NTH] = {
+        "CMOCKA_MALLOC_FAIL_NTH", CM_ENV_TYPE_SIZE,
+        &global_malloc_fail_nth },
+    [CM_ENV_MALLOC_FAIL_PROBABILITY] = {
+        "CMOCKA_MALLOC_FAIL_PROBABILITY", CM_ENV_TYPE_DOUBLE,
+        &global_malloc_fail_probability },
+    [CM_ENV_MALLOC_FAIL_SEED] = {
+        "CMOCKA_MALLOC_FAIL_SEED", CM_ENV_TYPE_UINT,
+        &global_malloc_fail_seed },
+    [CM_ENV_MALLOC_FAIL_SWEEP] = {
+        "CMOCKA_MALLOC_FAIL_SWEEP", CM_ENV_TYPE_SIZE,
+        &global_malloc_fail_sweep },
+    [CM_ENV_MALLOC_ARENA] = {
+        "CMOCKA_MALLOC_ARENA", CM_ENV_TYPE_BOOL,
+        &global_malloc_arena_enabled },
+    [CM_ENV_MALLOC_LEAK_DETAILS] = {
+        "CMOCKA_MALLOC_LEAK_DETAILS", CM_ENV_TYPE_BOOL,
+        &global_malloc_leak_details },
+    [CM_ENV_HEAP_PROFILE] = {
+        "CMOCKA_HEAP_PROFILE", CM_ENV_TYPE_BOOL,
+        &global_malloc_profile_enabled },
+    [CM_ENV_PERF_COUNTERS] = {
+        "CMOCKA_PERF_COUNTERS", CM_ENV_TYPE_BOOL,
+        &global_perf_counters_enabled },
+    [CM_ENV_RESOURCE_USAGE] = {
+        "CMOCKA_RESOURCE_USAGE", CM_ENV_TYPE_BOOL,
+        &global_resource_usage_enabled },
+    [CM_ENV_PHASE_TIMES] = {
+        "CMOCKA_PHASE_TIMES", CM_ENV_TYPE_BOOL,
+        &global_phase_times_enabled },
+    [CM_ENV_BENCHMARK_ROUNDS] = {
+        "CMOCKA_BENCHMARK_ROUNDS", CM_ENV_TYPE_SIZE,
+        &global_benchmark_rounds },
+    [CM_ENV_BENCHMARK_ROUND_TIME] = {
+        "CMOCKA_BENCHMARK_ROUND_TIME", CM_ENV_TYPE_SIZE,
+        &global_benchmark_round_time },
+    [CM_ENV_BENCHMARK_BASELINE] = {
+        "CMOCKA_BENCHMARK_BASELINE", CM_ENV_TYPE_STRING,
+        &global_benchmark_baseline_file },
+    [CM_ENV_BENCHMARK_SAVE] = {
+        "CMOCKA_BENCHMARK_SAVE", CM_ENV_TYPE_STRING,
+        &global_benchmark_save_file },
+    [CM_ENV_BENCHMARK_ALPHA] = {
+        "CMOCKA_BENCHMARK_ALPHA", CM_ENV_TYPE_DOUBLE,
+        &global_benchmark_alpha },
+    [CM_ENV_BENCHMARK_SLOWDOWN] = {
+        "CMOCKA_BENCHMARK_SLOWDOWN", CM_ENV_TYPE_DOUBLE,
+        &global_benchmark_slowdown },
+};
+
+/* One bit per enum cm_env_setting given in the environment. */
+static uint32_t global_env_overrides;
+
+#if defined(_WIN32)
+static INIT_ONCE global_env_once = INIT_ONCE_STATIC_INIT;
+#elif defined(HAVE_PTHREAD_H)
+static pthread_once_t global_env_once = PTHREAD_ONCE_INIT;
+#else
+static bool global_env_loaded;
+#endif
+
+#if defined(HAVE_SYS_MMAN_H) && !defined(MAP_ANONYMOUS)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
 #ifndef _WIN32
 /* Signals caught by exception_handler(). */
 static const int exception_signals[] = {
@@ -310,10 +1018,15 @@ static const int exception_signals[] = {
 #endif
 };
 
+#ifdef HAVE_SIGACTION
+/* Default signal actions that should be restored after a test is complete. */
+static struct sigaction default_signal_actions[ARRAY_SIZE(exception_signals)];
+#else
 /* Default signal functions that should be restored after a test is complete. */
 typedef void (*SignalFunction)(int signal);
 static SignalFunction default_signal_functions[
     ARRAY_SIZE(exception_signals)];
+#endif /* HAVE_SIGACTION */
 
 #else /* _WIN32 */
 
@@ -360,15 +1073,199 @@ enum CMUnitTestStatus {
     CM_TEST_SKIPPED,
 };
 
+/* Measurements of a benchmark, the times are in nanoseconds per iteration. */
+typedef struct CMBenchmarkResult {
+    size_t iterations; /* Iterations of each round. */
+    size_t rounds;     /* Measured rounds, 0 until the benchmark finished. */
+    double *samples;   /* Time of each round, sorted. */
+    double mean;
+    double min;
+    double median;
+    double stddev;
+    bool compared;          /* Whether there is a baseline of the benchmark. */
+    double baseline_median; /* Median of the baseline. */
+    double change;          /* Relative change of the median. */
+    double p_value;         /* Probability of a slowdown like this by chance. */
+} CMBenchmarkResult;
+
+#define PERF_COUNTERS (CM_PERF_LLC_MISSES + 1)
+
+/* Hardware events counted during a test. */
+typedef struct CMPerfCounters {
+    bool valid[PERF_COUNTERS]; /* Whether the counter was available. */
+    uint64_t counts[PERF_COUNTERS];
+} CMPerfCounters;
+
+/* Resources used by a test, the differences of getrusage(2). */
+typedef struct CMResourceUsage {
+    bool valid;
+    double user_time;   /* Seconds. */
+    double system_time; /* Seconds. */
+    long max_rss;       /* Growth of the maximum resident set in KiB. */
+    long minor_faults;
+    long major_faults;
+    long voluntary_switches;
+    long involuntary_switches;
+} CMResourceUsage;
+
+/* Seconds spent in the phases of a test, or of a group for its fixtures. */
+typedef struct {
+    bool valid;
+    double setup;
+    double test;
+    double verify; /* Leak check and leftover expectations. */
+    double teardown;
+} CMPhaseTimes;
+
 struct CMUnitTestState {
-    const ListNode *check_point; /* Check point of the test if there's a setup function. */
+    MallocCheckPoint check_point; /* Check point of the test if there's a setup function. */
     const struct CMUnitTest *test; /* Point to array element in the tests we get passed */
     void *state; /* State associated with the test */
     const char *error_message; /* The error messages by the test */
     enum CMUnitTestStatus status; /* PASSED, FAILED, ABORT ... */
-    double runtime; /* Time calculations */
+    double runtime; /* Wall time of the test and its fixtures */
+    CMPhaseTimes phases; /* Time spent in each phase of the test */
+    MallocProfile heap_profile; /* Heap usage of the test */
+    CMBenchmarkResult benchmark; /* Measurements if the test is a benchmark */
+    CMPerfCounters perf; /* Hardware events of the test function */
+    CMResourceUsage rusage; /* Resources used by the test and its fixtures */
 };
 
+#ifdef CMOCKA_ASAN
+static void malloc_asan_report(const char *report);
+#endif
+
+/* Round a guard size up to keep the block header in front of it aligned. */
+static size_t malloc_guard_size_align(size_t size)
+{
+    if (size > MALLOC_GUARD_SIZE_MAX) {
+        size = MALLOC_GUARD_SIZE_MAX;
+    }
+
+    return (size + MALLOC_ALIGNMENT - 1) & ~(MALLOC_ALIGNMENT - 1);
+}
+
+/* Parse one environment variable into its setting, false if it is invalid. */
+static bool cm_env_parse(const enum cm_env_type type,
+                         const char *env,
+                         void *value)
+{
+    switch (type) {
+    case CM_ENV_TYPE_SIZE:
+        *(size_t *)value = strtoul(env, NULL, 0);
+        return true;
+    case CM_ENV_TYPE_UINT:
+        *(unsigned int *)value = (unsigned int)strtoul(env, NULL, 0);
+        return true;
+    case CM_ENV_TYPE_BOOL:
+        if (strlen(env) != 1) {
+            return false;
+        }
+        *(bool *)value = (env[0] == '1');
+        return true;
+    case CM_ENV_TYPE_DOUBLE:
+        *(double *)value = strtod(env, NULL);
+        return true;
+    case CM_ENV_TYPE_STRING:
+        *(const char **)value = env;
+        return true;
+    case CM_ENV_TYPE_POISON:
+        if (strcasecmp(env, "FULL") == 0) {
+            *(enum cm_malloc_poison *)value = CM_MALLOC_POISON_FULL;
+        } else if (strcasecmp(env, "GUARDS") == 0) {
+            *(enum cm_malloc_poison *)value = CM_MALLOC_POISON_GUARDS;
+        } else if (strcasecmp(env, "CACHELINE") == 0) {
+            *(enum cm_malloc_poison *)value = CM_MALLOC_POISON_CACHELINE;
+        } else if (strcasecmp(env, "OFF") == 0) {
+            *(enum cm_malloc_poison *)value = CM_MALLOC_POISON_OFF;
+        } else {
+            return false;
+        }
+        return true;
+    case CM_ENV_TYPE_PAGE_GUARD:
+        if (strcasecmp(env, "RIGHT") == 0) {
+            *(enum cm_malloc_page_guard *)value = CM_MALLOC_PAGE_GUARD_RIGHT;
+        } else if (strcasecmp(env, "LEFT") == 0) {
+            *(enum cm_malloc_page_guard *)value = CM_MALLOC_PAGE_GUARD_LEFT;
+        } else if (strcasecmp(env, "OFF") == 0) {
+            *(enum cm_malloc_page_guard *)value = CM_MALLOC_PAGE_GUARD_OFF;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/* Read all settings from the environment, only called once. */
+static void cm_read_env(void)
+{
+    size_t i;
+
+    for (i = 0; i < CM_ENV_SETTINGS; i++) {
+        const char *env = getenv(cm_env_settings[i].name);
+
+        if (env == NULL || env[0] == '\0') {
+            continue;
+        }
+        if (cm_env_parse(cm_env_settings[i].type,
+                         env,
+                         cm_env_settings[i].value)) {
+            global_env_overrides |= (uint32_t)1 << i;
+        }
+    }
+
+    global_malloc_guard_size = malloc_guard_size_align(global_malloc_guard_size);
+
+#ifdef CMOCKA_ASAN
+    __asan_set_error_report_callback(malloc_asan_report);
+#endif
+}
+
+#if defined(_WIN32)
+static BOOL CALLBACK cm_read_env_once(PINIT_ONCE once,
+                                      PVOID parameter,
+                                      PVOID *context)
+{
+    (void)once;
+    (void)parameter;
+    (void)context;
+
+    cm_read_env();
+
+    return TRUE;
+}
+#endif
+
+/*
+ * Load the settings from the environment. This is done once, when the first
+ * test group starts, a setter is called or a setting is needed before. A
+ * variable which is set takes precedence over the setter of its setting, no
+ * matter if the setter is called before or after.
+ */
+static void cm_load_env(void)
+{
+#if defined(_WIN32)
+    InitOnceExecuteOnce(&global_env_once, cm_read_env_once, NULL, NULL);
+#elif defined(HAVE_PTHREAD_H)
+    pthread_once(&global_env_once, cm_read_env);
+#else
+    if (!global_env_loaded) {
+        global_env_loaded = true;
+        cm_read_env();
+    }
+#endif
+}
+
+/* Whether a setting is given in the environment, its setter is ignored. */
+static bool cm_env_is_set(const enum cm_env_setting setting)
+{
+    cm_load_env();
+
+    return (global_env_overrides & ((uint32_t)1 << setting)) != 0;
+}
+
 /* Exit the currently executing test. */
 static void exit_test(const bool quit_application)
 {
@@ -605,7 +1502,7 @@ static ListNode* list_initialize(ListNode * const node) {
  */
 static ListNode* list_add_value(ListNode * const head, const void *value,
                                      const int refcount) {
-    ListNode * const new_node = (ListNode*)malloc(sizeof(ListNode));
+    ListNode * const new_node = (ListNode*)libc_malloc(sizeof(ListNode));
     assert_non_null(head);
     assert_non_null(value);
     new_node->value = value;
@@ -645,7 +1542,7 @@ static void list_remove_free(
         ListNode * const node, const CleanupListValue cleanup_value,
         void * const cleanup_value_data) {
     assert_non_null(node);
-    free(list_remove(node, cleanup_value, cleanup_value_data));
+    libc_free(list_remove(node, cleanup_value, cleanup_value_data));
 }
 
 
@@ -707,7 +1604,7 @@ static int list_first(ListNode * const head, ListNode **output) {
 static void free_value(const void *value, void *cleanup_value_data) {
     (void)cleanup_value_data;
     assert_non_null(value);
-    free((void*)value);
+    libc_free((void*)value);
 }
 
 
@@ -727,7 +1624,7 @@ static void free_symbol_map_value(const void *value,
                   (void *)((uintptr_t)children - 1));
     }
 
-    free(map_value);
+    libc_free(map_value);
 }
 
 
@@ -759,7 +1656,7 @@ static void add_symbol_value(ListNode * const symbol_map_head,
     if (!list_find(symbol_map_head, symbol_name, symbol_names_match,
                    &target_node)) {
         SymbolMapValue * const new_symbol_map_value =
-            (SymbolMapValue*)malloc(sizeof(*new_symbol_map_value));
+            (SymbolMapValue*)libc_malloc(sizeof(*new_symbol_map_value));
         new_symbol_map_value->symbol_name = symbol_name;
         list_initialize(&new_symbol_map_value->symbol_values_list_head);
         target_node = list_add_value(symbol_map_head, new_symbol_map_value,
@@ -970,7 +1867,7 @@ uintmax_t _mock(const char * const function, const char* const file,
         const uintmax_t value = symbol->value;
         global_last_mock_value_location = symbol->location;
         if (rc == 1) {
-            free(symbol);
+            libc_free(symbol);
         }
         return value;
     } else {
@@ -1060,7 +1957,7 @@ void _will_return(const char * const function_name, const char * const file,
                   const int line, const uintmax_t value,
                   const int count) {
     SymbolValue * const return_value =
-        (SymbolValue*)malloc(sizeof(*return_value));
+        (SymbolValue*)libc_malloc(sizeof(*return_value));
     assert_true(count != 0);
     return_value->value = value;
     set_source_location(&return_value->location, file, line);
@@ -1082,7 +1979,7 @@ void _expect_check(
         const uintmax_t check_data,
         CheckParameterEvent * const event, const int count) {
     CheckParameterEvent * const check =
-        event ? event : (CheckParameterEvent*)malloc(sizeof(*check));
+        event ? event : (CheckParameterEvent*)libc_malloc(sizeof(*check));
     const char* symbols[] = {function, parameter};
     check->parameter_name = parameter;
     check->check_value = check_function;
@@ -1110,7 +2007,7 @@ void _expect_function_call(
     assert_non_null(file);
     assert_true(count != 0);
 
-    ordering = (FuncOrderingValue *)malloc(sizeof(*ordering));
+    ordering = (FuncOrderingValue *)libc_malloc(sizeof(*ordering));
 
     set_source_location(&ordering->location, file, line);
     ordering->function = function_name;
@@ -1507,7 +2404,7 @@ static void expect_set(
         const uintmax_t values[], const size_t number_of_values,
         const CheckParameterValue check_function, const int count) {
     CheckIntegerSet * const check_integer_set =
-        (CheckIntegerSet*)malloc(sizeof(*check_integer_set) +
+        (CheckIntegerSet*)libc_malloc(sizeof(*check_integer_set) +
                (sizeof(values[0]) * number_of_values));
     uintmax_t * const set = (uintmax_t*)(
         check_integer_set + 1);
@@ -1579,7 +2476,7 @@ static void expect_range(
         const uintmax_t minimum, const uintmax_t maximum,
         const CheckParameterValue check_function, const int count) {
     CheckIntegerRange * const check_integer_range =
-        (CheckIntegerRange*)malloc(sizeof(*check_integer_range));
+        (CheckIntegerRange*)libc_malloc(sizeof(*check_integer_range));
     declare_initialize_value_pointer_pointer(check_data, check_integer_range);
     check_integer_range->minimum = minimum;
     check_integer_range->maximum = maximum;
@@ -1709,7 +2606,7 @@ static void expect_memory_setup(
         const void * const memory, const size_t size,
         const CheckParameterValue check_function, const int count) {
     CheckMemoryData * const check_data =
-        (CheckMemoryData*)malloc(sizeof(*check_data) + size);
+        (CheckMemoryData*)libc_malloc(sizeof(*check_data) + size);
     void * const mem = (void*)(check_data + 1);
     declare_initialize_value_pointer_pointer(check_data_pointer, check_data);
     assert_non_null(memory);
@@ -1787,7 +2684,7 @@ void _check_expected(
         global_last_parameter_location = check->location;
         check_succeeded = check->check_value(value, check->check_value_data);
         if (rc == 1) {
-            free(check);
+            libc_free(check);
         }
         if (!check_succeeded) {
             cmocka_print_error(SOURCE_LOCATION_FORMAT
@@ -2047,35 +2944,183 @@ void _assert_not_in_set(const uintmax_t value,
 }
 
 
-/* Get the list of allocated blocks. */
-static ListNode* get_allocated_blocks_list(void) {
-    /* If it initialized, initialize the list of allocated blocks. */
-    if (!global_allocated_blocks.value) {
-        list_initialize(&global_allocated_blocks);
-        global_allocated_blocks.value = (void*)1;
+/* Return the shard of the registry which tracks the block at ptr. */
+static MallocShard *malloc_shard(const void *ptr)
+{
+    uint64_t h = (uint64_t)(uintptr_t)ptr;
+
+    /* The top bits, the table of the shard uses the lower ones. */
+    h *= UINT64_C(0x9E3779B97F4A7C15);
+
+    return &global_malloc_shards[h >> (64 - MALLOC_SHARD_BITS)];
+}
+
+/*
+ * Return the run new blocks of the calling thread belong to: the run of the
+ * test group the thread executes. A thread started by a test has none of its
+ * own and uses the run of the newest group in progress.
+ */
+static MallocRun *malloc_run(void)
+{
+    MallocRun *run = global_malloc_run;
+
+    if (run != NULL) {
+        return run;
+    }
+
+    run = CMOCKA_ATOMIC_LOAD(&global_malloc_newest_run);
+
+    return run != NULL ? run : &global_malloc_root_run;
+}
+
+/* Start the run of a test group on the calling thread. */
+static MallocRun *malloc_run_begin(void)
+{
+    MallocRun *run = libc_calloc(1, sizeof(*run));
+
+    assert_non_null(run);
+    CMOCKA_MUTEX_INIT(&run->lock);
+    CMOCKA_MUTEX_INIT(&run->quarantine_lock);
+    CMOCKA_MUTEX_INIT(&run->arena_lock);
+    list_initialize(&run->blocks);
+    list_initialize(&run->quarantine);
+    run->refs = 1;
+
+    run->parent = global_malloc_run;
+    global_malloc_run = run;
+
+    CMOCKA_MUTEX_LOCK(&global_malloc_runs_lock);
+    run->older = global_malloc_newest_run;
+    CMOCKA_ATOMIC_STORE(&global_malloc_newest_run, run);
+    CMOCKA_MUTEX_UNLOCK(&global_malloc_runs_lock);
+
+    return run;
+}
+
+/*
+ * Account a change of a counter shared by all threads and return its new
+ * value. The counters are kept lock free where the compiler allows.
+ */
+static size_t malloc_counter_add(size_t *counter,
+                                 const size_t add,
+                                 const size_t sub)
+{
+    size_t value;
+
+#ifdef __GNUC__
+    value = __atomic_add_fetch(counter, add - sub, __ATOMIC_RELAXED);
+#else
+    CMOCKA_MUTEX_LOCK(&global_malloc_counter_lock);
+    *counter += add - sub;
+    value = *counter;
+    CMOCKA_MUTEX_UNLOCK(&global_malloc_counter_lock);
+#endif
+
+    return value;
+}
+
+/*
+ * Drop a reference to a run, see MallocRun.refs. Nothing touches the run
+ * after the last one, so it is released.
+ */
+static void malloc_run_unref(MallocRun *run)
+{
+    size_t refs;
+
+#ifdef __GNUC__
+    refs = __atomic_sub_fetch(&run->refs, 1, __ATOMIC_ACQ_REL);
+#else
+    refs = malloc_counter_add(&run->refs, 0, 1);
+#endif
+    if (refs > 0) {
+        return;
+    }
+
+    libc_free(run->sites.sites);
+    libc_free(run->sites.slots);
+    CMOCKA_MUTEX_DESTROY(&run->arena_lock);
+    CMOCKA_MUTEX_DESTROY(&run->quarantine_lock);
+    CMOCKA_MUTEX_DESTROY(&run->lock);
+    libc_free(run);
+}
+
+/*
+ * End the run of a test group, its blocks have been freed and its quarantine
+ * has been emptied by then. Leaked thin blocks still refer to the run, it is
+ * released with the last of them.
+ */
+static void malloc_run_end(MallocRun *run)
+{
+    MallocRun **link;
+
+    CMOCKA_MUTEX_LOCK(&global_malloc_runs_lock);
+    for (link = &global_malloc_newest_run;
+         *link != run;
+         link = &(*link)->older) {
     }
-    return &global_allocated_blocks;
+    CMOCKA_ATOMIC_STORE(link, run->older);
+    CMOCKA_MUTEX_UNLOCK(&global_malloc_runs_lock);
+
+    global_malloc_run = run->parent;
+
+    malloc_run_unref(run);
+}
+
+/*
+ * Account bytes allocated and freed by any run and return the bytes in use.
+ * Only the total limit needs the sum, so it is kept lock free.
+ */
+static size_t malloc_total_bytes(const size_t add, const size_t sub)
+{
+    return malloc_counter_add(&global_malloc_total_bytes, add, sub);
+}
+
+static void *libc_malloc(size_t size)
+{
+    void *ptr;
+
+    global_malloc_wrap_depth++;
+#undef malloc
+    ptr = malloc(size);
+#define malloc test_malloc
+    global_malloc_wrap_depth--;
+
+    return ptr;
 }
 
 static void *libc_calloc(size_t nmemb, size_t size)
 {
+    void *ptr;
+
+    global_malloc_wrap_depth++;
 #undef calloc
-    return calloc(nmemb, size);
+    ptr = calloc(nmemb, size);
 #define calloc test_calloc
+    global_malloc_wrap_depth--;
+
+    return ptr;
 }
 
 static void libc_free(void *ptr)
 {
+    global_malloc_wrap_depth++;
 #undef free
     free(ptr);
 #define free test_free
+    global_malloc_wrap_depth--;
 }
 
 static void *libc_realloc(void *ptr, size_t size)
 {
+    void *new_ptr;
+
+    global_malloc_wrap_depth++;
 #undef realloc
-    return realloc(ptr, size);
+    new_ptr = realloc(ptr, size);
 #define realloc test_realloc
+    global_malloc_wrap_depth--;
+
+    return new_ptr;
 }
 
 static void vcmocka_print_error(const char* const format,
@@ -2134,831 +3179,5307 @@ static void vcm_free_error(char *err_msg)
     libc_free(err_msg);
 }
 
-/* Use the real malloc in this function. */
-#undef malloc
-void* _test_malloc(const size_t size, const char* file, const int line) {
-    char *ptr = NULL;
-    MallocBlockInfo block_info;
-    ListNode * const block_list = get_allocated_blocks_list();
-    size_t allocate_size;
-    char *block = NULL;
+static char *malloc_block_ptr(const struct MallocBlockInfoData *data);
+static void display_malloc_stack(const size_t index);
 
-    allocate_size = size + (MALLOC_GUARD_SIZE * 2) +
-                    sizeof(struct MallocBlockInfoData) + MALLOC_ALIGNMENT;
-    assert_true(allocate_size > size);
+/* Map a pointer to its home slot in a table of the given size. */
+static size_t malloc_table_hash(const void *ptr, const size_t size)
+{
+    uint64_t h = (uint64_t)(uintptr_t)ptr;
 
-    block = (char *)malloc(allocate_size);
-    assert_non_null(block);
+    /* Fibonacci hashing, the low bits of a heap pointer are mostly zero. */
+    h *= UINT64_C(0x9E3779B97F4A7C15);
 
-    /* Calculate the returned address. */
-    ptr = (char*)(((size_t)block + MALLOC_GUARD_SIZE +
-                  sizeof(struct MallocBlockInfoData) +
-                  MALLOC_ALIGNMENT) & ~(MALLOC_ALIGNMENT - 1));
+    return (size_t)(h >> 32) & (size - 1);
+}
 
-    /* Initialize the guard blocks. */
-    memset(ptr - MALLOC_GUARD_SIZE, MALLOC_GUARD_PATTERN, MALLOC_GUARD_SIZE);
-    memset(ptr + size, MALLOC_GUARD_PATTERN, MALLOC_GUARD_SIZE);
-    memset(ptr, MALLOC_ALLOC_PATTERN, size);
+/*
+ * Find the slot used by ptr. This returns NULL if the pointer has never been
+ * returned by test_malloc() or its record has been dropped.
+ */
+static MallocBlockEntry *malloc_table_find(const MallocBlockTable *table,
+                                           const void *ptr)
+{
+    size_t i;
 
-    block_info.ptr = ptr - (MALLOC_GUARD_SIZE +
-                            sizeof(struct MallocBlockInfoData));
-    set_source_location(&block_info.data->location, file, line);
-    block_info.data->allocated_size = allocate_size;
-    block_info.data->size = size;
-    block_info.data->block = block;
-    block_info.data->node.value = block_info.ptr;
-    list_add(block_list, &block_info.data->node);
-    return ptr;
+    if (table->entries == NULL) {
+        return NULL;
+    }
+
+    for (i = malloc_table_hash(ptr, table->size);
+         table->entries[i].ptr != NULL;
+         i = (i + 1) & (table->size - 1)) {
+        if (table->entries[i].ptr == ptr) {
+            return &table->entries[i];
+        }
+    }
+
+    return NULL;
 }
-#define malloc test_malloc
 
+/* Return the first empty slot on the probe sequence of ptr. */
+static MallocBlockEntry *malloc_table_empty_slot(const MallocBlockTable *table,
+                                                 const void *ptr)
+{
+    size_t i;
 
-void* _test_calloc(const size_t number_of_elements, const size_t size,
-                   const char* file, const int line) {
-    void* const ptr = _test_malloc(number_of_elements * size, file, line);
-    if (ptr) {
-        memset(ptr, 0, number_of_elements * size);
+    for (i = malloc_table_hash(ptr, table->size);
+         table->entries[i].ptr != NULL;
+         i = (i + 1) & (table->size - 1)) {
     }
-    return ptr;
-}
-#define calloc test_calloc
 
+    return &table->entries[i];
+}
 
-/* Use the real free in this function. */
-#undef free
-void _test_free(void* const ptr, const char* file, const int line) {
-    unsigned int i;
-    char *block = discard_const_p(char, ptr);
-    MallocBlockInfo block_info;
+/*
+ * Resize the table of a shard so it can hold at least live_hint live blocks.
+ * Records of freed blocks are dropped, so a double free is only reported until
+ * the next resize or until the address is handed out again. The address of a
+ * quarantined block is not reused yet, its record is kept.
+ */
+static void malloc_table_resize(MallocBlockTable *table,
+                                const size_t live_hint)
+{
+    MallocBlockTable new_table = {
+        .size = MALLOC_TABLE_MIN_SIZE,
+    };
+    size_t quarantined = 0;
+    size_t i;
 
-    if (ptr == NULL) {
-        return;
+    for (i = 0; i < table->size; i++) {
+        if (table->entries[i].data == NULL && table->entries[i].quarantined) {
+            quarantined++;
+        }
+    }
+    while (new_table.size < (live_hint + quarantined) * 4) {
+        new_table.size <<= 1;
     }
 
-    _assert_true(cast_ptr_to_uintmax_type(ptr), "ptr", file, line);
-    block_info.ptr = block - (MALLOC_GUARD_SIZE +
-                              sizeof(struct MallocBlockInfoData));
-    /* Check the guard blocks. */
-    {
-        char *guards[2] = {block - MALLOC_GUARD_SIZE,
-                           block + block_info.data->size};
-        for (i = 0; i < ARRAY_SIZE(guards); i++) {
-            unsigned int j;
-            char * const guard = guards[i];
-            for (j = 0; j < MALLOC_GUARD_SIZE; j++) {
-                const char diff = guard[j] - MALLOC_GUARD_PATTERN;
-                if (diff) {
-                    cmocka_print_error(SOURCE_LOCATION_FORMAT
-                                   ": error: Guard block of %p size=%lu is corrupt\n"
-                                   SOURCE_LOCATION_FORMAT ": note: allocated here at %p\n",
-                                   file,
-                                   line,
-                                   ptr,
-                                   (unsigned long)block_info.data->size,
-                                   block_info.data->location.file,
-                                   block_info.data->location.line,
-                                   (void *)&guard[j]);
-                    _fail(file, line);
-                }
-            }
+    new_table.entries = libc_calloc(new_table.size, sizeof(MallocBlockEntry));
+    assert_non_null(new_table.entries);
+
+    for (i = 0; i < table->size; i++) {
+        const MallocBlockEntry *entry = &table->entries[i];
+
+        if (entry->ptr == NULL ||
+            (entry->data == NULL && !entry->quarantined)) {
+            continue;
+        }
+        *malloc_table_empty_slot(&new_table, entry->ptr) = *entry;
+        new_table.used++;
+        if (entry->data != NULL) {
+            new_table.live++;
         }
     }
-    list_remove(&block_info.data->node, NULL, NULL);
 
-    block = discard_const_p(char, block_info.data->block);
-    memset(block, MALLOC_FREE_PATTERN, block_info.data->allocated_size);
-    free(block);
+    libc_free(table->entries);
+    *table = new_table;
 }
-#define free test_free
 
-#undef realloc
-void *_test_realloc(void *ptr,
-                   const size_t size,
-                   const char *file,
-                   const int line)
+/* Add a block returned by test_malloc() to the table. */
+static void malloc_table_insert(MallocBlockTable *table,
+                                struct MallocBlockInfoData *data,
+                                const void *ptr)
 {
-    MallocBlockInfo block_info;
-    char *block = ptr;
-    size_t block_size = size;
-    void *new_block;
+    MallocBlockEntry *entry;
 
-    if (ptr == NULL) {
-        return _test_malloc(size, file, line);
+    /* Keep the load factor below 3/4, counting the freed records. */
+    if ((table->used + 1) * 4 > table->size * 3) {
+        malloc_table_resize(table, table->live + 1);
     }
 
-    if (size == 0) {
-        _test_free(ptr, file, line);
-        return NULL;
+    entry = malloc_table_find(table, ptr);
+    if (entry == NULL) {
+        entry = malloc_table_empty_slot(table, ptr);
+        table->used++;
     }
+    assert_null(entry->data);
+
+    entry->ptr = ptr;
+    entry->data = data;
+    entry->location = data->location;
+    initialize_source_location(&entry->free_location);
+    entry->quarantined = false;
+    table->live++;
+}
 
-    block_info.ptr = block - (MALLOC_GUARD_SIZE +
-                              sizeof(struct MallocBlockInfoData));
+/* Mark the block of a table slot as freed at the given location. */
+static void malloc_table_remove(MallocBlockTable *table,
+                                MallocBlockEntry *entry,
+                                const char *file,
+                                const int line)
+{
+    entry->data = NULL;
+    set_source_location(&entry->free_location, file, line);
+    table->live--;
+}
+
+/*
+ * Look up the table slot of a block passed to test_free() or test_realloc(),
+ * with the lock of its shard held. If the pointer is unknown or has already
+ * been freed, the error is displayed and NULL is returned. The caller has to
+ * release the lock and fail the test then.
+ */
+static MallocBlockEntry *get_allocated_block_entry(MallocShard *shard,
+                                                   const void *ptr,
+                                                   const char *file,
+                                                   const int line)
+{
+    MallocBlockEntry *entry = malloc_table_find(&shard->table, ptr);
 
-    new_block = _test_malloc(size, file, line);
-    if (new_block == NULL) {
+    if (entry == NULL) {
+        cmocka_print_error(SOURCE_LOCATION_FORMAT
+                           ": error: %p was not allocated by test_malloc()\n",
+                           file,
+                           line,
+                           ptr);
         return NULL;
     }
 
-    if (block_info.data->size < size) {
-        block_size = block_info.data->size;
+    if (entry->data == NULL) {
+        cmocka_print_error(SOURCE_LOCATION_FORMAT
+                           ": error: Double free of %p\n"
+                           SOURCE_LOCATION_FORMAT ": note: allocated here\n"
+                           SOURCE_LOCATION_FORMAT ": note: freed here\n",
+                           file,
+                           line,
+                           ptr,
+                           entry->location.file,
+                           entry->location.line,
+                           entry->free_location.file,
+                           entry->free_location.line);
+        return NULL;
     }
 
-    memcpy(new_block, ptr, block_size);
+    return entry;
+}
 
-    /* Free previous memory */
-    _test_free(ptr, file, line);
+static size_t cm_get_malloc_guard_size(void)
+{
+    cm_load_env();
 
-    return new_block;
+    return global_malloc_guard_size;
 }
-#define realloc test_realloc
 
-/* Crudely checkpoint the current heap state. */
-static const ListNode* check_point_allocated_blocks(void) {
-    return get_allocated_blocks_list()->prev;
+void cmocka_set_malloc_guard_size(size_t size)
+{
+    if (!cm_env_is_set(CM_ENV_MALLOC_GUARD_SIZE)) {
+        global_malloc_guard_size = malloc_guard_size_align(size);
+    }
 }
 
+static enum cm_malloc_poison cm_get_malloc_poison(void)
+{
+    cm_load_env();
 
-/* Display the blocks allocated after the specified check point.  This
- * function returns the number of blocks displayed. */
-static size_t display_allocated_blocks(const ListNode * const check_point) {
-    const ListNode * const head = get_allocated_blocks_list();
-    const ListNode *node;
-    size_t allocated_blocks = 0;
-    assert_non_null(check_point);
-    assert_non_null(check_point->next);
-
-    for (node = check_point->next; node != head; node = node->next) {
-        const MallocBlockInfo block_info = {
-            .ptr = discard_const(node->value),
-        };
-        assert_non_null(block_info.ptr);
+    return global_malloc_poison;
+}
 
-        if (allocated_blocks == 0) {
-            cmocka_print_error("Blocks allocated...\n");
-        }
-        cmocka_print_error(SOURCE_LOCATION_FORMAT ": note: block %p allocated here\n",
-                       block_info.data->location.file,
-                       block_info.data->location.line,
-                       block_info.data->block);
-        allocated_blocks++;
+void cmocka_set_malloc_poison(enum cm_malloc_poison mode)
+{
+    if (!cm_env_is_set(CM_ENV_MALLOC_POISON)) {
+        global_malloc_poison = mode;
     }
-    return allocated_blocks;
 }
 
+#ifdef CMOCKA_ASAN
+static void display_malloc_fault(const void *address);
 
-/* Free all blocks allocated after the specified check point. */
-static void free_allocated_blocks(const ListNode * const check_point) {
-    const ListNode * const head = get_allocated_blocks_list();
-    const ListNode *node;
-    assert_non_null(check_point);
+/* Name the cmocka allocation site of a block AddressSanitizer reports. */
+static void malloc_asan_report(const char *report)
+{
+    (void)report; /* unused */
 
-    node = check_point->next;
-    assert_non_null(node);
+    /* The process exits after the report, print right away. */
+    cm_error_message_enabled = 0;
+    display_malloc_fault(__asan_get_report_address());
+}
+#endif /* CMOCKA_ASAN */
 
-    while (node != head) {
-        const MallocBlockInfo block_info = {
-            .ptr = discard_const(node->value),
-        };
-        node = node->next;
-        free(discard_const_p(char, block_info.data) +
-             sizeof(struct MallocBlockInfoData) +
-             MALLOC_GUARD_SIZE);
+/* Whether guard blocks and fills are left to a sanitizer. */
+static bool cm_get_malloc_sanitizer(void)
+{
+#if defined(CMOCKA_ASAN) || defined(CMOCKA_MSAN)
+    cm_load_env();
+
+    return global_malloc_sanitizer;
+#else
+    return false;
+#endif /* CMOCKA_ASAN || CMOCKA_MSAN */
+}
+
+void cmocka_set_malloc_sanitizer(int enable)
+{
+    if (!cm_env_is_set(CM_ENV_MALLOC_SANITIZER)) {
+        global_malloc_sanitizer = (enable != 0);
     }
 }
 
+/*
+ * Set up the guard blocks of a block handled by a sanitizer. With
+ * AddressSanitizer they are poisoned, so an overflow is reported at the
+ * access instead of when the block is freed.
+ */
+static void malloc_sanitizer_guards(char *ptr,
+                                    const size_t size,
+                                    const size_t guard_size,
+                                    const size_t tail_guard_size)
+{
+#ifdef CMOCKA_ASAN
+    __asan_poison_memory_region(ptr - guard_size, guard_size);
+    __asan_poison_memory_region(ptr + size, tail_guard_size);
+#else
+    memset(ptr - guard_size, MALLOC_GUARD_PATTERN, guard_size);
+    memset(ptr + size, MALLOC_GUARD_PATTERN, tail_guard_size);
+#endif
+}
 
-/* Fail if any any blocks are allocated after the specified check point. */
-static void fail_if_blocks_allocated(const ListNode * const check_point,
-                                     const char * const test_name) {
-    const size_t allocated_blocks = display_allocated_blocks(check_point);
-    if (allocated_blocks > 0) {
-        free_allocated_blocks(check_point);
-        cmocka_print_error("ERROR: %s leaked %zu block(s)\n", test_name,
-                       allocated_blocks);
-        exit_test(true);
+/* Make the guard blocks of a block handled by a sanitizer accessible. */
+static void malloc_sanitizer_unguard(const struct MallocBlockInfoData *data,
+                                     char *ptr)
+{
+#ifdef CMOCKA_ASAN
+    __asan_unpoison_memory_region(ptr - data->guard_size, data->guard_size);
+    __asan_unpoison_memory_region(ptr + data->size, data->tail_guard_size);
+#else
+    (void)data; /* unused */
+    (void)ptr; /* unused */
+#endif
+}
+
+/*
+ * Fill the user data of a block with a pattern. Depending on the poison mode
+ * the whole area, only the first and last cache line, or nothing is filled.
+ */
+static void malloc_poison_data(char *ptr,
+                               const size_t size,
+                               const int pattern,
+                               const enum cm_malloc_poison mode)
+{
+    switch (mode) {
+    case CM_MALLOC_POISON_FULL:
+        memset(ptr, pattern, size);
+        break;
+    case CM_MALLOC_POISON_CACHELINE:
+        if (size <= 2 * MALLOC_POISON_CACHELINE_SIZE) {
+            memset(ptr, pattern, size);
+        } else {
+            memset(ptr, pattern, MALLOC_POISON_CACHELINE_SIZE);
+            memset(ptr + size - MALLOC_POISON_CACHELINE_SIZE,
+                   pattern,
+                   MALLOC_POISON_CACHELINE_SIZE);
+        }
+        break;
+    case CM_MALLOC_POISON_GUARDS:
+    case CM_MALLOC_POISON_OFF:
+        break;
     }
 }
 
+/* Return the pointer handed out to the caller for a block. */
+static char *malloc_block_ptr(const struct MallocBlockInfoData *data)
+{
+    return discard_const_p(char, data) + sizeof(struct MallocBlockInfoData) +
+           data->guard_size;
+}
 
-void _fail(const char * const file, const int line) {
-    uint32_t output = cm_get_output();
+/*
+ * Determine whether a memory area is still filled with a byte pattern. The
+ * area is compared a word at a time and the differences are accumulated
+ * without branching, so the compiler is free to vectorize the loop.
+ */
+static bool malloc_pattern_is_intact(const char *area,
+                                     const size_t size,
+                                     const unsigned char pattern)
+{
+    const uintptr_t pattern_word = UINTPTR_MAX / 0xFF * pattern;
+    uintptr_t diff = 0;
+    size_t i;
 
-    if (output & CM_OUTPUT_STANDARD) {
-        cmocka_print_error("[   LINE   ] --- " SOURCE_LOCATION_FORMAT
-                       ": error: Failure!",
-                       file, line);
+    for (i = 0; i + sizeof(uintptr_t) <= size; i += sizeof(uintptr_t)) {
+        uintptr_t word;
+
+        /* The trailing guard is not word aligned. */
+        memcpy(&word, area + i, sizeof(word));
+        diff |= word ^ pattern_word;
     }
-    if ((output & CM_OUTPUT_SUBUNIT) || (output & CM_OUTPUT_TAP) ||
-        (output & CM_OUTPUT_XML)) {
-        cmocka_print_error(SOURCE_LOCATION_FORMAT ": error: Failure!", file, line);
+    for (; i < size; i++) {
+        diff |= (unsigned char)area[i] ^ pattern;
     }
-    exit_test(true);
 
-    /* Unreachable */
-    exit(EXIT_FAILURE);
+    return diff == 0;
 }
 
+/*
+ * Check whether the guard blocks of a block are intact. A modified guard is
+ * displayed and false is returned, the caller fails the test.
+ */
+static bool check_block_guards(const struct MallocBlockInfoData *data,
+                               const char *file,
+                               const int line)
+{
+    char * const ptr = malloc_block_ptr(data);
+    const char * const guards[2] = {
+        ptr - data->guard_size,
+        ptr + data->size,
+    };
+    /* The leading guard of a left aligned block is an inaccessible page. */
+    const size_t guard_sizes[2] = {
+        data->page_guard == CM_MALLOC_PAGE_GUARD_LEFT ? 0 : data->guard_size,
+        data->tail_guard_size,
+    };
+    unsigned int i;
 
-#ifndef _WIN32
-CMOCKA_NORETURN static void exception_handler(int sig) {
-    const char *sig_strerror = "";
-
-#ifdef HAVE_STRSIGNAL
-    sig_strerror = strsignal(sig);
+#ifdef CMOCKA_ASAN
+    /* AddressSanitizer already reported any access to the guards. */
+    if (data->sanitized) {
+        return true;
+    }
 #endif
 
-    cmocka_print_error("Test failed with exception: %s(%d)",
-                   sig_strerror, sig);
-    exit_test(true);
+    for (i = 0; i < ARRAY_SIZE(guards); i++) {
+        const char * const guard = guards[i];
+        size_t j;
 
-    /* Unreachable */
-    exit(EXIT_FAILURE);
+        if (malloc_pattern_is_intact(guard,
+                                     guard_sizes[i],
+                                     MALLOC_GUARD_PATTERN)) {
+            continue;
+        }
+
+        /* Only scan byte by byte to locate the corruption. */
+        for (j = 0; (unsigned char)guard[j] == MALLOC_GUARD_PATTERN; j++) {
+        }
+
+        cmocka_print_error(SOURCE_LOCATION_FORMAT
+                           ": error: Guard block of %p size=%lu is corrupt\n"
+                           SOURCE_LOCATION_FORMAT ": note: allocated here at %p\n",
+                           file,
+                           line,
+                           (void *)ptr,
+                           (unsigned long)data->size,
+                           data->location.file,
+                           data->location.line,
+                           (const void *)&guard[j]);
+        display_malloc_stack(data->stack);
+        return false;
+    }
+
+    return true;
 }
 
-#else /* _WIN32 */
+static size_t cm_get_malloc_quarantine_size(void)
+{
+    cm_load_env();
 
-static LONG WINAPI exception_filter(EXCEPTION_POINTERS *exception_pointers) {
-    EXCEPTION_RECORD * const exception_record =
-        exception_pointers->ExceptionRecord;
-    const DWORD code = exception_record->ExceptionCode;
-    unsigned int i;
-    for (i = 0; i < ARRAY_SIZE(exception_codes); i++) {
-        const ExceptionCodeInfo * const code_info = &exception_codes[i];
-        if (code == code_info->code) {
-            static int shown_debug_message = 0;
-            fflush(stdout);
-            cmocka_print_error("%s occurred at %p.\n", code_info->description,
-                        exception_record->ExceptionAddress);
-            if (!shown_debug_message) {
-                cmocka_print_error(
-                    "\n"
-                    "To debug in Visual Studio...\n"
-                    "1. Select menu item File->Open Project\n"
-                    "2. Change 'Files of type' to 'Executable Files'\n"
-                    "3. Open this executable.\n"
-                    "4. Select menu item Debug->Start\n"
-                    "\n"
-                    "Alternatively, set the environment variable \n"
-                    "UNIT_TESTING_DEBUG to 1 and rebuild this executable, \n"
-                    "then click 'Debug' in the popup dialog box.\n"
-                    "\n");
-                shown_debug_message = 1;
-            }
-            exit_test(false);
-            return EXCEPTION_EXECUTE_HANDLER;
-        }
+    return global_malloc_quarantine_size;
+}
+
+void cmocka_set_malloc_quarantine(size_t size)
+{
+    if (!cm_env_is_set(CM_ENV_MALLOC_QUARANTINE)) {
+        global_malloc_quarantine_size = size;
     }
-    return EXCEPTION_CONTINUE_SEARCH;
 }
-#endif /* !_WIN32 */
 
-void cmocka_print_error(const char * const format, ...)
+void cmocka_set_malloc_slab(int enable)
 {
-    va_list args;
-    va_start(args, format);
-    if (cm_error_message_enabled) {
-        vcmocka_print_error(format, args);
-    } else {
-        vprint_error(format, args);
+    if (!cm_env_is_set(CM_ENV_MALLOC_SLAB)) {
+        global_malloc_slab_enabled = (enable != 0);
     }
-    va_end(args);
 }
 
-/* Standard output and error print methods. */
-void vprint_message(const char* const format, va_list args)
+/* Return the first slot to probe for a window in the chunk map. */
+static size_t malloc_chunk_slot(const MallocChunkMap *map,
+                                const uintptr_t window)
 {
-    char buffer[4096];
+    const uint64_t h = (uint64_t)window * UINT64_C(0x9E3779B97F4A7C15);
 
-    vsnprintf(buffer, sizeof(buffer), format, args);
-    printf("%s", buffer);
-    fflush(stdout);
-#ifdef _WIN32
-    OutputDebugString(buffer);
-#endif /* _WIN32 */
+    return (size_t)(h >> 32) & (map->size - 1);
 }
 
-
-void vprint_error(const char* const format, va_list args)
+/*
+ * Look up the chunk holding the memory at ptr and copy its description. This
+ * returns false if cmocka didn't carve the memory from a chunk. It takes no
+ * lock, so a chunk being released may still be found.
+ */
+static bool malloc_chunk_find(const void *ptr, MallocChunk *chunk)
 {
-    char buffer[4096];
+    const MallocChunkMap *map = CMOCKA_ATOMIC_LOAD(&global_malloc_chunk_map);
+    const uintptr_t window = ((uintptr_t)ptr >> MALLOC_CHUNK_WINDOW_SHIFT) + 1;
+    size_t i;
 
-    vsnprintf(buffer, sizeof(buffer), format, args);
-    fprintf(stderr, "%s", buffer);
-    fflush(stderr);
-#ifdef _WIN32
-    OutputDebugString(buffer);
-#endif /* _WIN32 */
-}
+    if (map == NULL) {
+        return false;
+    }
 
+    for (i = malloc_chunk_slot(map, window);
+         ;
+         i = (i + 1) & (map->size - 1)) {
+        const uintptr_t key = CMOCKA_ATOMIC_LOAD(&map->slots[i].window);
 
-void print_message(const char* const format, ...) {
-    va_list args;
-    va_start(args, format);
-    vprint_message(format, args);
-    va_end(args);
+        if (key == 0) {
+            return false;
+        }
+        if (key == window &&
+            (const char *)ptr >= map->slots[i].chunk.start &&
+            (const char *)ptr < map->slots[i].chunk.end) {
+            *chunk = map->slots[i].chunk;
+            return true;
+        }
+    }
 }
 
+/* Add a window of a chunk to the chunk map, call locked with a free slot. */
+static void malloc_chunk_map_put(MallocChunkMap *map,
+                                 const uintptr_t window,
+                                 const MallocChunk *chunk)
+{
+    size_t i;
+
+    for (i = malloc_chunk_slot(map, window);
+         map->slots[i].window != 0;
+         i = (i + 1) & (map->size - 1)) {
+    }
+    map->used++;
+    map->live++;
 
-void print_error(const char* const format, ...) {
-    va_list args;
-    va_start(args, format);
-    vprint_error(format, args);
-    va_end(args);
+    /* Readers find the chunk as soon as they see the window. */
+    map->slots[i].chunk = *chunk;
+    CMOCKA_ATOMIC_STORE(&map->slots[i].window, window);
 }
 
-/* New formatter */
-static uint32_t cm_get_output(void)
+/*
+ * Replace the chunk map by one with room for the given number of new
+ * windows, call locked. The old map stays valid for readers.
+ */
+static MallocChunkMap *malloc_chunk_map_grow(const size_t windows)
 {
-    static bool env_checked = false;
-    char *env = NULL;
-    size_t len = 0;
-    uint32_t new_output = 0;
-    char *str_output_list = NULL;
-    char *str_output = NULL;
-    char *saveptr = NULL;
+    MallocChunkMap *old_map = global_malloc_chunk_map;
+    MallocChunkMap *map;
+    size_t live = old_map != NULL ? old_map->live : 0;
+    size_t size = MALLOC_CHUNK_MAP_MIN_SIZE;
+    size_t i;
 
-    if (env_checked) {
-        return global_msg_output;
+    while (size < (live + windows) * 4) {
+        size *= 2;
     }
 
-    env = getenv("CMOCKA_MESSAGE_OUTPUT");
-    if (env == NULL) {
-        return global_msg_output;
+    map = libc_calloc(1, sizeof(*map));
+    if (map == NULL) {
+        return NULL;
     }
-
-    len = strlen(env);
-    if (len == 0 || len > 32) {
-        return global_msg_output;
+    map->slots = libc_calloc(size, sizeof(*map->slots));
+    if (map->slots == NULL) {
+        libc_free(map);
+        return NULL;
+    }
+    map->size = size;
+    map->replaced = old_map;
+
+    for (i = 0; old_map != NULL && i < old_map->size; i++) {
+        if (old_map->slots[i].window != 0 &&
+            old_map->slots[i].window != MALLOC_CHUNK_REMOVED) {
+            malloc_chunk_map_put(map,
+                                 old_map->slots[i].window,
+                                 &old_map->slots[i].chunk);
+        }
     }
+    CMOCKA_ATOMIC_STORE(&global_malloc_chunk_map, map);
 
-    str_output_list = strdup(env);
-    if (str_output_list == NULL) {
-        return global_msg_output;
+    return map;
+}
+
+/* Make a chunk known to malloc_chunk_find(). */
+static bool malloc_chunk_register(const MallocChunk *chunk)
+{
+    const uintptr_t first = (uintptr_t)chunk->start >> MALLOC_CHUNK_WINDOW_SHIFT;
+    const uintptr_t last = (uintptr_t)(chunk->end - 1) >>
+                           MALLOC_CHUNK_WINDOW_SHIFT;
+    MallocChunkMap *map;
+    uintptr_t window;
+
+    CMOCKA_MUTEX_LOCK(&global_malloc_chunk_lock);
+    map = global_malloc_chunk_map;
+    if (map == NULL || (map->used + (last - first + 1)) * 2 > map->size) {
+        map = malloc_chunk_map_grow(last - first + 1);
+        if (map == NULL) {
+            CMOCKA_MUTEX_UNLOCK(&global_malloc_chunk_lock);
+            return false;
+        }
+    }
+    for (window = first; window <= last; window++) {
+        malloc_chunk_map_put(map, window + 1, chunk);
     }
+    CMOCKA_MUTEX_UNLOCK(&global_malloc_chunk_lock);
 
-    for (str_output = strtok_r(str_output_list, ",", &saveptr);
-         str_output != NULL;
-         str_output = strtok_r(NULL, ",", &saveptr)) {
-        if (strcasecmp(str_output, "STANDARD") == 0) {
-            new_output |= CM_OUTPUT_STANDARD;
-        } else if (strcasecmp(str_output, "STDOUT") == 0) {
-            new_output |= CM_OUTPUT_STANDARD;
-        } else if (strcasecmp(str_output, "SUBUNIT") == 0) {
-            new_output |= CM_OUTPUT_SUBUNIT;
-        } else if (strcasecmp(str_output, "TAP") == 0) {
-            new_output |= CM_OUTPUT_TAP;
-        } else if (strcasecmp(str_output, "XML") == 0) {
-            new_output |= CM_OUTPUT_XML;
+    return true;
+}
+
+/* Forget a chunk before its memory is released. */
+static void malloc_chunk_unregister(const MallocChunk *chunk)
+{
+    const uintptr_t first = (uintptr_t)chunk->start >> MALLOC_CHUNK_WINDOW_SHIFT;
+    const uintptr_t last = (uintptr_t)(chunk->end - 1) >>
+                           MALLOC_CHUNK_WINDOW_SHIFT;
+    MallocChunkMap *map;
+    uintptr_t window;
+    size_t i;
+
+    CMOCKA_MUTEX_LOCK(&global_malloc_chunk_lock);
+    map = global_malloc_chunk_map;
+    for (window = first + 1; window <= last + 1; window++) {
+        for (i = malloc_chunk_slot(map, window);
+             map->slots[i].window != 0;
+             i = (i + 1) & (map->size - 1)) {
+            if (map->slots[i].window == window &&
+                map->slots[i].chunk.start == chunk->start) {
+                CMOCKA_ATOMIC_STORE(&map->slots[i].window,
+                                    MALLOC_CHUNK_REMOVED);
+                map->live--;
+                break;
+            }
         }
     }
+    CMOCKA_MUTEX_UNLOCK(&global_malloc_chunk_lock);
+}
 
-    libc_free(str_output_list);
+static bool cm_get_malloc_slab(void)
+{
+    cm_load_env();
 
-    if (new_output != 0) {
-        global_msg_output = new_output;
+    return global_malloc_slab_enabled;
+}
+
+/* Return the slab size class for blocks of the given size or -1. */
+static int malloc_slab_class(const size_t size)
+{
+    int slab_class = 0;
+
+    if (size > ((size_t)1 << MALLOC_SLAB_MAX_SHIFT)) {
+        return -1;
+    }
+    while (((size_t)1 << (slab_class + MALLOC_SLAB_MIN_SHIFT)) < size) {
+        slab_class++;
     }
 
-    env_checked = true;
+    return slab_class;
+}
 
-    return global_msg_output;
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+/* Leave the slab cache of an exiting thread to malloc_slab_release(). */
+static void malloc_slab_orphan(void *arg)
+{
+    MallocSlabCache *cache = arg;
+
+    CMOCKA_MUTEX_LOCK(&cache->remote_lock);
+    cache->orphaned = true;
+    CMOCKA_MUTEX_UNLOCK(&cache->remote_lock);
 }
 
-enum cm_printf_type {
-    PRINTF_TEST_START,
-    PRINTF_TEST_SUCCESS,
-    PRINTF_TEST_FAILURE,
-    PRINTF_TEST_ERROR,
-    PRINTF_TEST_SKIPPED,
-};
+static void malloc_slab_key_create(void)
+{
+    pthread_key_create(&global_malloc_slab_key, malloc_slab_orphan);
+}
+#endif
 
-static int xml_printed;
-static int file_append;
+/*
+ * Return the slab cache of the calling thread, created on first use. Without
+ * pthreads the cache of an exited thread is kept until the process exits.
+ */
+static MallocSlabCache *malloc_slab_cache(void)
+{
+    MallocSlabCache *cache = global_malloc_slab_cache;
 
-static void cmprintf_group_finish_xml(const char *group_name,
-                                      size_t total_executed,
-                                      size_t total_failed,
-                                      size_t total_errors,
-                                      size_t total_skipped,
-                                      double total_runtime,
-                                      struct CMUnitTestState *cm_tests)
+    if (cache != NULL) {
+        return cache;
+    }
+
+    cache = libc_calloc(1, sizeof(MallocSlabCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    CMOCKA_MUTEX_INIT(&cache->remote_lock);
+#if defined(HAVE_PTHREAD_H) && !defined(_WIN32)
+    pthread_once(&global_malloc_slab_once, malloc_slab_key_create);
+    pthread_setspecific(global_malloc_slab_key, cache);
+#endif
+
+    CMOCKA_MUTEX_LOCK(&global_malloc_slab_lock);
+    cache->next_cache = global_malloc_slab_caches;
+    global_malloc_slab_caches = cache;
+    CMOCKA_MUTEX_UNLOCK(&global_malloc_slab_lock);
+
+    global_malloc_slab_cache = cache;
+
+    return cache;
+}
+
+/*
+ * Take back the blocks of a class other threads have freed. Call as the owner
+ * of the cache, or for an orphaned cache with global_malloc_slab_lock held.
+ */
+static void malloc_slab_drain(MallocSlabCache *cache, const int slab_class)
 {
-    FILE *fp = stdout;
-    int file_opened = 0;
-    int multiple_files = 0;
-    char *env;
-    size_t i;
+    void *blocks;
+    void **tail;
 
-    env = getenv("CMOCKA_XML_FILE");
-    if (env != NULL) {
-        char buf[1024];
-        int rc;
+    CMOCKA_MUTEX_LOCK(&cache->remote_lock);
+    blocks = cache->remote_list[slab_class];
+    cache->live -= cache->remote_count[slab_class];
+    cache->remote_list[slab_class] = NULL;
+    cache->remote_count[slab_class] = 0;
+    CMOCKA_MUTEX_UNLOCK(&cache->remote_lock);
 
-        snprintf(buf, sizeof(buf), "%s", env);
+    if (blocks == NULL) {
+        return;
+    }
+    for (tail = (void **)blocks; *tail != NULL; tail = (void **)*tail) {
+    }
+    *tail = cache->free_list[slab_class];
+    cache->free_list[slab_class] = blocks;
+}
 
-        rc = c_strreplace(buf, sizeof(buf), "%g", group_name, &multiple_files);
-        if (rc < 0) {
-            snprintf(buf, sizeof(buf), "%s", env);
+/* Take a block of the given class from the cache of the calling thread. */
+static void *malloc_slab_alloc(const int slab_class, MallocSlabCache **owner)
+{
+    MallocSlabCache *cache = malloc_slab_cache();
+    const size_t block_size = (size_t)1 << (slab_class + MALLOC_SLAB_MIN_SHIFT);
+    void *block;
+
+    if (cache == NULL) {
+        return NULL;
+    }
+    *owner = cache;
+
+    /* Blocks freed by other threads are only taken back before a new chunk. */
+    if (cache->free_list[slab_class] == NULL &&
+        cache->next[slab_class] == cache->end[slab_class]) {
+        malloc_slab_drain(cache, slab_class);
+    }
+
+    block = cache->free_list[slab_class];
+    if (block != NULL) {
+        cache->free_list[slab_class] = *(void **)block;
+        cache->live++;
+#ifdef CMOCKA_ASAN
+        /* The data of a block freed by a sanitized test_free() is poisoned. */
+        __asan_unpoison_memory_region(block, block_size);
+#endif
+        return block;
+    }
+
+    if (cache->next[slab_class] == cache->end[slab_class]) {
+        MallocSlabChunk *chunk = libc_malloc(MALLOC_SLAB_CHUNK_SIZE);
+
+        if (chunk == NULL) {
+            return NULL;
         }
+        chunk->range.start = (const char *)chunk;
+        chunk->range.end = (const char *)chunk + MALLOC_SLAB_CHUNK_SIZE;
+        chunk->range.arena_run = NULL;
+        chunk->range.arena_serial = 0;
+        if (!malloc_chunk_register(&chunk->range)) {
+            libc_free(chunk);
+            return NULL;
+        }
+        chunk->next = cache->chunks;
+        cache->chunks = chunk;
 
-        fp = fopen(buf, "r");
-        if (fp == NULL) {
-            fp = fopen(buf, "w");
-            if (fp != NULL) {
-                file_append = 1;
-                file_opened = 1;
-            } else {
-                fp = stderr;
-            }
+        /* The first block is given up for the chunk header. */
+        cache->next[slab_class] = (char *)chunk + block_size;
+        cache->end[slab_class] = (char *)chunk + MALLOC_SLAB_CHUNK_SIZE;
+    }
+
+    block = cache->next[slab_class];
+    cache->next[slab_class] += block_size;
+    cache->live++;
+
+    return block;
+}
+
+/*
+ * Give a block back to its cache. A block freed by another thread than the
+ * owner of the cache is queued for the owner.
+ */
+static void malloc_slab_free(void *block,
+                             const int slab_class,
+                             MallocSlabCache *cache)
+{
+    if (cache == global_malloc_slab_cache) {
+        *(void **)block = cache->free_list[slab_class];
+        cache->free_list[slab_class] = block;
+        cache->live--;
+        return;
+    }
+
+    CMOCKA_MUTEX_LOCK(&cache->remote_lock);
+    *(void **)block = cache->remote_list[slab_class];
+    cache->remote_list[slab_class] = block;
+    cache->remote_count[slab_class]++;
+    CMOCKA_MUTEX_UNLOCK(&cache->remote_lock);
+}
+
+/*
+ * Release all chunks of a cache at once if none of its blocks is in use
+ * anymore, with the same calling rules as malloc_slab_drain().
+ */
+static bool malloc_slab_cache_release(MallocSlabCache *cache)
+{
+    MallocSlabChunk *chunk;
+    int i;
+
+    for (i = 0; i < MALLOC_SLAB_CLASSES; i++) {
+        malloc_slab_drain(cache, i);
+    }
+    if (cache->live > 0) {
+        return false;
+    }
+
+    chunk = cache->chunks;
+    while (chunk != NULL) {
+        MallocSlabChunk *next = chunk->next;
+
+        malloc_chunk_unregister(&chunk->range);
+        libc_free(chunk);
+        chunk = next;
+    }
+    memset(cache->free_list, 0, sizeof(cache->free_list));
+    memset(cache->next, 0, sizeof(cache->next));
+    memset(cache->end, 0, sizeof(cache->end));
+    cache->chunks = NULL;
+
+    return true;
+}
+
+/*
+ * Release the chunks of the cache of the calling thread and of the caches of
+ * exited threads, where no slab block is in use anymore.
+ */
+static void malloc_slab_release(void)
+{
+    MallocSlabCache **link;
+
+    if (global_malloc_slab_cache != NULL) {
+        malloc_slab_cache_release(global_malloc_slab_cache);
+    }
+
+    CMOCKA_MUTEX_LOCK(&global_malloc_slab_lock);
+    link = &global_malloc_slab_caches;
+    while (*link != NULL) {
+        MallocSlabCache *cache = *link;
+        bool orphaned;
+
+        CMOCKA_MUTEX_LOCK(&cache->remote_lock);
+        orphaned = cache->orphaned;
+        CMOCKA_MUTEX_UNLOCK(&cache->remote_lock);
+
+        if (orphaned && malloc_slab_cache_release(cache)) {
+            *link = cache->next_cache;
+            CMOCKA_MUTEX_DESTROY(&cache->remote_lock);
+            libc_free(cache);
         } else {
-            fclose(fp);
-            if (file_append) {
-                fp = fopen(buf, "a");
-                if (fp != NULL) {
-                    file_opened = 1;
-                    xml_printed = 1;
-                } else {
-                    fp = stderr;
-                }
-            } else {
-                fp = stderr;
-            }
+            link = &cache->next_cache;
         }
     }
+    CMOCKA_MUTEX_UNLOCK(&global_malloc_slab_lock);
+}
+
+/* Allocate the memory of a block, from a slab if they are enabled. */
+static void *malloc_raw_alloc(const size_t size,
+                              int *slab_class,
+                              MallocSlabCache **slab_cache)
+{
+    *slab_class = cm_get_malloc_slab() ? malloc_slab_class(size) : -1;
+    *slab_cache = NULL;
+    if (*slab_class >= 0) {
+        return malloc_slab_alloc(*slab_class, slab_cache);
+    }
+
+    return libc_malloc(size);
+}
+
+/* Free the memory of a block allocated with malloc_raw_alloc(). */
+static void malloc_raw_free(void *block,
+                            const int slab_class,
+                            MallocSlabCache *slab_cache)
+{
+    if (slab_class >= 0) {
+        malloc_slab_free(block, slab_class, slab_cache);
+    } else {
+        libc_free(block);
+    }
+}
+
+void cmocka_set_malloc_page_guard(enum cm_malloc_page_guard mode,
+                                  size_t min_size)
+{
+    if (!cm_env_is_set(CM_ENV_MALLOC_PAGE_GUARD)) {
+        global_malloc_page_guard = mode;
+    }
+    if (!cm_env_is_set(CM_ENV_MALLOC_PAGE_GUARD_MIN_SIZE)) {
+        global_malloc_page_guard_min_size = min_size;
+    }
+}
+
+#ifdef HAVE_SYS_MMAN_H
+static size_t malloc_page_size(void)
+{
+    static size_t page_size;
+
+    if (page_size == 0) {
+        long rc = sysconf(_SC_PAGESIZE);
+
+        page_size = rc > 0 ? (size_t)rc : 4096;
+    }
+
+    return page_size;
+}
+#endif /* HAVE_SYS_MMAN_H */
+
+/* Return where to place a guard page for a block of the given size. */
+static enum cm_malloc_page_guard cm_get_malloc_page_guard(const size_t size,
+                                                          const size_t alignment)
+{
+    cm_load_env();
+
+#ifdef HAVE_SYS_MMAN_H
+    if (size < global_malloc_page_guard_min_size) {
+        return CM_MALLOC_PAGE_GUARD_OFF;
+    }
+    /* A left aligned block starts at a page boundary. */
+    if (global_malloc_page_guard == CM_MALLOC_PAGE_GUARD_LEFT &&
+        alignment > malloc_page_size()) {
+        return CM_MALLOC_PAGE_GUARD_OFF;
+    }
+
+    return global_malloc_page_guard;
+#else
+    (void)size;
+    (void)alignment;
+
+    return CM_MALLOC_PAGE_GUARD_OFF;
+#endif /* HAVE_SYS_MMAN_H */
+}
+
+#ifdef HAVE_SYS_MMAN_H
+/*
+ * Map a block next to an inaccessible guard page and return the pointer
+ * handed out to the caller. With right alignment, the data ends at the guard
+ * page, the few bytes left over by the alignment form the trailing guard.
+ * With left alignment, the data starts after the guard page and the header
+ * sits on the page before it, so guard_size is set to the page size.
+ */
+static char *malloc_page_guard_map(const size_t size,
+                                   const size_t alignment,
+                                   const enum cm_malloc_page_guard mode,
+                                   size_t *guard_size,
+                                   size_t *tail_guard_size,
+                                   char **block,
+                                   size_t *allocate_size)
+{
+    const size_t page_size = malloc_page_size();
+    const size_t page_mask = page_size - 1;
+    const size_t header_size = sizeof(struct MallocBlockInfoData);
+    size_t header_pages_size = 0;
+    size_t data_size;
+    char *map;
+    char *guard_page;
+    char *ptr;
+
+    if (mode == CM_MALLOC_PAGE_GUARD_RIGHT) {
+        data_size = (size + *guard_size + header_size + alignment +
+                     page_mask) & ~page_mask;
+    } else {
+        header_pages_size = (header_size + page_mask) & ~page_mask;
+        data_size = header_pages_size +
+                    ((size + *tail_guard_size + page_mask) & ~page_mask);
+    }
+    *allocate_size = data_size + page_size;
+    assert_true(*allocate_size > size);
+
+    map = mmap(NULL,
+               *allocate_size,
+               PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS,
+               -1,
+               0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    if (mode == CM_MALLOC_PAGE_GUARD_RIGHT) {
+        guard_page = map + data_size;
+        ptr = (char *)((size_t)(guard_page - size) & ~(alignment - 1));
+        *tail_guard_size = (size_t)(guard_page - (ptr + size));
+    } else {
+        guard_page = map + header_pages_size;
+        ptr = guard_page + page_size;
+        *guard_size = page_size;
+    }
+
+    if (mprotect(guard_page, page_size, PROT_NONE) != 0) {
+        munmap(map, *allocate_size);
+        return NULL;
+    }
+    *block = map;
+
+    return ptr;
+}
+#endif /* HAVE_SYS_MMAN_H */
+
+/* Hand the memory of a block back to its allocator. */
+static void malloc_block_release(struct MallocBlockInfoData *data)
+{
+#ifdef HAVE_SYS_MMAN_H
+    if (data->page_guard != CM_MALLOC_PAGE_GUARD_OFF) {
+        munmap(discard_const(data->block), data->allocated_size);
+        return;
+    }
+#endif
+    malloc_raw_free(data->block, data->slab_class, data->slab_cache);
+}
+
+/*
+ * Clear the mark of a quarantined block in its table slot before its memory
+ * is released and the address may be handed out by libc.
+ */
+static void malloc_table_unquarantine(const void *ptr)
+{
+    MallocShard *shard = malloc_shard(ptr);
+    MallocBlockEntry *entry;
+
+    CMOCKA_MUTEX_LOCK(&shard->lock);
+    entry = malloc_table_find(&shard->table, ptr);
+    if (entry != NULL && entry->data == NULL) {
+        entry->quarantined = false;
+    }
+    CMOCKA_MUTEX_UNLOCK(&shard->lock);
+}
+
+/*
+ * Fill a freed block with the free pattern and append it to the quarantine
+ * of a run.
+ */
+static void quarantine_add(MallocRun *run,
+                           struct MallocBlockInfoData *data,
+                           const char *file,
+                           const int line)
+{
+    set_source_location(&data->free_location, file, line);
+    memset(malloc_block_ptr(data) - data->guard_size,
+           MALLOC_FREE_PATTERN,
+           data->size + (data->guard_size * 2));
+
+    CMOCKA_MUTEX_LOCK(&run->quarantine_lock);
+    list_add(&run->quarantine, &data->node);
+    run->quarantine_bytes += data->allocated_size;
+    run->quarantine_count++;
+    CMOCKA_MUTEX_UNLOCK(&run->quarantine_lock);
+}
+
+/*
+ * Remove a block from the quarantine of a run and release it, with the
+ * quarantine lock held. If the block has been written to since it was freed, the
+ * corruption is displayed and false is returned.
+ */
+static bool quarantine_release(MallocRun *run,
+                               struct MallocBlockInfoData *data)
+{
+    const char *area = malloc_block_ptr(data) - data->guard_size;
+    const size_t area_size = data->size + (data->guard_size * 2);
+    bool intact = malloc_pattern_is_intact(area,
+                                           area_size,
+                                           MALLOC_FREE_PATTERN);
+
+    if (!intact) {
+        size_t i;
+
+        for (i = 0; (unsigned char)area[i] == MALLOC_FREE_PATTERN; i++) {
+        }
+
+        cmocka_print_error("Freed block %p size=%lu was modified at %p\n"
+                           SOURCE_LOCATION_FORMAT ": note: allocated here\n"
+                           SOURCE_LOCATION_FORMAT ": note: freed here\n",
+                           (void *)malloc_block_ptr(data),
+                           (unsigned long)data->size,
+                           (const void *)&area[i],
+                           data->location.file,
+                           data->location.line,
+                           data->free_location.file,
+                           data->free_location.line);
+        display_malloc_stack(data->stack);
+    }
+
+    list_remove(&data->node, NULL, NULL);
+    run->quarantine_bytes -= data->allocated_size;
+    run->quarantine_count--;
+    malloc_table_unquarantine(malloc_block_ptr(data));
+    malloc_block_release(data);
+
+    return intact;
+}
+
+/*
+ * Release the oldest blocks of the quarantine of a run until it fits into the
+ * given budget. This returns the number of blocks found modified after free.
+ */
+static size_t quarantine_evict(MallocRun *run, const size_t budget)
+{
+    ListNode *head = &run->quarantine;
+    size_t corrupt_blocks = 0;
+
+    CMOCKA_MUTEX_LOCK(&run->quarantine_lock);
+    while (run->quarantine_bytes > budget && !list_empty(head)) {
+        const MallocBlockInfo block_info = {
+            .ptr = discard_const(head->next->value),
+        };
+
+        if (!quarantine_release(run, block_info.data)) {
+            corrupt_blocks++;
+        }
+    }
+    CMOCKA_MUTEX_UNLOCK(&run->quarantine_lock);
+
+    return corrupt_blocks;
+}
+
+static unsigned int cm_get_malloc_backtrace_rate(void)
+{
+    cm_load_env();
+
+    return global_malloc_backtrace_rate;
+}
+
+void cmocka_set_malloc_backtrace(unsigned int sample_rate)
+{
+    if (!cm_env_is_set(CM_ENV_MALLOC_BACKTRACE)) {
+        global_malloc_backtrace_rate = sample_rate;
+    }
+    global_malloc_backtrace_countdown = 0;
+}
+
+void cmocka_set_malloc_sampling(size_t period, size_t bytes)
+{
+    if (!cm_env_is_set(CM_ENV_MALLOC_SAMPLE)) {
+        global_malloc_sample_period = period;
+    }
+    if (!cm_env_is_set(CM_ENV_MALLOC_SAMPLE_BYTES)) {
+        global_malloc_sample_bytes = bytes;
+    }
+    global_malloc_sample_countdown = 0;
+    global_malloc_sample_bytes_left = 0;
+}
+
+/*
+ * Decide whether an allocation of size bytes gets guard blocks, poisoning
+ * and a call stack. Every allocation does unless sampling is enabled.
+ */
+static bool malloc_sample(const size_t size)
+{
+    bool sampled = false;
+
+    cm_load_env();
+    if (global_malloc_sample_period == 0 && global_malloc_sample_bytes == 0) {
+        return true;
+    }
+
+    if (global_malloc_sample_period != 0) {
+        global_malloc_sample_countdown++;
+        if (global_malloc_sample_countdown >= global_malloc_sample_period) {
+            global_malloc_sample_countdown = 0;
+            sampled = true;
+        }
+    }
+
+    if (global_malloc_sample_bytes != 0) {
+        if (size >= global_malloc_sample_bytes_left) {
+            global_malloc_sample_bytes_left = global_malloc_sample_bytes;
+            sampled = true;
+        } else {
+            global_malloc_sample_bytes_left -= size;
+        }
+    }
+
+    return sampled;
+}
+
+/* Grow the slots of the stack table and index all stacks again. */
+static void malloc_stack_table_resize(MallocStackTable *table)
+{
+    size_t new_size = table->size > 0 ? table->size * 2 :
+                                        MALLOC_STACK_TABLE_MIN_SIZE;
+    size_t *slots = libc_calloc(new_size, sizeof(size_t));
+    size_t i;
+
+    assert_non_null(slots);
+
+    /* Stack 0 is the "no stack" entry and is not indexed. */
+    for (i = 1; i < table->count; i++) {
+        size_t j = table->stacks[i].hash & (new_size - 1);
+
+        while (slots[j] != 0) {
+            j = (j + 1) & (new_size - 1);
+        }
+        slots[j] = i;
+    }
+
+    libc_free(table->slots);
+    table->slots = slots;
+    table->size = new_size;
+}
+
+/* Return the index of a call stack, adding it to the table if it is new. */
+static size_t malloc_stack_intern(MallocStackTable *table,
+                                  const MallocStack *stack)
+{
+    size_t i;
+
+    if (table->count == 0) {
+        /* Reserve index 0. */
+        table->capacity = MALLOC_STACK_TABLE_MIN_SIZE;
+        table->stacks = libc_calloc(table->capacity, sizeof(MallocStack));
+        assert_non_null(table->stacks);
+        table->count = 1;
+    }
+
+    if (table->count * 2 >= table->size) {
+        malloc_stack_table_resize(table);
+    }
+
+    for (i = stack->hash & (table->size - 1);
+         table->slots[i] != 0;
+         i = (i + 1) & (table->size - 1)) {
+        const MallocStack *s = &table->stacks[table->slots[i]];
+
+        if (s->hash == stack->hash &&
+            s->depth == stack->depth &&
+            memcmp(s->frames,
+                   stack->frames,
+                   stack->depth * sizeof(void *)) == 0) {
+            return table->slots[i];
+        }
+    }
+
+    if (table->count == table->capacity) {
+        MallocStack *stacks = libc_realloc(table->stacks,
+                                           table->capacity * 2 *
+                                           sizeof(MallocStack));
+        assert_non_null(stacks);
+        table->stacks = stacks;
+        table->capacity *= 2;
+    }
+
+    table->stacks[table->count] = *stack;
+    table->slots[i] = table->count;
+
+    return table->count++;
+}
+
+/*
+ * Capture the call stack of an allocation if it is sampled, and return its
+ * index in the stack table or 0.
+ */
+static size_t malloc_capture_stack(void)
+{
+#ifdef HAVE_BACKTRACE
+    const unsigned int rate = cm_get_malloc_backtrace_rate();
+    void *frames[MALLOC_BACKTRACE_DEPTH + 1];
+    MallocStack stack = {
+        .hash = 2166136261u,
+    };
+    size_t index;
+    unsigned int i;
+    int depth;
+
+    if (rate == 0) {
+        return 0;
+    }
+    if (global_malloc_backtrace_countdown > 0) {
+        global_malloc_backtrace_countdown--;
+        return 0;
+    }
+    global_malloc_backtrace_countdown = rate - 1;
+
+    depth = backtrace(frames, ARRAY_SIZE(frames));
+    if (depth <= 1) {
+        return 0;
+    }
+
+    /* Skip the frame of this function. */
+    stack.depth = (unsigned int)depth - 1;
+    for (i = 0; i < stack.depth; i++) {
+        const uint64_t frame = (uint64_t)(uintptr_t)frames[i + 1];
+
+        stack.frames[i] = frames[i + 1];
+        /* FNV-1a over the frame addresses. */
+        stack.hash = (stack.hash ^ (uint32_t)(frame ^ (frame >> 32))) *
+                     16777619u;
+    }
+
+    CMOCKA_MUTEX_LOCK(&global_malloc_stack_lock);
+    index = malloc_stack_intern(&global_malloc_stacks, &stack);
+    CMOCKA_MUTEX_UNLOCK(&global_malloc_stack_lock);
+
+    return index;
+#else
+    return 0;
+#endif /* HAVE_BACKTRACE */
+}
+
+/* Display the call stack of a block, if one was captured. */
+static void display_malloc_stack(const size_t index)
+{
+#ifdef HAVE_BACKTRACE
+    const MallocStack *stack;
+    char **symbols;
+    unsigned int i;
+
+    if (index == 0) {
+        return;
+    }
+    CMOCKA_MUTEX_LOCK(&global_malloc_stack_lock);
+    stack = &global_malloc_stacks.stacks[index];
+
+    symbols = backtrace_symbols(stack->frames, (int)stack->depth);
+    for (i = 0; i < stack->depth; i++) {
+        if (symbols != NULL) {
+            cmocka_print_error("    #%u %s\n", i, symbols[i]);
+        } else {
+            cmocka_print_error("    #%u %p\n", i, stack->frames[i]);
+        }
+    }
+    CMOCKA_MUTEX_UNLOCK(&global_malloc_stack_lock);
+    libc_free(symbols);
+#else
+    (void)index;
+#endif /* HAVE_BACKTRACE */
+}
+
+/* Grow the slots of the site table and index all sites again. */
+static void malloc_site_table_resize(MallocSiteTable *table)
+{
+    size_t new_size = table->size > 0 ? table->size * 2 :
+                                        MALLOC_SITE_TABLE_MIN_SIZE;
+    size_t *slots = libc_calloc(new_size, sizeof(size_t));
+    size_t i;
+
+    assert_non_null(slots);
+
+    for (i = 1; i < table->count; i++) {
+        size_t j = table->sites[i].hash & (new_size - 1);
+
+        while (slots[j] != 0) {
+            j = (j + 1) & (new_size - 1);
+        }
+        slots[j] = i;
+    }
+
+    libc_free(table->slots);
+    table->slots = slots;
+    table->size = new_size;
+}
+
+/* Return the index of an allocation site, adding it if it is new. */
+static size_t malloc_site_intern(MallocSiteTable *table,
+                                 const char *file,
+                                 const int line,
+                                 const size_t stack)
+{
+    uint64_t h = (uint64_t)(uintptr_t)file ^
+                 ((uint64_t)(unsigned int)line << 32) ^
+                 ((uint64_t)stack * UINT64_C(0x9E3779B97F4A7C15));
+    uint32_t hash;
+    size_t i;
+
+    h *= UINT64_C(0x9E3779B97F4A7C15);
+    hash = (uint32_t)(h >> 32);
+
+    if (table->count == 0) {
+        /* Reserve index 0, so an empty slot can be told apart. */
+        table->capacity = MALLOC_SITE_TABLE_MIN_SIZE;
+        table->sites = libc_calloc(table->capacity, sizeof(MallocSite));
+        assert_non_null(table->sites);
+        table->count = 1;
+    }
+
+    if (table->count * 2 >= table->size) {
+        malloc_site_table_resize(table);
+    }
+
+    for (i = hash & (table->size - 1);
+         table->slots[i] != 0;
+         i = (i + 1) & (table->size - 1)) {
+        const MallocSite *site = &table->sites[table->slots[i]];
+
+        if (site->hash == hash &&
+            site->location.file == file &&
+            site->location.line == line &&
+            site->stack == stack) {
+            return table->slots[i];
+        }
+    }
+
+    if (table->count == table->capacity) {
+        MallocSite *sites = libc_realloc(table->sites,
+                                         table->capacity * 2 *
+                                         sizeof(MallocSite));
+        assert_non_null(sites);
+        table->sites = sites;
+        table->capacity *= 2;
+    }
+
+    table->sites[table->count] = (MallocSite) {
+        .location = {
+            .file = file,
+            .line = line,
+        },
+        .stack = stack,
+        .hash = hash,
+    };
+    table->slots[i] = table->count;
+
+    return table->count++;
+}
+
+void cmocka_set_heap_profile(int enable)
+{
+    if (!cm_env_is_set(CM_ENV_HEAP_PROFILE)) {
+        global_malloc_profile_enabled = (enable != 0);
+    }
+}
+
+static bool cm_get_heap_profile(void)
+{
+    cm_load_env();
+
+    return global_malloc_profile_enabled;
+}
+
+/* Account an allocation of the given size made at a site, call locked. */
+static void malloc_profile_add(MallocRun *run,
+                               const size_t site,
+                               const size_t size)
+{
+    size_t bucket = 0;
+    size_t n;
+
+    run->live_bytes += size;
+    if (run->live_bytes > run->peak_bytes) {
+        run->peak_bytes = run->live_bytes;
+    }
+
+    run->profile.allocations++;
+    run->profile.total_bytes += size;
+    for (n = size; n != 0; n >>= 1) {
+        bucket++;
+    }
+    run->profile.histogram[bucket]++;
+
+    run->sites.sites[site].allocations++;
+    run->sites.sites[site].bytes += size;
+    if (size == run->sites.sites[site].last_free_size) {
+        run->sites.sites[site].same_size_pairs++;
+        run->sites.sites[site].last_free_size = 0;
+    }
+
+    if (run->region_active) {
+        run->region_allocations++;
+        run->region_bytes += size;
+        run->sites.sites[site].region_allocations++;
+        run->sites.sites[site].region_bytes += size;
+    }
+}
+
+/*
+ * Whether new blocks of a run are counted at their allocation site. Only the
+ * heap profile, the limits, a region and a budget need the counters, a leak
+ * report looks up the sites of the leaked blocks itself.
+ */
+static bool malloc_run_accounting(MallocRun *run)
+{
+    return global_malloc_profile_enabled ||
+           global_malloc_test_limit != 0 ||
+           global_malloc_total_limit != 0 ||
+           CMOCKA_ATOMIC_LOAD(&run->region_active) ||
+           CMOCKA_ATOMIC_LOAD(&run->budget_active);
+}
+
+/*
+ * Add a new block to the run of the calling thread and account it. The
+ * header of the block has to be filled in up to the call stack.
+ */
+static void malloc_run_add(struct MallocBlockInfoData *data,
+                           const char *file,
+                           const int line)
+{
+    MallocRun *run = malloc_run();
+
+    data->run = run;
+    data->site = 0;
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    data->serial = ++run->serial;
+    data->accounted = malloc_run_accounting(run);
+    if (data->accounted) {
+        data->site = malloc_site_intern(&run->sites, file, line, data->stack);
+        malloc_profile_add(run, data->site, data->size);
+    }
+    if (!data->arena) {
+        list_add(&run->blocks, &data->node);
+    } else {
+        run->arena_bytes += data->size;
+        if (data->accounted) {
+            run->arena_accounted_bytes += data->size;
+        }
+    }
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+
+    malloc_total_bytes(data->size, 0);
+}
+
+/*
+ * Remove a block being freed from its run, and account its lifetime at its
+ * site.
+ */
+static void malloc_run_remove(struct MallocBlockInfoData *data)
+{
+    MallocRun *run = data->run;
+    MallocSite *site;
+    size_t bucket = 0;
+    uint64_t n;
+
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    if (!data->arena) {
+        list_remove(&data->node, NULL, NULL);
+    } else {
+        run->arena_bytes -= data->size;
+        if (data->accounted) {
+            run->arena_accounted_bytes -= data->size;
+        }
+    }
+    if (!data->accounted) {
+        CMOCKA_MUTEX_UNLOCK(&run->lock);
+        malloc_total_bytes(0, data->size);
+        return;
+    }
+    run->live_bytes -= data->size;
+
+    site = &run->sites.sites[data->site];
+    site->frees++;
+    site->last_free_size = data->size;
+    if (data->reallocs > site->longest_realloc_chain) {
+        site->longest_realloc_chain = data->reallocs;
+    }
+    for (n = run->serial - data->serial;
+         n != 0 && bucket < MALLOC_LIFETIME_BUCKETS - 1;
+         n >>= 1) {
+        bucket++;
+    }
+    site->lifetimes[bucket]++;
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+
+    malloc_total_bytes(0, data->size);
+}
+
+/*
+ * Let a block moved by test_realloc() take the place and the serial number of
+ * the old block in their run, so check points stay meaningful. A block moved
+ * into the run of another group stays a new allocation of that group. Blocks
+ * of the arena swap places in the arena, see malloc_arena_realloc().
+ */
+static void malloc_run_replace(const struct MallocBlockInfoData *old_data,
+                               struct MallocBlockInfoData *new_data)
+{
+    MallocRun *run = new_data->run;
+
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    if (old_data->run == run && old_data->arena == new_data->arena) {
+        if (!new_data->arena) {
+            list_remove(&new_data->node, NULL, NULL);
+            list_add(old_data->node.next, &new_data->node);
+        }
+        new_data->serial = old_data->serial;
+    }
+    new_data->reallocs = old_data->reallocs + 1;
+    if (new_data->accounted) {
+        run->sites.sites[new_data->site].reallocs++;
+    }
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+}
+
+/*
+ * Reset the heap counters of the run of the calling thread at a test start,
+ * budget tells whether the test has an allocation budget.
+ */
+static void malloc_profile_start(const bool budget)
+{
+    MallocRun *run = malloc_run();
+    size_t i;
+
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    memset(&run->profile, 0, sizeof(run->profile));
+    run->profile_start_bytes = run->live_bytes;
+    run->peak_bytes = run->live_bytes;
+    CMOCKA_ATOMIC_STORE(&run->region_active, false);
+    run->limit_armed = true;
+    CMOCKA_ATOMIC_STORE(&run->budget_active, budget);
+
+    for (i = 0; i < run->sites.count; i++) {
+        MallocSite *site = &run->sites.sites[i];
+
+        site->allocations = 0;
+        site->bytes = 0;
+        site->frees = 0;
+        site->same_size_pairs = 0;
+        site->last_free_size = 0;
+        site->reallocs = 0;
+        site->longest_realloc_chain = 0;
+        memset(site->lifetimes, 0, sizeof(site->lifetimes));
+    }
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+}
+
+/* Upper bound of the bucket holding the median lifetime of a site. */
+static size_t malloc_site_median_lifetime(const MallocSite *site)
+{
+    size_t count = 0;
+    size_t i;
+
+    for (i = 0; i < MALLOC_LIFETIME_BUCKETS - 1; i++) {
+        count += site->lifetimes[i];
+        if (count * 2 >= site->frees) {
+            break;
+        }
+    }
+
+    return (size_t)1 << i;
+}
+
+/* Insert a site into the list of churn sites sorted by frees, most first. */
+static void malloc_profile_add_churn(MallocProfile *profile,
+                                     const MallocSite *site)
+{
+    size_t j = profile->num_churn_sites;
+
+    if (site->frees == 0) {
+        return;
+    }
+
+    if (j < MALLOC_PROFILE_TOP_SITES) {
+        profile->num_churn_sites++;
+    } else if (site->frees > profile->churn_sites[j - 1].frees) {
+        j--;
+    } else {
+        return;
+    }
+    for (; j > 0 && site->frees > profile->churn_sites[j - 1].frees; j--) {
+        profile->churn_sites[j] = profile->churn_sites[j - 1];
+    }
+    profile->churn_sites[j] = (MallocChurnSite) {
+        .location = site->location,
+        .allocations = site->allocations,
+        .frees = site->frees,
+        .same_size_pairs = site->same_size_pairs,
+        .reallocs = site->reallocs,
+        .longest_realloc_chain = site->longest_realloc_chain,
+        .median_lifetime = malloc_site_median_lifetime(site),
+    };
+}
+
+/* Collect the heap counters of a test, with its top allocation sites. */
+static void malloc_profile_stop(MallocProfile *profile)
+{
+    MallocRun *run = malloc_run();
+    size_t i;
+
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    run->limit_armed = false;
+    CMOCKA_ATOMIC_STORE(&run->budget_active, false);
+    *profile = run->profile;
+    profile->peak_bytes = run->peak_bytes - run->profile_start_bytes;
+
+    for (i = 1; i < run->sites.count; i++) {
+        const MallocSite *site = &run->sites.sites[i];
+        size_t j;
+
+        malloc_profile_add_churn(profile, site);
+        if (site->allocations == 0) {
+            continue;
+        }
+
+        /* Insertion into the list sorted by bytes, largest first. */
+        j = profile->num_top_sites;
+        if (j < MALLOC_PROFILE_TOP_SITES) {
+            profile->num_top_sites++;
+        } else if (site->bytes > profile->top_sites[j - 1].bytes) {
+            j--;
+        } else {
+            continue;
+        }
+        for (; j > 0 && site->bytes > profile->top_sites[j - 1].bytes; j--) {
+            profile->top_sites[j] = profile->top_sites[j - 1];
+        }
+        profile->top_sites[j] = (MallocProfileSite) {
+            .location = site->location,
+            .allocations = site->allocations,
+            .bytes = site->bytes,
+        };
+    }
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+}
+
+/* Print the sites which allocated in the current test or region. */
+static void display_malloc_sites(const bool region)
+{
+    MallocRun *run = malloc_run();
+    size_t i;
+
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    for (i = 1; i < run->sites.count; i++) {
+        const MallocSite *site = &run->sites.sites[i];
+        size_t allocations = region ? site->region_allocations :
+                                      site->allocations;
+        size_t bytes = region ? site->region_bytes : site->bytes;
+
+        if (allocations == 0) {
+            continue;
+        }
+        cmocka_print_error(SOURCE_LOCATION_FORMAT
+                           ": note: %zu allocation(s) of %zu bytes here\n",
+                           site->location.file,
+                           site->location.line,
+                           allocations,
+                           bytes);
+        display_malloc_stack(site->stack);
+    }
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+}
+
+void cmocka_alloc_region_begin(void)
+{
+    MallocRun *run = malloc_run();
+    size_t i;
+
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    CMOCKA_ATOMIC_STORE(&run->region_active, true);
+    run->region_allocations = 0;
+    run->region_bytes = 0;
+
+    for (i = 0; i < run->sites.count; i++) {
+        run->sites.sites[i].region_allocations = 0;
+        run->sites.sites[i].region_bytes = 0;
+    }
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+}
+
+void _assert_alloc_region_end(const size_t max_allocs,
+                              const size_t max_bytes,
+                              const char * const file,
+                              const int line)
+{
+    MallocRun *run = malloc_run();
+    bool active;
+    size_t allocations;
+    size_t bytes;
+
+    /* Allocations of other threads of the test count as well. */
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    active = run->region_active;
+    allocations = run->region_allocations;
+    bytes = run->region_bytes;
+    CMOCKA_ATOMIC_STORE(&run->region_active, false);
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+
+    if (!active) {
+        cmocka_print_error(SOURCE_LOCATION_FORMAT
+                           ": error: No allocation region was started with "
+                           "cmocka_alloc_region_begin()\n",
+                           file,
+                           line);
+        _fail(file, line);
+    }
+
+    if (allocations > max_allocs || bytes > max_bytes) {
+        cmocka_print_error(SOURCE_LOCATION_FORMAT
+                           ": error: Allocation region made %zu allocation(s) "
+                           "of %zu bytes, the budget is %zu allocation(s) "
+                           "of %zu bytes\n",
+                           file,
+                           line,
+                           allocations,
+                           bytes,
+                           max_allocs,
+                           max_bytes);
+        display_malloc_sites(true);
+        _fail(file, line);
+    }
+}
+
+/* Check the allocations of the test function against its budget. */
+static bool check_alloc_budget(const char *test_name,
+                               const struct CMAllocBudget *budget)
+{
+    MallocRun *run = malloc_run();
+    size_t allocations;
+    size_t bytes;
+
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    allocations = run->profile.allocations;
+    bytes = run->profile.total_bytes;
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+
+    if (allocations <= budget->max_allocs && bytes <= budget->max_bytes) {
+        return true;
+    }
+
+    cmocka_print_error("%s made %zu allocation(s) of %zu bytes, the budget "
+                       "is %zu allocation(s) of %zu bytes\n",
+                       test_name,
+                       allocations,
+                       bytes,
+                       budget->max_allocs,
+                       budget->max_bytes);
+    display_malloc_sites(false);
+
+    return false;
+}
+
+void cmocka_set_malloc_limit(size_t test_limit, size_t total_limit)
+{
+    if (!cm_env_is_set(CM_ENV_MALLOC_TEST_LIMIT)) {
+        global_malloc_test_limit = test_limit;
+    }
+    if (!cm_env_is_set(CM_ENV_MALLOC_LIMIT)) {
+        global_malloc_total_limit = total_limit;
+    }
+}
+
+/* Fail the test if allocating size more bytes at file:line exceeds a limit. */
+static void check_malloc_limit(const size_t size,
+                               const char *file,
+                               const int line)
+{
+    MallocRun *run;
+    size_t live;
+    size_t test_live = 0;
+    bool armed;
+
+    cm_load_env();
+    if (global_malloc_test_limit == 0 && global_malloc_total_limit == 0) {
+        return;
+    }
+
+    run = malloc_run();
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    armed = run->limit_armed;
+    if (run->live_bytes > run->profile_start_bytes) {
+        test_live = run->live_bytes - run->profile_start_bytes;
+    }
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+    live = malloc_total_bytes(0, 0);
+
+    if (armed && global_malloc_test_limit != 0 &&
+        (size > global_malloc_test_limit ||
+         test_live > global_malloc_test_limit - size)) {
+        cmocka_print_error(SOURCE_LOCATION_FORMAT
+                           ": error: Allocating %zu bytes exceeds the limit "
+                           "of %zu bytes of the test, %zu bytes are in use\n",
+                           file,
+                           line,
+                           size,
+                           global_malloc_test_limit,
+                           test_live);
+        display_malloc_sites(false);
+        _fail(file, line);
+    }
+
+    if (global_malloc_total_limit != 0 &&
+        (size > global_malloc_total_limit ||
+         live > global_malloc_total_limit - size)) {
+        cmocka_print_error(SOURCE_LOCATION_FORMAT
+                           ": error: Allocating %zu bytes exceeds the total "
+                           "limit of %zu bytes, %zu bytes are in use\n",
+                           file,
+                           line,
+                           size,
+                           global_malloc_total_limit,
+                           live);
+        display_malloc_sites(false);
+        _fail(file, line);
+    }
+}
+
+#ifdef HAVE_SYS_RESOURCE_H
+/* Cap the data segment of the process at the total limit, if it is set. */
+static void malloc_limit_process(void)
+{
+#if defined(RLIMIT_DATA)
+    const int resource = RLIMIT_DATA;
+#else
+    const int resource = RLIMIT_AS;
+#endif
+    struct rlimit limit;
+    rlim_t total;
+
+    cm_load_env();
+    if (global_malloc_total_limit == 0 ||
+        getrlimit(resource, &limit) != 0) {
+        return;
+    }
+
+    total = (rlim_t)global_malloc_total_limit;
+    if (limit.rlim_max != RLIM_INFINITY && total > limit.rlim_max) {
+        total = limit.rlim_max;
+    }
+    if (limit.rlim_cur == RLIM_INFINITY || total < limit.rlim_cur) {
+        limit.rlim_cur = total;
+        setrlimit(resource, &limit);
+    }
+}
+#endif /* HAVE_SYS_RESOURCE_H */
+
+void cmocka_set_malloc_fail_nth(size_t n)
+{
+    if (!cm_env_is_set(CM_ENV_MALLOC_FAIL_NTH)) {
+        global_malloc_fail_nth = n;
+    }
+}
+
+void cmocka_set_malloc_fail_probability(double probability, unsigned int seed)
+{
+    if (!cm_env_is_set(CM_ENV_MALLOC_FAIL_PROBABILITY)) {
+        global_malloc_fail_probability = probability;
+    }
+    if (!cm_env_is_set(CM_ENV_MALLOC_FAIL_SEED)) {
+        global_malloc_fail_seed = seed;
+    }
+}
+
+void cmocka_set_malloc_fail_sweep(size_t max_allocations)
+{
+    if (!cm_env_is_set(CM_ENV_MALLOC_FAIL_SWEEP)) {
+        global_malloc_fail_sweep = max_allocations;
+    }
+}
+
+int cmocka_malloc_failure_injected(void)
+{
+    return global_malloc_fail_injected ? 1 : 0;
+}
+
+static size_t cm_get_malloc_fail_sweep(void)
+{
+    cm_load_env();
+
+    return global_malloc_fail_sweep;
+}
+
+/* Start counting the allocations of a test. */
+static void malloc_fail_start(void)
+{
+    cm_load_env();
+
+    global_malloc_fail_armed = true;
+    global_malloc_fail_count = 0;
+    global_malloc_fail_injected = false;
+    /* Every test sees the same sequence for a seed, xorshift needs non-zero. */
+    global_malloc_fail_random =
+        ((uint64_t)global_malloc_fail_seed << 1 | 1) *
+        UINT64_C(0x9E3779B97F4A7C15);
+}
+
+static void malloc_fail_stop(void)
+{
+    global_malloc_fail_armed = false;
+}
+
+/* Decide whether the current allocation of the test has to fail. */
+static bool malloc_fail_inject(void)
+{
+    bool fail = false;
+
+    if (!global_malloc_fail_armed) {
+        return false;
+    }
+
+    global_malloc_fail_count++;
+    if (global_malloc_fail_count == global_malloc_fail_nth) {
+        fail = true;
+    }
+
+    if (global_malloc_fail_probability > 0.0) {
+        uint64_t x = global_malloc_fail_random;
+
+        /* xorshift64* */
+        x ^= x >> 12;
+        x ^= x << 25;
+        x ^= x >> 27;
+        global_malloc_fail_random = x;
+        x *= UINT64_C(0x2545F4914F6CDD1D);
+
+        if ((double)(x >> 11) / 9007199254740992.0 <
+            global_malloc_fail_probability) {
+            fail = true;
+        }
+    }
+
+    if (fail) {
+        global_malloc_fail_injected = true;
+    }
+
+    return fail;
+}
+
+void cmocka_set_malloc_arena(int enable)
+{
+    if (!cm_env_is_set(CM_ENV_MALLOC_ARENA)) {
+        global_malloc_arena_enabled = (enable != 0);
+    }
+}
+
+static bool cm_get_malloc_arena(void)
+{
+    cm_load_env();
+
+    return global_malloc_arena_enabled;
+}
+
+/*
+ * Start an arena for the blocks of a test, if arenas are enabled. The arena
+ * belongs to the run of the test group, so groups running concurrently carve
+ * from and drop their own arenas.
+ */
+static void malloc_arena_begin(void)
+{
+    MallocRun *run;
+
+    if (!cm_get_malloc_arena()) {
+        return;
+    }
+
+    run = malloc_run();
+    CMOCKA_MUTEX_LOCK(&run->arena_lock);
+    run->arena.active = true;
+    run->arena.serial++;
+    run->arena.guard_size = cm_get_malloc_guard_size();
+    CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+}
+
+/*
+ * Release the arena of a test with all its blocks, whether they were freed
+ * or not. Leaks have been reported by then. The blocks are not visited, the
+ * bytes of those never freed leave their run at once.
+ */
+static void malloc_arena_drop(void)
+{
+    MallocRun *run = malloc_run();
+    MallocArena arena;
+    size_t bytes;
+
+    CMOCKA_MUTEX_LOCK(&run->arena_lock);
+    arena = run->arena;
+    memset(&run->arena, 0, sizeof(run->arena));
+    run->arena.serial = arena.serial;
+    CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    run->live_bytes -= run->arena_accounted_bytes;
+    bytes = run->arena_bytes;
+    run->arena_bytes = 0;
+    run->arena_accounted_bytes = 0;
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+    malloc_total_bytes(0, bytes);
+
+    while (arena.chunks != NULL) {
+        MallocArenaChunk *chunk = arena.chunks;
+
+        arena.chunks = chunk->next;
+        malloc_chunk_unregister(&chunk->range);
+        libc_free(chunk);
+    }
+    libc_free(arena.blocks);
+}
+
+/*
+ * Carve a block from the arena of the running test of the run of the calling
+ * thread. This returns the pointer
+ * handed out to the caller and the layout of the block, or NULL if there is
+ * no arena.
+ */
+static char *malloc_arena_alloc(const size_t size,
+                                const size_t alignment,
+                                size_t *guard_size,
+                                char **block,
+                                size_t *allocate_size)
+{
+    MallocRun *run = malloc_run();
+    MallocArena *arena = &run->arena;
+    MallocArenaChunk *chunk;
+    struct MallocBlockInfoData *data;
+    char *ptr;
+
+    CMOCKA_MUTEX_LOCK(&run->arena_lock);
+    if (!arena->active) {
+        CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+        return NULL;
+    }
+
+    *guard_size = arena->guard_size;
+    *allocate_size = (size + (*guard_size * 2) +
+                      sizeof(struct MallocBlockInfoData) + alignment +
+                      MALLOC_ALIGNMENT - 1) & ~(MALLOC_ALIGNMENT - 1);
+    if (*allocate_size <= size) {
+        CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+        return NULL;
+    }
+
+    if (arena->num_blocks == arena->max_blocks) {
+        size_t max_blocks = arena->max_blocks > 0 ? arena->max_blocks * 2 :
+                                                    MALLOC_TABLE_MIN_SIZE;
+        struct MallocBlockInfoData **blocks =
+            libc_realloc(arena->blocks, max_blocks * sizeof(*blocks));
+
+        if (blocks == NULL) {
+            CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+            return NULL;
+        }
+        arena->blocks = blocks;
+        arena->max_blocks = max_blocks;
+    }
+
+    chunk = arena->chunks;
+    if (chunk == NULL ||
+        (size_t)(chunk->range.end - chunk->used) < *allocate_size) {
+        size_t chunk_size = MALLOC_ARENA_MIN_CHUNK_SIZE;
+
+        if (arena->chunk_size >= MALLOC_ARENA_MAX_CHUNK_SIZE) {
+            chunk_size = MALLOC_ARENA_MAX_CHUNK_SIZE;
+        } else if (arena->chunk_size > 0) {
+            chunk_size = arena->chunk_size * 2;
+        }
+        arena->chunk_size = chunk_size;
+        /* A large block gets a chunk of its own. */
+        if (chunk_size - sizeof(MallocArenaChunk) < *allocate_size) {
+            chunk_size = sizeof(MallocArenaChunk) + *allocate_size;
+        }
+
+        chunk = libc_malloc(chunk_size);
+        if (chunk == NULL) {
+            CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+            return NULL;
+        }
+        chunk->range.start = (const char *)chunk;
+        chunk->range.end = (const char *)chunk + chunk_size;
+        chunk->range.arena_run = run;
+        chunk->range.arena_serial = arena->serial;
+        if (!malloc_chunk_register(&chunk->range)) {
+            CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+            libc_free(chunk);
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        chunk->used = (char *)(chunk + 1);
+        arena->chunks = chunk;
+    }
+
+    *block = chunk->used;
+    chunk->used += *allocate_size;
+    ptr = (char *)(((size_t)*block + *guard_size +
+                    sizeof(struct MallocBlockInfoData) +
+                    alignment) & ~(alignment - 1));
+
+    data = (struct MallocBlockInfoData *)(ptr - *guard_size -
+                                          sizeof(struct MallocBlockInfoData));
+    data->arena = true;
+    data->arena_freed = false;
+    data->arena_index = arena->num_blocks;
+    arena->blocks[arena->num_blocks++] = data;
+    CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+
+    return ptr;
+}
+
+/*
+ * Look up a block of an arena by the pointer handed out and the chunk holding
+ * it, call locked. The chunk of an arena already dropped holds no blocks.
+ */
+static struct MallocBlockInfoData *malloc_arena_find(const MallocArena *arena,
+                                                     const MallocChunk *range,
+                                                     const void *ptr)
+{
+    const MallocArenaChunk *chunk = (const MallocArenaChunk *)range->start;
+    struct MallocBlockInfoData *data;
+
+    if (!arena->active ||
+        range->arena_serial != arena->serial ||
+        (const char *)ptr <= (const char *)(chunk + 1) ||
+        (const char *)ptr >= chunk->used) {
+        return NULL;
+    }
+
+    data = (struct MallocBlockInfoData *)
+        ((const char *)ptr - arena->guard_size -
+         sizeof(struct MallocBlockInfoData));
+    if ((const char *)data >= (const char *)(chunk + 1) &&
+        data->arena &&
+        malloc_block_ptr(data) == ptr) {
+        return data;
+    }
+
+    return NULL;
+}
+
+/*
+ * Look up a block in the arena it was carved from, a block may be freed by a
+ * thread of another group. The chunk map tells the arena, so only the lock
+ * of its run is taken. If the block is found, this returns with that lock
+ * held.
+ */
+static struct MallocBlockInfoData *malloc_arena_lookup(const void *ptr,
+                                                       MallocRun **owner)
+{
+    struct MallocBlockInfoData *data;
+    MallocChunk chunk;
+
+    if (!malloc_chunk_find(ptr, &chunk) || chunk.arena_run == NULL) {
+        return NULL;
+    }
+
+    CMOCKA_MUTEX_LOCK(&chunk.arena_run->arena_lock);
+    data = malloc_arena_find(&chunk.arena_run->arena, &chunk, ptr);
+    if (data == NULL) {
+        CMOCKA_MUTEX_UNLOCK(&chunk.arena_run->arena_lock);
+        return NULL;
+    }
+    *owner = chunk.arena_run;
+
+    return data;
+}
+
+/*
+ * Look up a live block of the arena and check its guards, failing the test on
+ * a double free. With release set the block is marked as freed. This returns
+ * NULL if the pointer is not in the arena.
+ */
+static struct MallocBlockInfoData *malloc_arena_check(const void *ptr,
+                                                      const bool release,
+                                                      const char *file,
+                                                      const int line)
+{
+    struct MallocBlockInfoData *data;
+    MallocRun *run;
+    bool valid = false;
+
+    data = malloc_arena_lookup(ptr, &run);
+    if (data == NULL) {
+        return NULL;
+    }
+
+    if (data->arena_freed) {
+        cmocka_print_error(SOURCE_LOCATION_FORMAT
+                           ": error: Double free of %p\n"
+                           SOURCE_LOCATION_FORMAT ": note: allocated here\n"
+                           SOURCE_LOCATION_FORMAT ": note: freed here\n",
+                           file,
+                           line,
+                           ptr,
+                           data->location.file,
+                           data->location.line,
+                           data->free_location.file,
+                           data->free_location.line);
+    } else if (check_block_guards(data, file, line)) {
+        if (release) {
+            data->arena_freed = true;
+            set_source_location(&data->free_location, file, line);
+        }
+        valid = true;
+    }
+    CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+
+    if (!valid) {
+        _fail(file, line);
+    }
+
+    return data;
+}
+
+/*
+ * Free a block of the arena, its memory is reclaimed with the arena. This
+ * returns false if the pointer is not in the arena.
+ */
+static bool malloc_arena_free(void *ptr, const char *file, const int line)
+{
+    struct MallocBlockInfoData *data = malloc_arena_check(ptr, true, file, line);
+
+    if (data == NULL) {
+        return false;
+    }
+
+    malloc_run_remove(data);
+    malloc_poison_data(ptr,
+                       data->size,
+                       MALLOC_FREE_PATTERN,
+                       cm_get_malloc_poison());
+
+    return true;
+}
+
+/*
+ * Allocate an unsampled block on the thin path: a small header and the
+ * counters of its run, but no registry entry, serial number or allocation
+ * site. Thin blocks always come from a slab, so they can be told apart, see
+ * malloc_thin_header(). This returns NULL if the block needs the full header.
+ */
+static void *malloc_thin_alloc(const size_t size, const size_t alignment)
+{
+    MallocRun *run = malloc_run();
+    MallocThinHeader *header;
+    MallocSlabCache *slab_cache;
+    int slab_class;
+    char *block;
+    char *ptr;
+
+    if (!MALLOC_THIN_ENABLED ||
+        alignment != MALLOC_ALIGNMENT ||
+        sizeof(MallocThinHeader) % MALLOC_ALIGNMENT != 0 ||
+        size > SIZE_MAX - sizeof(MallocThinHeader) ||
+        malloc_run_accounting(run)) {
+        return NULL;
+    }
+
+    slab_class = malloc_slab_class(sizeof(MallocThinHeader) + size);
+    if (slab_class < 0) {
+        return NULL;
+    }
+    block = (char *)malloc_slab_alloc(slab_class, &slab_cache);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    ptr = block + sizeof(MallocThinHeader);
+    header = (MallocThinHeader *)block;
+    header->run = run;
+    header->slab_cache = slab_cache;
+    header->size = size;
+    header->slab_class = slab_class;
+    header->tag = (uintptr_t)ptr ^ MALLOC_THIN_TAG;
+    malloc_counter_add(&run->refs, 1, 0);
+    malloc_counter_add(&run->thin_bytes, size, 0);
+
+    return ptr;
+}
+
+/*
+ * Return where the header of a thin block at ptr would be. Only a pointer
+ * into a slab chunk can be a thin block, so the header is never read out of
+ * bounds. The tag of the header tells whether there is one. This returns NULL
+ * for any other pointer.
+ */
+static MallocThinHeader *malloc_thin_header(const void *ptr)
+{
+    MallocChunk chunk;
+    MallocThinHeader *header;
+
+    if (!MALLOC_THIN_ENABLED) {
+        return NULL;
+    }
+    if (!malloc_chunk_find(ptr, &chunk) ||
+        chunk.arena_run != NULL ||
+        (size_t)((const char *)ptr - chunk.start) <
+        sizeof(MallocThinHeader)) {
+        return NULL;
+    }
+    header = (MallocThinHeader *)((uintptr_t)ptr - sizeof(MallocThinHeader));
+
+#ifdef CMOCKA_ASAN
+    /* The guards of sanitized blocks in a slab are poisoned. */
+    if (__asan_region_is_poisoned(header, sizeof(*header)) != NULL) {
+        return NULL;
+    }
+#endif
+
+    return header;
+}
+
+/* Return the header of an allocated thin block, NULL for any other pointer. */
+static MallocThinHeader *malloc_thin_find(const void *ptr)
+{
+    MallocThinHeader *header = malloc_thin_header(ptr);
+
+    if (header == NULL || header->tag != ((uintptr_t)ptr ^ MALLOC_THIN_TAG)) {
+        return NULL;
+    }
+
+    return header;
+}
+
+/*
+ * Free a thin block, failing the test if it has been freed before. This
+ * returns false if the pointer is not a thin block.
+ */
+static bool malloc_thin_free(void *ptr, const char *file, const int line)
+{
+    MallocThinHeader *header = malloc_thin_header(ptr);
+
+    if (header == NULL) {
+        return false;
+    }
+    if (header->tag == ((uintptr_t)ptr ^ MALLOC_THIN_FREED_TAG)) {
+        cmocka_print_error(SOURCE_LOCATION_FORMAT
+                           ": error: Double free of %p, an unsampled block\n",
+                           file,
+                           line,
+                           ptr);
+        _fail(file, line);
+    }
+    if (header->tag != ((uintptr_t)ptr ^ MALLOC_THIN_TAG)) {
+        return false;
+    }
+
+    /* The tag is kept in the slab, so a second free is still recognized. */
+    header->tag = (uintptr_t)ptr ^ MALLOC_THIN_FREED_TAG;
+    malloc_counter_add(&header->run->thin_bytes, 0, header->size);
+    malloc_run_unref(header->run);
+    malloc_slab_free(header, header->slab_class, header->slab_cache);
+
+    return true;
+}
+
+/*
+ * Allocate a tracked block with the given power of two alignment. With
+ * arena_allowed unset the block is never carved from the arena of the test,
+ * as for a block moved from one allocated before the arena.
+ */
+static void *malloc_block_alloc(const size_t size,
+                                const size_t alignment,
+                                const bool arena_allowed,
+                                const char *file,
+                                const int line)
+{
+    char *ptr = NULL;
+    MallocBlockInfo block_info;
+    MallocShard *shard;
+    bool arena = false;
+    bool sampled;
+    enum cm_malloc_page_guard page_guard = CM_MALLOC_PAGE_GUARD_OFF;
+    bool sanitized = false;
+    size_t guard_size = 0;
+    size_t tail_guard_size;
+    size_t allocate_size = 0;
+    int slab_class = -1;
+    MallocSlabCache *slab_cache = NULL;
+    char *block = NULL;
+
+    check_malloc_limit(size, file, line);
+
+    if (arena_allowed && cm_get_malloc_arena()) {
+        ptr = malloc_arena_alloc(size,
+                                 alignment,
+                                 &guard_size,
+                                 &block,
+                                 &allocate_size);
+        arena = (ptr != NULL);
+    }
+
+    /* Blocks of an arena always have guards in the layout of the arena. */
+    sampled = arena || malloc_sample(size);
+    if (!sampled) {
+        ptr = malloc_thin_alloc(size, alignment);
+        if (ptr != NULL) {
+            return ptr;
+        }
+    }
+    if (sampled && !arena) {
+        page_guard = cm_get_malloc_page_guard(size, alignment);
+        sanitized = page_guard == CM_MALLOC_PAGE_GUARD_OFF &&
+                    cm_get_malloc_sanitizer();
+        guard_size = cm_get_malloc_guard_size();
+    }
+    tail_guard_size = guard_size;
+
+#ifdef HAVE_SYS_MMAN_H
+    if (!arena && page_guard != CM_MALLOC_PAGE_GUARD_OFF) {
+        ptr = malloc_page_guard_map(size,
+                                    alignment,
+                                    page_guard,
+                                    &guard_size,
+                                    &tail_guard_size,
+                                    &block,
+                                    &allocate_size);
+        assert_non_null(ptr);
+    } else
+#endif /* HAVE_SYS_MMAN_H */
+    if (!arena) {
+        allocate_size = size + (guard_size * 2) +
+                        sizeof(struct MallocBlockInfoData) + alignment;
+        assert_true(allocate_size > size);
+
+        block = (char *)malloc_raw_alloc(allocate_size,
+                                         &slab_class,
+                                         &slab_cache);
+        assert_non_null(block);
+
+        /* Calculate the returned address. */
+        ptr = (char*)(((size_t)block + guard_size +
+                      sizeof(struct MallocBlockInfoData) +
+                      alignment) & ~(alignment - 1));
+    }
+
+    /* Initialize the guard blocks. */
+    if (sanitized) {
+        malloc_sanitizer_guards(ptr, size, guard_size, tail_guard_size);
+    } else {
+        if (page_guard != CM_MALLOC_PAGE_GUARD_LEFT) {
+            memset(ptr - guard_size, MALLOC_GUARD_PATTERN, guard_size);
+        }
+        memset(ptr + size, MALLOC_GUARD_PATTERN, tail_guard_size);
+    }
+    if (sampled && !sanitized) {
+        malloc_poison_data(ptr,
+                           size,
+                           MALLOC_ALLOC_PATTERN,
+                           cm_get_malloc_poison());
+    }
+
+    block_info.ptr = ptr - (guard_size +
+                            sizeof(struct MallocBlockInfoData));
+    set_source_location(&block_info.data->location, file, line);
+    block_info.data->allocated_size = allocate_size;
+    block_info.data->size = size;
+    block_info.data->guard_size = guard_size;
+    block_info.data->tail_guard_size = tail_guard_size;
+    block_info.data->alignment = alignment;
+    block_info.data->slab_class = slab_class;
+    block_info.data->slab_cache = slab_cache;
+    block_info.data->page_guard = page_guard;
+    block_info.data->sampled = sampled;
+    block_info.data->sanitized = sanitized;
+    block_info.data->arena = arena;
+    block_info.data->arena_freed = false;
+    block_info.data->stack = sampled ? malloc_capture_stack() : 0;
+    block_info.data->reallocs = 0;
+    block_info.data->block = block;
+    block_info.data->node.value = block_info.ptr;
+    malloc_run_add(block_info.data, file, line);
+
+    /* The arena keeps track of its blocks. */
+    if (arena) {
+        return ptr;
+    }
+
+    shard = malloc_shard(ptr);
+    CMOCKA_MUTEX_LOCK(&shard->lock);
+    malloc_table_insert(&shard->table, block_info.data, ptr);
+    CMOCKA_MUTEX_UNLOCK(&shard->lock);
+
+    return ptr;
+}
+
+void* _test_malloc(const size_t size, const char* file, const int line) {
+    if (malloc_fail_inject()) {
+        return NULL;
+    }
+
+    return malloc_block_alloc(size, MALLOC_ALIGNMENT, true, file, line);
+}
+
+void *_test_aligned_alloc(const size_t alignment,
+                          const size_t size,
+                          const char *file,
+                          const int line)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (malloc_fail_inject()) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return malloc_block_alloc(size,
+                              alignment > MALLOC_ALIGNMENT ? alignment :
+                                                             MALLOC_ALIGNMENT,
+                              true,
+                              file,
+                              line);
+}
+
+int _test_posix_memalign(void **memptr,
+                         const size_t alignment,
+                         const size_t size,
+                         const char *file,
+                         const int line)
+{
+    if (alignment == 0 ||
+        alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+
+    *memptr = _test_aligned_alloc(alignment, size, file, line);
+    if (*memptr == NULL) {
+        return ENOMEM;
+    }
+
+    return 0;
+}
+
+void *_test_memalign(const size_t alignment,
+                     const size_t size,
+                     const char *file,
+                     const int line)
+{
+    return _test_aligned_alloc(alignment, size, file, line);
+}
+
+
+void* _test_calloc(const size_t number_of_elements, const size_t size,
+                   const char* file, const int line) {
+    void* const ptr = _test_malloc(number_of_elements * size, file, line);
+    if (ptr) {
+        memset(ptr, 0, number_of_elements * size);
+    }
+    return ptr;
+}
+#define calloc test_calloc
+
+
+void _test_free(void* const ptr, const char* file, const int line) {
+    char *block;
+    int slab_class;
+    MallocSlabCache *slab_cache;
+    size_t quarantine_size;
+    MallocRun *run;
+    MallocShard *shard;
+    MallocBlockEntry *entry;
+    MallocBlockInfo block_info;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    _assert_true(cast_ptr_to_uintmax_type(ptr), "ptr", file, line);
+    if (malloc_thin_free(ptr, file, line)) {
+        return;
+    }
+    if (malloc_arena_free(ptr, file, line)) {
+        return;
+    }
+
+    shard = malloc_shard(ptr);
+    CMOCKA_MUTEX_LOCK(&shard->lock);
+    entry = get_allocated_block_entry(shard, ptr, file, line);
+    if (entry == NULL || !check_block_guards(entry->data, file, line)) {
+        CMOCKA_MUTEX_UNLOCK(&shard->lock);
+        _fail(file, line);
+    }
+    block_info.data = entry->data;
+    malloc_table_remove(&shard->table, entry, file, line);
+    malloc_run_remove(block_info.data);
+
+    quarantine_size = cm_get_malloc_quarantine_size();
+    if (block_info.data->sampled &&
+        !block_info.data->sanitized &&
+        block_info.data->page_guard == CM_MALLOC_PAGE_GUARD_OFF &&
+        block_info.data->allocated_size <= quarantine_size) {
+        /* Keep the freed record until the block leaves the quarantine. */
+        entry->quarantined = true;
+        CMOCKA_MUTEX_UNLOCK(&shard->lock);
+        run = malloc_run();
+        quarantine_add(run, block_info.data, file, line);
+        if (quarantine_evict(run, quarantine_size) > 0) {
+            _fail(file, line);
+        }
+        return;
+    }
+    CMOCKA_MUTEX_UNLOCK(&shard->lock);
+
+    /* Unmapping a page guarded block makes any later access fault. */
+    if (block_info.data->page_guard != CM_MALLOC_PAGE_GUARD_OFF) {
+        malloc_block_release(block_info.data);
+        return;
+    }
+
+    block = discard_const_p(char, block_info.data->block);
+    slab_class = block_info.data->slab_class;
+    slab_cache = block_info.data->slab_cache;
+    if (!block_info.data->sampled) {
+        malloc_raw_free(block, slab_class, slab_cache);
+        return;
+    }
+    if (block_info.data->sanitized) {
+#ifdef CMOCKA_ASAN
+        /* Catch a use after free while the block is cached in a slab. */
+        __asan_poison_memory_region(ptr, block_info.data->size);
+#endif
+        malloc_raw_free(block, slab_class, slab_cache);
+        return;
+    }
+    switch (cm_get_malloc_poison()) {
+    case CM_MALLOC_POISON_FULL:
+        memset(block, MALLOC_FREE_PATTERN, block_info.data->allocated_size);
+        break;
+    case CM_MALLOC_POISON_CACHELINE:
+        malloc_poison_data(ptr,
+                           block_info.data->size,
+                           MALLOC_FREE_PATTERN,
+                           CM_MALLOC_POISON_CACHELINE);
+        break;
+    case CM_MALLOC_POISON_GUARDS:
+    case CM_MALLOC_POISON_OFF:
+        break;
+    }
+    malloc_raw_free(block, slab_class, slab_cache);
+}
+
+/*
+ * Move a block of the arena to a new block, blocks of the arena are never
+ * resized in place. This returns false if the pointer is not in the arena.
+ */
+static bool malloc_arena_realloc(void *ptr,
+                                 const size_t size,
+                                 const char *file,
+                                 const int line,
+                                 void **new_ptr)
+{
+    struct MallocBlockInfoData *data;
+    struct MallocBlockInfoData *new_data;
+    MallocRun *run;
+    size_t old_size;
+
+    data = malloc_arena_check(ptr, false, file, line);
+    if (data == NULL) {
+        return false;
+    }
+
+    /* On failure the block is left untouched. */
+    if (malloc_fail_inject()) {
+        *new_ptr = NULL;
+        return true;
+    }
+
+    old_size = data->size;
+    *new_ptr = malloc_block_alloc(size, data->alignment, true, file, line);
+    memcpy(*new_ptr, ptr, old_size < size ? old_size : size);
+
+    /* The new block takes the place of the old one in the arena. */
+    new_data = malloc_arena_lookup(*new_ptr, &run);
+    if (new_data != NULL) {
+        if (run == data->run) {
+            const size_t index = new_data->arena_index;
+
+            run->arena.blocks[data->arena_index] = new_data;
+            run->arena.blocks[index] = data;
+            new_data->arena_index = data->arena_index;
+            data->arena_index = index;
+        }
+        CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+        malloc_run_replace(data, new_data);
+    }
+
+    malloc_arena_free(ptr, file, line);
+
+    return true;
+}
+
+/*
+ * Move a thin block to a new block, which may be sampled. This returns false
+ * if the pointer is not a thin block.
+ */
+static bool malloc_thin_realloc(void *ptr,
+                                const size_t size,
+                                const char *file,
+                                const int line,
+                                void **new_ptr)
+{
+    MallocThinHeader *header = malloc_thin_find(ptr);
+    size_t old_size;
+
+    if (header == NULL) {
+        return false;
+    }
+
+    /* On failure the block is left untouched. */
+    if (malloc_fail_inject()) {
+        *new_ptr = NULL;
+        return true;
+    }
+
+    /* Thin blocks are never allocated while there is an arena. */
+    old_size = header->size;
+    *new_ptr = malloc_block_alloc(size, MALLOC_ALIGNMENT, false, file, line);
+    memcpy(*new_ptr, ptr, old_size < size ? old_size : size);
+    malloc_thin_free(ptr, file, line);
+
+    return true;
+}
+
+void *_test_realloc(void *ptr,
+                   const size_t size,
+                   const char *file,
+                   const int line)
+{
+    struct MallocBlockInfoData *data;
+    struct MallocBlockInfoData *new_data;
+    MallocShard *shard;
+    MallocBlockEntry *entry;
+    size_t old_size;
+    size_t guard_size;
+    size_t alignment;
+    size_t offset;
+    size_t allocate_size;
+    size_t stack;
+    int slab_class;
+    MallocSlabCache *slab_cache;
+    MallocRun *run;
+    char *block;
+    char *new_ptr;
+
+    if (ptr == NULL) {
+        return _test_malloc(size, file, line);
+    }
+
+    if (size == 0) {
+        _test_free(ptr, file, line);
+        return NULL;
+    }
+
+    if (malloc_thin_realloc(ptr, size, file, line, (void **)&new_ptr)) {
+        return new_ptr;
+    }
+    if (malloc_arena_realloc(ptr, size, file, line, (void **)&new_ptr)) {
+        return new_ptr;
+    }
+
+    shard = malloc_shard(ptr);
+    CMOCKA_MUTEX_LOCK(&shard->lock);
+    entry = get_allocated_block_entry(shard, ptr, file, line);
+    if (entry == NULL || !check_block_guards(entry->data, file, line)) {
+        CMOCKA_MUTEX_UNLOCK(&shard->lock);
+        _fail(file, line);
+    }
+    data = entry->data;
+    CMOCKA_MUTEX_UNLOCK(&shard->lock);
+
+    /* On failure the block is left untouched. */
+    if (malloc_fail_inject()) {
+        return NULL;
+    }
+
+    old_size = data->size;
+    guard_size = data->guard_size;
+    alignment = data->alignment;
+
+    if (data->page_guard != CM_MALLOC_PAGE_GUARD_OFF ||
+        cm_get_malloc_page_guard(size, alignment) != CM_MALLOC_PAGE_GUARD_OFF) {
+        /*
+         * Page guarded blocks are not resized in place, move the data. The
+         * block predates any arena, so the new one stays out of it.
+         */
+        new_ptr = malloc_block_alloc(size, alignment, false, file, line);
+        memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+
+        shard = malloc_shard(new_ptr);
+        CMOCKA_MUTEX_LOCK(&shard->lock);
+        entry = malloc_table_find(&shard->table, new_ptr);
+        new_data = entry != NULL ? entry->data : NULL;
+        CMOCKA_MUTEX_UNLOCK(&shard->lock);
+
+        /* A thin block is only counted, it takes no place in the run. */
+        if (new_data != NULL) {
+            malloc_run_replace(data, new_data);
+        }
+
+        _test_free(ptr, file, line);
+
+        return new_ptr;
+    }
+
+    if (size > old_size) {
+        check_malloc_limit(size - old_size, file, line);
+    }
+
+    offset = (size_t)((char *)ptr - (char *)data->block);
+
+    /* The leading guard is moved along with the data below. */
+    if (data->sanitized) {
+        malloc_sanitizer_unguard(data, ptr);
+    }
+
+    allocate_size = size + (guard_size * 2) +
+                    sizeof(struct MallocBlockInfoData) + alignment;
+    assert_true(allocate_size > size);
+
+    stack = data->sampled ? malloc_capture_stack() : 0;
+
+    /* The neighbours of the header in the run are fixed up once it moved. */
+    run = data->run;
+    CMOCKA_MUTEX_LOCK(&run->lock);
+
+    slab_class = data->slab_class;
+    slab_cache = data->slab_cache;
+    if (slab_class < 0) {
+        /*
+         * Resize the underlying block, the header and the leading guard move
+         * along with it. On failure the old block is left untouched.
+         */
+        block = (char *)libc_realloc(data->block, allocate_size);
+        if (block == NULL) {
+            CMOCKA_MUTEX_UNLOCK(&run->lock);
+            if (data->sanitized) {
+                malloc_sanitizer_guards(ptr, old_size, guard_size, guard_size);
+            }
+            return NULL;
+        }
+    } else if (allocate_size <= ((size_t)1 << (slab_class +
+                                               MALLOC_SLAB_MIN_SHIFT))) {
+        /* The block still fits in its slab. */
+        block = discard_const_p(char, data->block);
+    } else {
+        void *old_block = discard_const(data->block);
+
+        block = (char *)malloc_raw_alloc(allocate_size,
+                                         &slab_class,
+                                         &slab_cache);
+        if (block == NULL) {
+            CMOCKA_MUTEX_UNLOCK(&run->lock);
+            if (data->sanitized) {
+                malloc_sanitizer_guards(ptr, old_size, guard_size, guard_size);
+            }
+            return NULL;
+        }
+        new_ptr = (char*)(((size_t)block + guard_size +
+                          sizeof(struct MallocBlockInfoData) +
+                          alignment) & ~(alignment - 1));
+        memcpy(new_ptr - guard_size - sizeof(struct MallocBlockInfoData),
+               data,
+               sizeof(struct MallocBlockInfoData) + guard_size +
+               (old_size < size ? old_size : size));
+        malloc_raw_free(old_block, data->slab_class, data->slab_cache);
+        offset = (size_t)(new_ptr - block);
+    }
+
+    new_ptr = (char*)(((size_t)block + guard_size +
+                      sizeof(struct MallocBlockInfoData) +
+                      alignment) & ~(alignment - 1));
+    if ((size_t)(new_ptr - block) != offset) {
+        /* The new block has a different alignment, shift the contents. */
+        memmove(new_ptr - guard_size - sizeof(struct MallocBlockInfoData),
+                block + offset - guard_size - sizeof(struct MallocBlockInfoData),
+                sizeof(struct MallocBlockInfoData) + guard_size +
+                (old_size < size ? old_size : size));
+    }
+
+    data = (struct MallocBlockInfoData *)(new_ptr - guard_size -
+                                          sizeof(struct MallocBlockInfoData));
+    data->node.prev->next = &data->node;
+    data->node.next->prev = &data->node;
+    data->node.value = data;
+    set_source_location(&data->location, file, line);
+    data->stack = stack;
+    data->site = 0;
+    if (data->accounted) {
+        run->live_bytes -= old_size;
+    }
+    data->accounted = malloc_run_accounting(run);
+    if (data->accounted) {
+        data->site = malloc_site_intern(&run->sites, file, line, stack);
+        malloc_profile_add(run, data->site, size);
+        run->sites.sites[data->site].reallocs++;
+    }
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+    malloc_total_bytes(size, old_size);
+    data->block = block;
+    data->allocated_size = allocate_size;
+    data->tail_guard_size = guard_size;
+    data->slab_class = slab_class;
+    data->slab_cache = slab_cache;
+    data->size = size;
+    data->reallocs++;
+
+    /* Only the newly exposed tail needs to be initialized. */
+    if (data->sanitized) {
+        malloc_sanitizer_guards(new_ptr, size, guard_size, guard_size);
+    } else {
+        if (data->sampled && size > old_size) {
+            malloc_poison_data(new_ptr + old_size,
+                               size - old_size,
+                               MALLOC_ALLOC_PATTERN,
+                               cm_get_malloc_poison());
+        }
+        memset(new_ptr + size, MALLOC_GUARD_PATTERN, guard_size);
+    }
+
+    /* The block keeps its serial number, so check points stay meaningful. */
+    CMOCKA_MUTEX_LOCK(&shard->lock);
+    malloc_table_remove(&shard->table,
+                        malloc_table_find(&shard->table, ptr),
+                        file,
+                        line);
+    if (malloc_shard(new_ptr) != shard) {
+        CMOCKA_MUTEX_UNLOCK(&shard->lock);
+        shard = malloc_shard(new_ptr);
+        CMOCKA_MUTEX_LOCK(&shard->lock);
+    }
+    malloc_table_insert(&shard->table, data, new_ptr);
+    CMOCKA_MUTEX_UNLOCK(&shard->lock);
+
+    return new_ptr;
+}
+
+#ifdef HAVE_WEAK_REFERENCES
+/*
+ * Allocator interposition for code which isn't compiled with UNIT_TESTING.
+ *
+ * Linking a test with -Wl,--wrap=malloc,--wrap=free,... (see the
+ * WRAP_ALLOCATORS option of add_cmocka_test()) makes the linker resolve the
+ * allocator calls of all objects of the test to the functions below. While a
+ * test, setup or teardown function is running they are routed through the
+ * test_malloc() bookkeeping, so leaks anywhere in the executable are reported.
+ *
+ * The __real_*() symbols are only defined if cmocka itself is linked with
+ * --wrap, e.g. as a static library. In that case the libc_*() helpers end up
+ * here as well and global_malloc_wrap_depth sends them on to the C library.
+ * The wrappers are weak so a test can still provide its own __wrap_malloc().
+ */
+#define CMOCKA_WEAK __attribute__((weak))
+
+extern void *__real_malloc(size_t size) CMOCKA_WEAK;
+extern void *__real_calloc(size_t nmemb, size_t size) CMOCKA_WEAK;
+extern void *__real_realloc(void *ptr, size_t size) CMOCKA_WEAK;
+extern void __real_free(void *ptr) CMOCKA_WEAK;
+
+void *__wrap_malloc(size_t size) CMOCKA_WEAK;
+void *__wrap_calloc(size_t nmemb, size_t size) CMOCKA_WEAK;
+void *__wrap_realloc(void *ptr, size_t size) CMOCKA_WEAK;
+void __wrap_free(void *ptr) CMOCKA_WEAK;
+char *__wrap_strdup(const char *s) CMOCKA_WEAK;
+char *__wrap_strndup(const char *s, size_t n) CMOCKA_WEAK;
+int __wrap_vasprintf(char **strp, const char *format, va_list args)
+    CMOCKA_WEAK CMOCKA_PRINTF_ATTRIBUTE(2, 0);
+int __wrap_asprintf(char **strp, const char *format, ...)
+    CMOCKA_WEAK CMOCKA_PRINTF_ATTRIBUTE(2, 3);
+
+/* Source location of blocks allocated by code outside of the test. */
+#define MALLOC_WRAP_LOCATION "<wrapped allocator>"
+
+/*
+ * Whether the memory at ptr is held by the test allocators: a live block, or
+ * a freed block whose memory has not been released yet, so libc can't have
+ * handed out the address again. Only those pointers are passed on to
+ * test_free(), which then also reports a double free.
+ */
+static bool malloc_registry_holds(const void *ptr)
+{
+    MallocShard *shard = malloc_shard(ptr);
+    const MallocBlockEntry *entry;
+    const MallocThinHeader *thin;
+    MallocRun *run;
+    bool held;
+
+    thin = malloc_thin_header(ptr);
+    if (thin != NULL &&
+        (thin->tag == ((uintptr_t)ptr ^ MALLOC_THIN_TAG) ||
+         thin->tag == ((uintptr_t)ptr ^ MALLOC_THIN_FREED_TAG))) {
+        return true;
+    }
+
+    if (malloc_arena_lookup(ptr, &run) != NULL) {
+        CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+        return true;
+    }
+
+    CMOCKA_MUTEX_LOCK(&shard->lock);
+    entry = malloc_table_find(&shard->table, ptr);
+    held = entry != NULL && (entry->data != NULL || entry->quarantined);
+    CMOCKA_MUTEX_UNLOCK(&shard->lock);
+
+    return held;
+}
+
+void *__wrap_malloc(size_t size)
+{
+    if (global_malloc_wrap_depth > 0) {
+        return __real_malloc(size);
+    }
+    if (!global_running_test) {
+        return libc_malloc(size);
+    }
+
+    return _test_malloc(size, MALLOC_WRAP_LOCATION, 0);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    if (global_malloc_wrap_depth > 0) {
+        return __real_calloc(nmemb, size);
+    }
+    if (!global_running_test) {
+        return libc_calloc(nmemb, size);
+    }
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return _test_calloc(nmemb, size, MALLOC_WRAP_LOCATION, 0);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    if (global_malloc_wrap_depth > 0) {
+        return __real_realloc(ptr, size);
+    }
+
+    /* Blocks allocated before the test started stay with the C library. */
+    if (ptr != NULL && !malloc_registry_holds(ptr)) {
+        return libc_realloc(ptr, size);
+    }
+    if (ptr == NULL && !global_running_test) {
+        return libc_malloc(size);
+    }
+
+    return _test_realloc(ptr, size, MALLOC_WRAP_LOCATION, 0);
+}
+
+void __wrap_free(void *ptr)
+{
+    if (global_malloc_wrap_depth > 0) {
+        __real_free(ptr);
+        return;
+    }
+
+    /*
+     * The record of a freed and released block is not enough, libc may have
+     * handed out the address to code running outside of a test since.
+     */
+    if (ptr != NULL && malloc_registry_holds(ptr)) {
+        _test_free(ptr, MALLOC_WRAP_LOCATION, 0);
+        return;
+    }
+
+    libc_free(ptr);
+}
+
+char *__wrap_strndup(const char *s, size_t n)
+{
+    const char *end = (const char *)memchr(s, '\0', n);
+    char *copy;
+
+    if (end != NULL) {
+        n = (size_t)(end - s);
+    }
+
+    copy = (char *)__wrap_malloc(n + 1);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, s, n);
+    copy[n] = '\0';
+
+    return copy;
+}
+
+char *__wrap_strdup(const char *s)
+{
+    return __wrap_strndup(s, strlen(s));
+}
+
+int __wrap_vasprintf(char **strp, const char *format, va_list args)
+{
+    va_list ap;
+    int len;
+
+    va_copy(ap, args);
+    len = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+    if (len < 0) {
+        return -1;
+    }
+
+    *strp = (char *)__wrap_malloc((size_t)len + 1);
+    if (*strp == NULL) {
+        return -1;
+    }
+    vsnprintf(*strp, (size_t)len + 1, format, args);
+
+    return len;
+}
+
+int __wrap_asprintf(char **strp, const char *format, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = __wrap_vasprintf(strp, format, args);
+    va_end(args);
+
+    return len;
+}
+#endif /* HAVE_WEAK_REFERENCES */
+
+/*
+ * Return the thin blocks of a run of a test group in progress which have not
+ * been reported as leaked yet. All but the reference of the group are theirs.
+ */
+static size_t malloc_run_thin_blocks(MallocRun *run)
+{
+    return malloc_counter_add(&run->refs, 0, 0) - 1 -
+           run->thin_forgotten_blocks;
+}
+
+/*
+ * Checkpoint the heap state of the run of the calling thread. Blocks allocated
+ * later in the run have a larger serial number, or come later in its arena.
+ * Thin blocks are only counted.
+ */
+static MallocCheckPoint check_point_allocated_blocks(void) {
+    MallocRun *run = malloc_run();
+    MallocCheckPoint check_point;
+
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    check_point.serial = run->serial;
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+    CMOCKA_MUTEX_LOCK(&run->arena_lock);
+    check_point.arena_serial = run->arena.serial;
+    check_point.arena_blocks = run->arena.num_blocks;
+    CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+    check_point.thin_blocks = malloc_run_thin_blocks(run);
+    check_point.thin_bytes = malloc_counter_add(&run->thin_bytes, 0, 0) -
+                             run->thin_forgotten_bytes;
+
+    return check_point;
+}
+
+/*
+ * Count the thin blocks of the run of the calling thread which were allocated
+ * after the specified check point and not freed. Only the balance is known,
+ * blocks from before the check point freed since offset new ones.
+ */
+static size_t count_thin_blocks(const MallocCheckPoint check_point,
+                                size_t *bytes)
+{
+    MallocRun *run = malloc_run();
+    size_t blocks;
+
+    blocks = malloc_run_thin_blocks(run) - check_point.thin_blocks;
+    *bytes = malloc_counter_add(&run->thin_bytes, 0, 0) -
+             run->thin_forgotten_bytes - check_point.thin_bytes;
+    if (blocks == 0 || blocks > SIZE_MAX / 2) {
+        *bytes = 0;
+        return 0;
+    }
+
+    return blocks;
+}
+
+/*
+ * Collect the blocks of the run of the calling thread allocated after the
+ * specified check point, oldest first, followed by the live blocks of the
+ * arena allocated after it. The blocks of a run and of an arena are kept in
+ * allocation order, so only the new ones are visited. The threads of the test
+ * have to be finished, the blocks must not be freed while the returned array
+ * is in use. The array is released with libc_free().
+ */
+static struct MallocBlockInfoData **collect_allocated_blocks(
+    const MallocCheckPoint check_point, size_t *count)
+{
+    MallocRun *run = malloc_run();
+    struct MallocBlockInfoData **blocks = NULL;
+    ListNode *first = &run->blocks;
+    size_t list_count = 0;
+    size_t arena_first;
+    size_t i;
+
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    CMOCKA_MUTEX_LOCK(&run->arena_lock);
+    while (first->prev != &run->blocks) {
+        const MallocBlockInfo block_info = {
+            .ptr = discard_const(first->prev->value),
+        };
+
+        if (block_info.data->serial <= check_point.serial) {
+            break;
+        }
+        first = first->prev;
+        list_count++;
+    }
+
+    /* An arena started after the check point is new as a whole. */
+    arena_first = check_point.arena_serial == run->arena.serial ?
+                  check_point.arena_blocks : 0;
+    *count = list_count;
+    for (i = arena_first; i < run->arena.num_blocks; i++) {
+        if (!run->arena.blocks[i]->arena_freed) {
+            (*count)++;
+        }
+    }
+
+    if (*count > 0) {
+        blocks = libc_malloc(*count * sizeof(*blocks));
+        if (blocks == NULL) {
+            CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+            CMOCKA_MUTEX_UNLOCK(&run->lock);
+            assert_non_null(blocks);
+        }
+        for (i = 0; i < list_count; i++, first = first->next) {
+            blocks[i] = discard_const(first->value);
+        }
+        for (i = arena_first; i < run->arena.num_blocks; i++) {
+            if (!run->arena.blocks[i]->arena_freed) {
+                blocks[list_count++] = run->arena.blocks[i];
+            }
+        }
+    }
+    CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+
+    return blocks;
+}
+
+
+void cmocka_set_malloc_leak_details(int enable)
+{
+    if (!cm_env_is_set(CM_ENV_MALLOC_LEAK_DETAILS)) {
+        global_malloc_leak_details = (enable != 0);
+    }
+}
+
+static bool cm_get_malloc_leak_details(void)
+{
+    cm_load_env();
+
+    return global_malloc_leak_details;
+}
+
+/* Display the blocks allocated after the specified check point, grouped by
+ * allocation site.  This function returns the number of blocks displayed. */
+static size_t display_allocated_blocks(const MallocCheckPoint check_point) {
+    MallocRun *run;
+    size_t allocated_blocks = 0;
+    size_t allocated_bytes = 0;
+    size_t thin_blocks;
+    size_t thin_bytes;
+    struct MallocBlockInfoData **blocks;
+    size_t top_sites[MALLOC_LEAK_TOP_SITES];
+    size_t num_top_sites = 0;
+    size_t num_sites = 0;
+    size_t other_blocks;
+    size_t other_bytes;
+    size_t i;
+
+    thin_blocks = count_thin_blocks(check_point, &thin_bytes);
+    blocks = collect_allocated_blocks(check_point, &allocated_blocks);
+    if (allocated_blocks == 0 && thin_blocks == 0) {
+        return 0;
+    }
+
+    run = malloc_run();
+    CMOCKA_MUTEX_LOCK(&run->lock);
+    for (i = 0; i < allocated_blocks; i++) {
+        MallocSite *site;
+
+        /* Sites of blocks allocated without accounting are looked up now. */
+        if (blocks[i]->site == 0) {
+            blocks[i]->site = malloc_site_intern(&run->sites,
+                                                 blocks[i]->location.file,
+                                                 blocks[i]->location.line,
+                                                 blocks[i]->stack);
+        }
+        site = &run->sites.sites[blocks[i]->site];
+
+        if (site->leaked_blocks == 0) {
+            num_sites++;
+        }
+        site->leaked_blocks++;
+        site->leaked_bytes += blocks[i]->size;
+        allocated_bytes += blocks[i]->size;
+    }
+
+    /* Pick the sites which leaked the most bytes, largest first. */
+    for (i = 1; i < run->sites.count; i++) {
+        const MallocSite *site = &run->sites.sites[i];
+        size_t j;
+
+        if (site->leaked_blocks == 0) {
+            continue;
+        }
+
+        j = num_top_sites;
+        if (j < MALLOC_LEAK_TOP_SITES) {
+            num_top_sites++;
+        } else if (site->leaked_bytes >
+                   run->sites.sites[top_sites[j - 1]].leaked_bytes) {
+            j--;
+        } else {
+            continue;
+        }
+        for (; j > 0 &&
+               site->leaked_bytes >
+               run->sites.sites[top_sites[j - 1]].leaked_bytes;
+             j--) {
+            top_sites[j] = top_sites[j - 1];
+        }
+        top_sites[j] = i;
+    }
+
+    cmocka_print_error("Blocks allocated...\n");
+    other_blocks = allocated_blocks;
+    other_bytes = allocated_bytes;
+    for (i = 0; i < num_top_sites; i++) {
+        const MallocSite *site = &run->sites.sites[top_sites[i]];
+
+        cmocka_print_error(SOURCE_LOCATION_FORMAT
+                           ": note: %zu block(s) of %zu bytes allocated here\n",
+                           site->location.file,
+                           site->location.line,
+                           site->leaked_blocks,
+                           site->leaked_bytes);
+        display_malloc_stack(site->stack);
+        other_blocks -= site->leaked_blocks;
+        other_bytes -= site->leaked_bytes;
+    }
+    if (num_sites > num_top_sites) {
+        cmocka_print_error("note: %zu block(s) of %zu bytes allocated at %zu "
+                           "other site(s)\n",
+                           other_blocks,
+                           other_bytes,
+                           num_sites - num_top_sites);
+    }
+    if (thin_blocks > 0) {
+        cmocka_print_error("note: %zu unsampled block(s) of %zu bytes "
+                           "allocated at unrecorded sites\n",
+                           thin_blocks,
+                           thin_bytes);
+    }
+    cmocka_print_error("note: %zu block(s) of %zu bytes allocated at %zu "
+                       "site(s) in total\n",
+                       allocated_blocks + thin_blocks,
+                       allocated_bytes + thin_bytes,
+                       num_sites);
+
+    for (i = 1; i < run->sites.count; i++) {
+        run->sites.sites[i].leaked_blocks = 0;
+        run->sites.sites[i].leaked_bytes = 0;
+    }
+    CMOCKA_MUTEX_UNLOCK(&run->lock);
+
+    if (cm_get_malloc_leak_details()) {
+        for (i = 0; i < allocated_blocks; i++) {
+            cmocka_print_error(SOURCE_LOCATION_FORMAT
+                               ": note: block %p size=%lu allocated here\n",
+                               blocks[i]->location.file,
+                               blocks[i]->location.line,
+                               (void *)malloc_block_ptr(blocks[i]),
+                               (unsigned long)blocks[i]->size);
+            display_malloc_stack(blocks[i]->stack);
+        }
+    }
+    libc_free(blocks);
+
+    return allocated_blocks + thin_blocks;
+}
+
+
+/*
+ * Free all blocks allocated after the specified check point. Thin blocks
+ * can't be found, they are left allocated and not reported again. Blocks of
+ * the arena are only marked as freed, they are released with the arena.
+ */
+static void free_allocated_blocks(const MallocCheckPoint check_point) {
+    MallocRun *run = malloc_run();
+    struct MallocBlockInfoData **blocks;
+    size_t thin_bytes;
+    size_t count;
+    size_t i;
+
+    count = count_thin_blocks(check_point, &thin_bytes);
+    run->thin_forgotten_blocks += count;
+    run->thin_forgotten_bytes += thin_bytes;
+
+    blocks = collect_allocated_blocks(check_point, &count);
+    for (i = 0; i < count; i++) {
+        if (blocks[i]->arena) {
+            CMOCKA_MUTEX_LOCK(&run->arena_lock);
+            blocks[i]->arena_freed = true;
+            CMOCKA_MUTEX_UNLOCK(&run->arena_lock);
+        } else {
+            free(malloc_block_ptr(blocks[i]));
+        }
+    }
+    libc_free(blocks);
+}
+
+
+/* Fail if any any blocks are allocated after the specified check point. */
+static void fail_if_blocks_allocated(const MallocCheckPoint check_point,
+                                     const char * const test_name) {
+    const size_t allocated_blocks = display_allocated_blocks(check_point);
+    if (allocated_blocks > 0) {
+        free_allocated_blocks(check_point);
+        cmocka_print_error("ERROR: %s leaked %zu block(s)\n", test_name,
+                       allocated_blocks);
+        exit_test(true);
+    }
+}
+
+
+/*
+ * Fail if any block in the quarantine has been modified after it was freed.
+ * Corrupt blocks are released, so they are only reported once.
+ */
+static void fail_if_quarantine_corrupt(const char * const test_name) {
+    MallocRun *run = malloc_run();
+    ListNode *head = &run->quarantine;
+    ListNode *node;
+    size_t corrupt_blocks = 0;
+
+    CMOCKA_MUTEX_LOCK(&run->quarantine_lock);
+    node = head->next;
+    while (node != head) {
+        const MallocBlockInfo block_info = {
+            .ptr = discard_const(node->value),
+        };
+        const char *area = malloc_block_ptr(block_info.data) -
+                           block_info.data->guard_size;
+
+        node = node->next;
+        if (!malloc_pattern_is_intact(area,
+                                      block_info.data->size +
+                                      (block_info.data->guard_size * 2),
+                                      MALLOC_FREE_PATTERN)) {
+            quarantine_release(run, block_info.data);
+            corrupt_blocks++;
+        }
+    }
+    CMOCKA_MUTEX_UNLOCK(&run->quarantine_lock);
+
+    if (corrupt_blocks > 0) {
+        cmocka_print_error("ERROR: %s used %zu block(s) after free\n",
+                           test_name,
+                           corrupt_blocks);
+        exit_test(true);
+    }
+}
+
+
+void _fail(const char * const file, const int line) {
+    uint32_t output = cm_get_output();
+
+    if (output & CM_OUTPUT_STANDARD) {
+        cmocka_print_error("[   LINE   ] --- " SOURCE_LOCATION_FORMAT
+                       ": error: Failure!",
+                       file, line);
+    }
+    if ((output & CM_OUTPUT_SUBUNIT) || (output & CM_OUTPUT_TAP) ||
+        (output & CM_OUTPUT_XML)) {
+        cmocka_print_error(SOURCE_LOCATION_FORMAT ": error: Failure!", file, line);
+    }
+    exit_test(true);
+
+    /* Unreachable */
+    exit(EXIT_FAILURE);
+}
+
+
+#if (!defined(_WIN32) && defined(HAVE_SIGACTION)) || defined(CMOCKA_ASAN)
+/*
+ * Report the block owning the guard page, or the guard blocks poisoned by
+ * AddressSanitizer, containing a faulting address.
+ */
+static void display_malloc_fault(const void *address)
+{
+    size_t i;
+
+    /*
+     * The shard locks are not taken, the faulting thread might hold one and
+     * the test crashed anyway.
+     */
+    for (i = 0; i < MALLOC_SHARDS; i++) {
+        const MallocBlockTable *table = &global_malloc_shards[i].table;
+        size_t j;
+
+        for (j = 0; j < table->size; j++) {
+            const struct MallocBlockInfoData *data = table->entries[j].data;
+            const char *ptr;
+            const char *guard_begin;
+            const char *guard_end;
+            const char *kind;
+
+            if (data == NULL) {
+                continue;
+            }
+
+            ptr = malloc_block_ptr(data);
+            if (data->sanitized) {
+                guard_begin = ptr - data->guard_size;
+                guard_end = ptr + data->size + data->tail_guard_size;
+#ifdef HAVE_SYS_MMAN_H
+            } else if (data->page_guard == CM_MALLOC_PAGE_GUARD_RIGHT) {
+                guard_begin = ptr + data->size + data->tail_guard_size;
+                guard_end = guard_begin + malloc_page_size();
+            } else if (data->page_guard == CM_MALLOC_PAGE_GUARD_LEFT) {
+                guard_begin = ptr - data->guard_size;
+                guard_end = guard_begin + malloc_page_size();
+#endif /* HAVE_SYS_MMAN_H */
+            } else {
+                continue;
+            }
+            if ((const char *)address < guard_begin ||
+                (const char *)address >= guard_end) {
+                continue;
+            }
+
+            if ((const char *)address < ptr) {
+                kind = "underflow";
+            } else if ((const char *)address >= ptr + data->size) {
+                kind = "overflow";
+            } else {
+                kind = "access";
+            }
+            cmocka_print_error(SOURCE_LOCATION_FORMAT
+                               ": note: %s of block %p size=%lu allocated "
+                               "here\n",
+                               data->location.file,
+                               data->location.line,
+                               kind,
+                               (const void *)ptr,
+                               (unsigned long)data->size);
+            display_malloc_stack(data->stack);
+            return;
+        }
+    }
+}
+#endif /* (!_WIN32 && HAVE_SIGACTION) || CMOCKA_ASAN */
+
+#ifndef _WIN32
+#ifdef HAVE_SIGACTION
+CMOCKA_NORETURN static void exception_handler(int sig,
+                                              siginfo_t *info,
+                                              void *context) {
+    const char *sig_strerror = "";
+
+    (void)context; /* unused */
+
+#ifdef HAVE_STRSIGNAL
+    sig_strerror = strsignal(sig);
+#endif
+
+    if (sig == SIGSEGV
+#ifdef SIGBUS
+        || sig == SIGBUS
+#endif
+        ) {
+        cmocka_print_error("Invalid memory access at %p\n", info->si_addr);
+        display_malloc_fault(info->si_addr);
+    }
+
+    cmocka_print_error("Test failed with exception: %s(%d)",
+                   sig_strerror, sig);
+    exit_test(true);
+
+    /* Unreachable */
+    exit(EXIT_FAILURE);
+}
+#else
+CMOCKA_NORETURN static void exception_handler(int sig) {
+    const char *sig_strerror = "";
+
+#ifdef HAVE_STRSIGNAL
+    sig_strerror = strsignal(sig);
+#endif
+
+    cmocka_print_error("Test failed with exception: %s(%d)",
+                   sig_strerror, sig);
+    exit_test(true);
+
+    /* Unreachable */
+    exit(EXIT_FAILURE);
+}
+#endif /* HAVE_SIGACTION */
+
+#else /* _WIN32 */
+
+static LONG WINAPI exception_filter(EXCEPTION_POINTERS *exception_pointers) {
+    EXCEPTION_RECORD * const exception_record =
+        exception_pointers->ExceptionRecord;
+    const DWORD code = exception_record->ExceptionCode;
+    unsigned int i;
+    for (i = 0; i < ARRAY_SIZE(exception_codes); i++) {
+        const ExceptionCodeInfo * const code_info = &exception_codes[i];
+        if (code == code_info->code) {
+            static int shown_debug_message = 0;
+            fflush(stdout);
+            cmocka_print_error("%s occurred at %p.\n", code_info->description,
+                        exception_record->ExceptionAddress);
+            if (!shown_debug_message) {
+                cmocka_print_error(
+                    "\n"
+                    "To debug in Visual Studio...\n"
+                    "1. Select menu item File->Open Project\n"
+                    "2. Change 'Files of type' to 'Executable Files'\n"
+                    "3. Open this executable.\n"
+                    "4. Select menu item Debug->Start\n"
+                    "\n"
+                    "Alternatively, set the environment variable \n"
+                    "UNIT_TESTING_DEBUG to 1 and rebuild this executable, \n"
+                    "then click 'Debug' in the popup dialog box.\n"
+                    "\n");
+                shown_debug_message = 1;
+            }
+            exit_test(false);
+            return EXCEPTION_EXECUTE_HANDLER;
+        }
+    }
+    return EXCEPTION_CONTINUE_SEARCH;
+}
+#endif /* !_WIN32 */
+
+void cmocka_print_error(const char * const format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if (cm_error_message_enabled) {
+        vcmocka_print_error(format, args);
+    } else {
+        vprint_error(format, args);
+    }
+    va_end(args);
+}
+
+/* Standard output and error print methods. */
+void vprint_message(const char* const format, va_list args)
+{
+    char buffer[4096];
+
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    printf("%s", buffer);
+    fflush(stdout);
+#ifdef _WIN32
+    OutputDebugString(buffer);
+#endif /* _WIN32 */
+}
+
+
+void vprint_error(const char* const format, va_list args)
+{
+    char buffer[4096];
+
+    vsnprintf(buffer, sizeof(buffer), format, args);
+    fprintf(stderr, "%s", buffer);
+    fflush(stderr);
+#ifdef _WIN32
+    OutputDebugString(buffer);
+#endif /* _WIN32 */
+}
+
+
+void print_message(const char* const format, ...) {
+    va_list args;
+    va_start(args, format);
+    vprint_message(format, args);
+    va_end(args);
+}
+
+
+void print_error(const char* const format, ...) {
+    va_list args;
+    va_start(args, format);
+    vprint_error(format, args);
+    va_end(args);
+}
+
+/* New formatter */
+static uint32_t cm_get_output(void)
+{
+    static bool env_checked = false;
+    char *env = NULL;
+    size_t len = 0;
+    uint32_t new_output = 0;
+    char *str_output_list = NULL;
+    char *str_output = NULL;
+    char *saveptr = NULL;
+
+    if (env_checked) {
+        return global_msg_output;
+    }
+
+    env = getenv("CMOCKA_MESSAGE_OUTPUT");
+    if (env == NULL) {
+        return global_msg_output;
+    }
+
+    len = strlen(env);
+    if (len == 0 || len > 32) {
+        return global_msg_output;
+    }
+
+    str_output_list = strdup(env);
+    if (str_output_list == NULL) {
+        return global_msg_output;
+    }
+
+    for (str_output = strtok_r(str_output_list, ",", &saveptr);
+         str_output != NULL;
+         str_output = strtok_r(NULL, ",", &saveptr)) {
+        if (strcasecmp(str_output, "STANDARD") == 0) {
+            new_output |= CM_OUTPUT_STANDARD;
+        } else if (strcasecmp(str_output, "STDOUT") == 0) {
+            new_output |= CM_OUTPUT_STANDARD;
+        } else if (strcasecmp(str_output, "SUBUNIT") == 0) {
+            new_output |= CM_OUTPUT_SUBUNIT;
+        } else if (strcasecmp(str_output, "TAP") == 0) {
+            new_output |= CM_OUTPUT_TAP;
+        } else if (strcasecmp(str_output, "XML") == 0) {
+            new_output |= CM_OUTPUT_XML;
+        }
+    }
+
+    libc_free(str_output_list);
+
+    if (new_output != 0) {
+        global_msg_output = new_output;
+    }
+
+    env_checked = true;
+
+    return global_msg_output;
+}
+
+/****************************************************************************
+ * PERFORMANCE COUNTERS
+ ****************************************************************************/
+
+/* Names of the counters in the XML output. */
+static const char * const perf_counter_names[PERF_COUNTERS] = {
+    "cycles",
+    "instructions",
+    "branch_misses",
+    "l1d_read_misses",
+    "llc_misses",
+};
+
+#ifdef CMOCKA_PERF
+/* Counters of the running test. */
+static struct {
+    bool active;
+    int leader;
+    int fds[PERF_COUNTERS];     /* -1 if the counter is not available. */
+    size_t slots[PERF_COUNTERS]; /* Position in the values of the group. */
+    size_t num_open;
+} global_perf;
+#endif /* CMOCKA_PERF */
+
+void cmocka_set_perf_counters(int enable)
+{
+    if (!cm_env_is_set(CM_ENV_PERF_COUNTERS)) {
+        global_perf_counters_enabled = (enable != 0);
+    }
+}
+
+static bool cm_get_perf_counters(void)
+{
+    cm_load_env();
+
+    return global_perf_counters_enabled;
+}
+
+/* Open the counters as a group and start counting, if enabled. */
+static void perf_counters_start(void)
+{
+#ifdef CMOCKA_PERF
+    static const struct {
+        uint32_t type;
+        uint64_t config;
+    } events[PERF_COUNTERS] = {
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+        { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                              (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                              (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+        { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    };
+    int leader = -1;
+    size_t i;
+
+    if (!cm_get_perf_counters()) {
+        return;
+    }
+
+    global_perf.num_open = 0;
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        int fd;
+
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        /* The whole group is enabled through its leader. */
+        attr.disabled = (leader == -1);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP |
+                           PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+        global_perf.fds[i] = fd;
+        if (fd == -1) {
+            continue;
+        }
+        if (leader == -1) {
+            leader = fd;
+        }
+        global_perf.slots[i] = global_perf.num_open++;
+    }
+
+    /* Not supported by the kernel, the hardware or forbidden, count nothing. */
+    if (leader == -1) {
+        return;
+    }
+
+    global_perf.leader = leader;
+    global_perf.active = true;
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif /* CMOCKA_PERF */
+}
+
+/* Read the counters so far, scaled up if they were multiplexed. */
+static bool perf_counters_read(CMPerfCounters *counters)
+{
+#ifdef CMOCKA_PERF
+    uint64_t values[3 + PERF_COUNTERS];
+    uint64_t enabled;
+    uint64_t running;
+    ssize_t n;
+    size_t i;
+
+    memset(counters, 0, sizeof(*counters));
+    if (!global_perf.active) {
+        return false;
+    }
+
+    /* The number of values, the times enabled and running, the values. */
+    n = read(global_perf.leader, values, sizeof(values));
+    if (n < (ssize_t)((3 + global_perf.num_open) * sizeof(uint64_t))) {
+        return false;
+    }
+    enabled = values[1];
+    running = values[2];
+    if (running == 0) {
+        return false;
+    }
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        uint64_t count;
+
+        if (global_perf.fds[i] == -1) {
+            continue;
+        }
+        count = values[3 + global_perf.slots[i]];
+        if (running < enabled) {
+            count = (uint64_t)((double)count * (double)enabled /
+                               (double)running);
+        }
+        counters->counts[i] = count;
+        counters->valid[i] = true;
+    }
+
+    return true;
+#else
+    memset(counters, 0, sizeof(*counters));
+
+    return false;
+#endif /* CMOCKA_PERF */
+}
+
+static bool perf_counters_any(const CMPerfCounters *counters)
+{
+    size_t i;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        if (counters->valid[i]) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Stop counting and close the counters. */
+static void perf_counters_stop(CMPerfCounters *counters)
+{
+#ifdef CMOCKA_PERF
+    size_t i;
+
+    if (!global_perf.active) {
+        memset(counters, 0, sizeof(*counters));
+        return;
+    }
+
+    ioctl(global_perf.leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    perf_counters_read(counters);
+
+    /* Close the members before their leader. */
+    for (i = PERF_COUNTERS; i > 0; i--) {
+        if (global_perf.fds[i - 1] != -1) {
+            close(global_perf.fds[i - 1]);
+        }
+    }
+    global_perf.active = false;
+#else
+    memset(counters, 0, sizeof(*counters));
+#endif /* CMOCKA_PERF */
+}
+
+void _assert_perf_counter_below(enum cm_perf_counter counter,
+                                const char *counter_name,
+                                uint64_t max,
+                                const char * const file,
+                                const int line)
+{
+    CMPerfCounters counters;
+
+    if ((size_t)counter >= PERF_COUNTERS ||
+        !perf_counters_read(&counters) ||
+        !counters.valid[counter]) {
+        return;
+    }
+
+    if (counters.counts[counter] >= max) {
+        cmocka_print_error(SOURCE_LOCATION_FORMAT
+                           ": error: %s is %" PRIu64 ", which is not below "
+                           "%" PRIu64 "\n",
+                           file,
+                           line,
+                           counter_name,
+                           counters.counts[counter],
+                           max);
+        _fail(file, line);
+    }
+}
+
+/****************************************************************************
+ * RESOURCE USAGE
+ ****************************************************************************/
+
+/* The usage of the calling thread only, glibc hides it without _GNU_SOURCE. */
+#if defined(__linux__) && !defined(RUSAGE_THREAD)
+#define RUSAGE_THREAD 1
+#endif
+
+void cmocka_set_resource_usage(int enable)
+{
+    if (!cm_env_is_set(CM_ENV_RESOURCE_USAGE)) {
+        global_resource_usage_enabled = (enable != 0);
+    }
+}
+
+static bool cm_get_resource_usage(void)
+{
+    cm_load_env();
+
+    return global_resource_usage_enabled;
+}
+
+/* Sample the resource usage, if enabled. */
+static bool resource_usage_sample(CMResourceUsage *usage)
+{
+#ifdef HAVE_SYS_RESOURCE_H
+    struct rusage ru;
+    int rc;
+
+    memset(usage, 0, sizeof(*usage));
+    if (!cm_get_resource_usage()) {
+        return false;
+    }
+
+#ifdef RUSAGE_THREAD
+    rc = getrusage(RUSAGE_THREAD, &ru);
+#else
+    rc = getrusage(RUSAGE_SELF, &ru);
+#endif
+    if (rc != 0) {
+        return false;
+    }
+
+    usage->valid = true;
+    usage->user_time = (double)ru.ru_utime.tv_sec +
+                       (double)ru.ru_utime.tv_usec / 1E6;
+    usage->system_time = (double)ru.ru_stime.tv_sec +
+                         (double)ru.ru_stime.tv_usec / 1E6;
+    usage->max_rss = ru.ru_maxrss;
+    usage->minor_faults = ru.ru_minflt;
+    usage->major_faults = ru.ru_majflt;
+    usage->voluntary_switches = ru.ru_nvcsw;
+    usage->involuntary_switches = ru.ru_nivcsw;
+
+    return true;
+#else
+    memset(usage, 0, sizeof(*usage));
+
+    return false;
+#endif /* HAVE_SYS_RESOURCE_H */
+}
+
+/* Turn the usage sampled at the start of a test into the usage of the test. */
+static void resource_usage_stop(CMResourceUsage *usage)
+{
+    CMResourceUsage end;
+
+    if (!usage->valid) {
+        return;
+    }
+    if (!resource_usage_sample(&end)) {
+        usage->valid = false;
+        return;
+    }
+
+    usage->user_time = end.user_time - usage->user_time;
+    usage->system_time = end.system_time - usage->system_time;
+    usage->max_rss = end.max_rss - usage->max_rss;
+    usage->minor_faults = end.minor_faults - usage->minor_faults;
+    usage->major_faults = end.major_faults - usage->major_faults;
+    usage->voluntary_switches =
+        end.voluntary_switches - usage->voluntary_switches;
+    usage->involuntary_switches =
+        end.involuntary_switches - usage->involuntary_switches;
+}
+
+enum cm_printf_type {
+    PRINTF_TEST_START,
+    PRINTF_TEST_SUCCESS,
+    PRINTF_TEST_FAILURE,
+    PRINTF_TEST_ERROR,
+    PRINTF_TEST_SKIPPED,
+};
+
+static int xml_printed;
+static int file_append;
+
+static void cmprintf_heap_profile_xml(FILE *fp, const MallocProfile *profile)
+{
+    size_t i;
+
+    fprintf(fp, "        <property name=\"heap.allocations\" "
+                "value=\"%zu\" />\n", profile->allocations);
+    fprintf(fp, "        <property name=\"heap.total_bytes\" "
+                "value=\"%zu\" />\n", profile->total_bytes);
+    fprintf(fp, "        <property name=\"heap.peak_bytes\" "
+                "value=\"%zu\" />\n", profile->peak_bytes);
+
+    for (i = 0; i < MALLOC_PROFILE_BUCKETS; i++) {
+        size_t upper;
+
+        if (profile->histogram[i] == 0) {
+            continue;
+        }
+        /* Bucket i holds the sizes below 2^i. */
+        if (i == 0) {
+            upper = 1;
+        } else if (i < MALLOC_PROFILE_BUCKETS - 1) {
+            upper = (size_t)1 << i;
+        } else {
+            upper = SIZE_MAX;
+        }
+        fprintf(fp, "        <property name=\"heap.histogram.lt%zu\" "
+                    "value=\"%zu\" />\n", upper, profile->histogram[i]);
+    }
+
+    for (i = 0; i < profile->num_top_sites; i++) {
+        const MallocProfileSite *site = &profile->top_sites[i];
+
+        fprintf(fp, "        <property name=\"heap.site.%zu\" "
+                    "value=\"%s:%d allocations=%zu bytes=%zu\" />\n",
+                    i + 1,
+                    site->location.file,
+                    site->location.line,
+                    site->allocations,
+                    site->bytes);
+    }
+
+    for (i = 0; i < profile->num_churn_sites; i++) {
+        const MallocChurnSite *site = &profile->churn_sites[i];
+
+        fprintf(fp, "        <property name=\"heap.churn.%zu\" "
+                    "value=\"%s:%d allocations=%zu frees=%zu "
+                    "same_size_pairs=%zu reallocs=%zu "
+                    "longest_realloc_chain=%zu median_lifetime_lt=%zu\" />\n",
+                    i + 1,
+                    site->location.file,
+                    site->location.line,
+                    site->allocations,
+                    site->frees,
+                    site->same_size_pairs,
+                    site->reallocs,
+                    site->longest_realloc_chain,
+                    site->median_lifetime);
+    }
+}
+
+static void cmprintf_perf_counters_xml(FILE *fp, const CMPerfCounters *perf)
+{
+    size_t i;
+
+    for (i = 0; i < PERF_COUNTERS; i++) {
+        if (perf->valid[i]) {
+            fprintf(fp, "        <property name=\"perf.%s\" "
+                        "value=\"%" PRIu64 "\" />\n",
+                        perf_counter_names[i],
+                        perf->counts[i]);
+        }
+    }
+}
+
+static void cmprintf_resource_usage_xml(FILE *fp, const CMResourceUsage *usage)
+{
+    fprintf(fp, "        <property name=\"rusage.user_time\" "
+                "value=\"%.6f\" />\n", usage->user_time);
+    fprintf(fp, "        <property name=\"rusage.system_time\" "
+                "value=\"%.6f\" />\n", usage->system_time);
+    fprintf(fp, "        <property name=\"rusage.max_rss_growth_kb\" "
+                "value=\"%ld\" />\n", usage->max_rss);
+    fprintf(fp, "        <property name=\"rusage.minor_faults\" "
+                "value=\"%ld\" />\n", usage->minor_faults);
+    fprintf(fp, "        <property name=\"rusage.major_faults\" "
+                "value=\"%ld\" />\n", usage->major_faults);
+    fprintf(fp, "        <property name=\"rusage.voluntary_switches\" "
+                "value=\"%ld\" />\n", usage->voluntary_switches);
+    fprintf(fp, "        <property name=\"rusage.involuntary_switches\" "
+                "value=\"%ld\" />\n", usage->involuntary_switches);
+}
+
+static void cmprintf_benchmark_xml(FILE *fp, const CMBenchmarkResult *result)
+{
+    fprintf(fp, "        <property name=\"benchmark.iterations\" "
+                "value=\"%zu\" />\n", result->iterations);
+    fprintf(fp, "        <property name=\"benchmark.rounds\" "
+                "value=\"%zu\" />\n", result->rounds);
+    fprintf(fp, "        <property name=\"benchmark.ns_per_op\" "
+                "value=\"%.2f\" />\n", result->mean);
+    fprintf(fp, "        <property name=\"benchmark.min_ns_per_op\" "
+                "value=\"%.2f\" />\n", result->min);
+    fprintf(fp, "        <property name=\"benchmark.median_ns_per_op\" "
+                "value=\"%.2f\" />\n", result->median);
+    fprintf(fp, "        <property name=\"benchmark.stddev_ns_per_op\" "
+                "value=\"%.2f\" />\n", result->stddev);
+    if (result->compared) {
+        fprintf(fp, "        <property name=\"benchmark.baseline_median_ns_per_op\" "
+                    "value=\"%.2f\" />\n", result->baseline_median);
+        fprintf(fp, "        <property name=\"benchmark.change\" "
+                    "value=\"%.4f\" />\n", result->change);
+        fprintf(fp, "        <property name=\"benchmark.p_value\" "
+                    "value=\"%.4f\" />\n", result->p_value);
+    }
+}
+
+static void cmprintf_phase_times_xml(FILE *fp,
+                                     const char *indent,
+                                     const CMPhaseTimes *phases)
+{
+    fprintf(fp, "%s<property name=\"time.setup\" value=\"%.6f\" />\n",
+            indent, phases->setup);
+    fprintf(fp, "%s<property name=\"time.test\" value=\"%.6f\" />\n",
+            indent, phases->test);
+    fprintf(fp, "%s<property name=\"time.verify\" value=\"%.6f\" />\n",
+            indent, phases->verify);
+    fprintf(fp, "%s<property name=\"time.teardown\" value=\"%.6f\" />\n",
+            indent, phases->teardown);
+}
+
+static void cmprintf_group_finish_xml(const char *group_name,
+                                      size_t total_executed,
+                                      size_t total_failed,
+                                      size_t total_errors,
+                                      size_t total_skipped,
+                                      double total_runtime,
+                                      const CMPhaseTimes *group_phases,
+                                      struct CMUnitTestState *cm_tests)
+{
+    FILE *fp = stdout;
+    int file_opened = 0;
+    int multiple_files = 0;
+    char *env;
+    size_t i;
+
+    env = getenv("CMOCKA_XML_FILE");
+    if (env != NULL) {
+        char buf[1024];
+        int rc;
+
+        snprintf(buf, sizeof(buf), "%s", env);
+
+        rc = c_strreplace(buf, sizeof(buf), "%g", group_name, &multiple_files);
+        if (rc < 0) {
+            snprintf(buf, sizeof(buf), "%s", env);
+        }
+
+        fp = fopen(buf, "r");
+        if (fp == NULL) {
+            fp = fopen(buf, "w");
+            if (fp != NULL) {
+                file_append = 1;
+                file_opened = 1;
+            } else {
+                fp = stderr;
+            }
+        } else {
+            fclose(fp);
+            if (file_append) {
+                fp = fopen(buf, "a");
+                if (fp != NULL) {
+                    file_opened = 1;
+                    xml_printed = 1;
+                } else {
+                    fp = stderr;
+                }
+            } else {
+                fp = stderr;
+            }
+        }
+    }
+
+    if (!xml_printed || (file_opened && !file_append)) {
+        fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n");
+        if (!file_opened) {
+            xml_printed = 1;
+        }
+    }
+
+    fprintf(fp, "<testsuites>\n");
+    fprintf(fp, "  <testsuite name=\"%s\" time=\"%.3f\" "
+                "tests=\"%u\" failures=\"%u\" errors=\"%u\" skipped=\"%u\" >\n",
+                group_name,
+                total_runtime, /* seconds */
+                (unsigned)total_executed,
+                (unsigned)total_failed,
+                (unsigned)total_errors,
+                (unsigned)total_skipped);
+    if (group_phases->valid) {
+        fprintf(fp, "    <properties>\n");
+        cmprintf_phase_times_xml(fp, "      ", group_phases);
+        fprintf(fp, "    </properties>\n");
+    }
+
+    for (i = 0; i < total_executed; i++) {
+        struct CMUnitTestState *cmtest = &cm_tests[i];
+
+        fprintf(fp, "    <testcase name=\"%s\" time=\"%.3f\" >\n",
+                cmtest->test->name, cmtest->runtime);
+
+        if (cm_get_heap_profile() || cmtest->benchmark.rounds > 0 ||
+            perf_counters_any(&cmtest->perf) || cmtest->rusage.valid ||
+            cmtest->phases.valid) {
+            fprintf(fp, "      <properties>\n");
+            if (cm_get_heap_profile()) {
+                cmprintf_heap_profile_xml(fp, &cmtest->heap_profile);
+            }
+            if (cmtest->benchmark.rounds > 0) {
+                cmprintf_benchmark_xml(fp, &cmtest->benchmark);
+            }
+            cmprintf_perf_counters_xml(fp, &cmtest->perf);
+            if (cmtest->rusage.valid) {
+                cmprintf_resource_usage_xml(fp, &cmtest->rusage);
+            }
+            if (cmtest->phases.valid) {
+                cmprintf_phase_times_xml(fp, "        ", &cmtest->phases);
+            }
+            fprintf(fp, "      </properties>\n");
+        }
+
+        switch (cmtest->status) {
+        case CM_TEST_ERROR:
+        case CM_TEST_FAILED:
+            if (cmtest->error_message != NULL) {
+                fprintf(fp, "      <failure><![CDATA[%s]]></failure>\n",
+                        cmtest->error_message);
+            } else {
+                fprintf(fp, "      <failure message=\"Unknown error\" />\n");
+            }
+            break;
+        case CM_TEST_SKIPPED:
+            fprintf(fp, "      <skipped/>\n");
+            break;
+
+        case CM_TEST_PASSED:
+        case CM_TEST_NOT_STARTED:
+            break;
+        }
+
+        fprintf(fp, "    </testcase>\n");
+    }
+
+    fprintf(fp, "  </testsuite>\n");
+    fprintf(fp, "</testsuites>\n");
+
+    if (file_opened) {
+        fclose(fp);
+    }
+}
+
+static void cmprintf_group_start_standard(const char *group_name,
+                                          const size_t num_tests)
+{
+    print_message("[==========] %s: Running %zu test(s).\n",
+                  group_name,
+                  num_tests);
+}
+
+static void cmprintf_group_finish_standard(const char *group_name,
+                                           size_t total_executed,
+                                           size_t total_passed,
+                                           size_t total_failed,
+                                           size_t total_errors,
+                                           size_t total_skipped,
+                                           struct CMUnitTestState *cm_tests)
+{
+    size_t i;
+
+    print_message("[==========] %s: %zu test(s) run.\n",
+                  group_name,
+                  total_executed);
+    print_error("[  PASSED  ] %u test(s).\n",
+                (unsigned)(total_passed));
+
+    if (total_skipped) {
+        print_error("[  SKIPPED ] %s: %zu test(s), listed below:\n",
+                    group_name,
+                    total_skipped);
+        for (i = 0; i < total_executed; i++) {
+            struct CMUnitTestState *cmtest = &cm_tests[i];
+
+            if (cmtest->status == CM_TEST_SKIPPED) {
+                print_error("[  SKIPPED ] %s\n", cmtest->test->name);
+            }
+        }
+        print_error("\n %zu SKIPPED TEST(S)\n", total_skipped);
+    }
+
+    if (total_failed) {
+        print_error("[  FAILED  ] %s: %zu test(s), listed below:\n",
+                    group_name,
+                    total_failed);
+        for (i = 0; i < total_executed; i++) {
+            struct CMUnitTestState *cmtest = &cm_tests[i];
+
+            if (cmtest->status == CM_TEST_FAILED) {
+                print_error("[  FAILED  ] %s\n", cmtest->test->name);
+            }
+        }
+        print_error("\n %zu FAILED TEST(S)\n",
+                    (total_failed + total_errors));
+    }
+}
+
+static void cmprintf_standard(enum cm_printf_type type,
+                              const char *test_name,
+                              const char *error_message)
+{
+    switch (type) {
+    case PRINTF_TEST_START:
+        print_message("[ RUN      ] %s\n", test_name);
+        break;
+    case PRINTF_TEST_SUCCESS:
+        print_message("[       OK ] %s\n", test_name);
+        break;
+    case PRINTF_TEST_FAILURE:
+        if (error_message != NULL) {
+            print_error("[  ERROR   ] --- %s\n", error_message);
+        }
+        print_message("[  FAILED  ] %s\n", test_name);
+        break;
+    case PRINTF_TEST_SKIPPED:
+        print_message("[  SKIPPED ] %s\n", test_name);
+        break;
+    case PRINTF_TEST_ERROR:
+        if (error_message != NULL) {
+            print_error("%s\n", error_message);
+        }
+        print_error("[  ERROR   ] %s\n", test_name);
+        break;
+    }
+}
+
+static void cmprintf_group_start_tap(const size_t num_tests)
+{
+    static bool version_printed = false;
+    if (!version_printed) {
+        print_message("TAP version 13\n");
+        version_printed = true;
+    }
+
+    print_message("1..%u\n", (unsigned)num_tests);
+}
+
+static void cmprintf_group_finish_tap(const char *group_name,
+                                      size_t total_executed,
+                                      size_t total_passed,
+                                      size_t total_skipped)
+{
+    const char *status = "not ok";
+    if (total_passed + total_skipped == total_executed) {
+        status = "ok";
+    }
+    print_message("# %s - %s\n", status, group_name);
+}
+
+static void cmprintf_tap(enum cm_printf_type type,
+                         size_t test_number,
+                         const char *test_name,
+                         const char *error_message)
+{
+    switch (type) {
+    case PRINTF_TEST_START:
+        break;
+    case PRINTF_TEST_SUCCESS:
+        print_message("ok %u - %s\n", (unsigned)test_number, test_name);
+        break;
+    case PRINTF_TEST_FAILURE:
+        print_message("not ok %u - %s\n", (unsigned)test_number, test_name);
+        if (error_message != NULL) {
+            char *msg;
+            char *p;
+
+            msg = strdup(error_message);
+            if (msg == NULL) {
+                return;
+            }
+            p = msg;
+
+            while (p[0] != '\0') {
+                char *q = p;
+
+                p = strchr(q, '\n');
+                if (p != NULL) {
+                    p[0] = '\0';
+                }
+
+                print_message("# %s\n", q);
+
+                if (p == NULL) {
+                    break;
+                }
+                p++;
+            }
+            libc_free(msg);
+        }
+        break;
+    case PRINTF_TEST_SKIPPED:
+        print_message("ok %u # SKIP %s\n", (unsigned)test_number, test_name);
+        break;
+    case PRINTF_TEST_ERROR:
+        print_message("not ok %u - %s %s\n",
+                      (unsigned)test_number, test_name, error_message);
+        break;
+    }
+}
+
+static void cmprintf_subunit(enum cm_printf_type type,
+                             const char *test_name,
+                             const char *error_message)
+{
+    switch (type) {
+    case PRINTF_TEST_START:
+        print_message("test: %s\n", test_name);
+        break;
+    case PRINTF_TEST_SUCCESS:
+        print_message("success: %s\n", test_name);
+        break;
+    case PRINTF_TEST_FAILURE:
+        print_message("failure: %s", test_name);
+        if (error_message != NULL) {
+            print_message(" [\n%s\n]\n", error_message);
+        }
+        break;
+    case PRINTF_TEST_SKIPPED:
+        print_message("skip: %s\n", test_name);
+        break;
+    case PRINTF_TEST_ERROR:
+        print_message("error: %s [ %s ]\n", test_name, error_message);
+        break;
+    }
+}
+
+static void cmprintf_group_start(const char *group_name,
+                                 const size_t num_tests)
+{
+    uint32_t output;
+
+    output = cm_get_output();
+
+    if (output & CM_OUTPUT_STANDARD) {
+        cmprintf_group_start_standard(group_name, num_tests);
+    }
+    if (output & CM_OUTPUT_TAP) {
+        cmprintf_group_start_tap(num_tests);
+    }
+}
+
+static void cmprintf_group_finish(const char *group_name,
+                                  size_t total_executed,
+                                  size_t total_passed,
+                                  size_t total_failed,
+                                  size_t total_errors,
+                                  size_t total_skipped,
+                                  double total_runtime,
+                                  const CMPhaseTimes *group_phases,
+                                  struct CMUnitTestState *cm_tests)
+{
+    uint32_t output;
+
+    output = cm_get_output();
+
+    if ((output & CM_OUTPUT_STANDARD) && group_phases->valid) {
+        print_message("[   TIME   ] %s: %.3f ms wall time, setup %.3f ms, "
+                      "teardown %.3f ms\n",
+                      group_name,
+                      total_runtime * 1000.0,
+                      group_phases->setup * 1000.0,
+                      group_phases->teardown * 1000.0);
+    }
+    if (output & CM_OUTPUT_STANDARD) {
+        cmprintf_group_finish_standard(group_name,
+                                       total_executed,
+                                       total_passed,
+                                       total_failed,
+                                       total_errors,
+                                       total_skipped,
+                                       cm_tests);
+    }
+    if (output & CM_OUTPUT_TAP) {
+        cmprintf_group_finish_tap(group_name,
+                                  total_executed,
+                                  total_passed,
+                                  total_skipped);
+    }
+    if (output & CM_OUTPUT_XML) {
+        cmprintf_group_finish_xml(group_name,
+                                  total_executed,
+                                  total_failed,
+                                  total_errors,
+                                  total_skipped,
+                                  total_runtime,
+                                  group_phases,
+                                  cm_tests);
+    }
+}
+
+static void cmprintf(enum cm_printf_type type,
+                     size_t test_number,
+                     const char *test_name,
+                     const char *error_message)
+{
+    uint32_t output;
+
+    output = cm_get_output();
+
+    if (output & CM_OUTPUT_STANDARD) {
+        cmprintf_standard(type, test_name, error_message);
+    }
+    if (output & CM_OUTPUT_SUBUNIT) {
+        cmprintf_subunit(type, test_name, error_message);
+    }
+    if (output & CM_OUTPUT_TAP) {
+        cmprintf_tap(type, test_number, test_name, error_message);
+    }
+}
+
+static void cmprintf_benchmark(size_t test_number,
+                               const char *test_name,
+                               const CMBenchmarkResult *result)
+{
+    char baseline[64] = "";
+    uint32_t output;
+
+    output = cm_get_output();
+
+    if (result->compared) {
+        snprintf(baseline, sizeof(baseline),
+                 ", %+.1f%% against the baseline (p = %.4f)",
+                 result->change * 100.0,
+                 result->p_value);
+    }
+
+    if (output & CM_OUTPUT_STANDARD) {
+        print_message("[  BENCH   ] %s: %.2f ns/op (min %.2f, median %.2f, "
+                      "stddev %.2f), %zu rounds of %zu iterations%s\n",
+                      test_name,
+                      result->mean,
+                      result->min,
+                      result->median,
+                      result->stddev,
+                      result->rounds,
+                      result->iterations,
+                      baseline);
+    }
+    if (output & CM_OUTPUT_TAP) {
+        print_message("# %u - %s: %.2f ns/op (min %.2f, median %.2f, "
+                      "stddev %.2f), %zu rounds of %zu iterations%s\n",
+                      (unsigned)test_number,
+                      test_name,
+                      result->mean,
+                      result->min,
+                      result->median,
+                      result->stddev,
+                      result->rounds,
+                      result->iterations,
+                      baseline);
+    }
+}
+
+static void cmprintf_phase_times(size_t test_number,
+                                 const char *test_name,
+                                 const CMPhaseTimes *phases)
+{
+    uint32_t output;
+
+    output = cm_get_output();
+
+    if (output & CM_OUTPUT_STANDARD) {
+        print_message("[   TIME   ] %s: setup %.3f ms, test %.3f ms, "
+                      "verify %.3f ms, teardown %.3f ms\n",
+                      test_name,
+                      phases->setup * 1000.0,
+                      phases->test * 1000.0,
+                      phases->verify * 1000.0,
+                      phases->teardown * 1000.0);
+    }
+    if (output & CM_OUTPUT_TAP) {
+        print_message("# %u - %s: setup %.3f ms, test %.3f ms, "
+                      "verify %.3f ms, teardown %.3f ms\n",
+                      (unsigned)test_number,
+                      test_name,
+                      phases->setup * 1000.0,
+                      phases->test * 1000.0,
+                      phases->verify * 1000.0,
+                      phases->teardown * 1000.0);
+    }
+}
+
+void cmocka_set_message_output(uint32_t output)
+{
+    global_msg_output = output;
+}
+
+void cmocka_set_test_filter(const char *pattern)
+{
+    global_test_filter_pattern = pattern;
+}
+
+void cmocka_set_skip_filter(const char *pattern)
+{
+    global_skip_filter_pattern = pattern;
+}
+
+/****************************************************************************
+ * TIME CALCULATIONS
+ ****************************************************************************/
+
+/* Nanoseconds of a clock which is not affected by changes of the time. */
+static uint64_t cm_clock_ns(void)
+{
+#if defined(HAVE_CLOCK_REALTIME)
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+/* Seconds passed since start, a value of cm_clock_ns(). */
+static double cm_seconds_since(const uint64_t start)
+{
+    return (double)(cm_clock_ns() - start) / 1E9;
+}
+
+void cmocka_set_phase_times(int enable)
+{
+    if (!cm_env_is_set(CM_ENV_PHASE_TIMES)) {
+        global_phase_times_enabled = (enable != 0);
+    }
+}
 
-    if (!xml_printed || (file_opened && !file_append)) {
-        fprintf(fp, "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n");
-        if (!file_opened) {
-            xml_printed = 1;
-        }
-    }
+static bool cm_get_phase_times(void)
+{
+    cm_load_env();
 
-    fprintf(fp, "<testsuites>\n");
-    fprintf(fp, "  <testsuite name=\"%s\" time=\"%.3f\" "
-                "tests=\"%u\" failures=\"%u\" errors=\"%u\" skipped=\"%u\" >\n",
-                group_name,
-                total_runtime, /* seconds */
-                (unsigned)total_executed,
-                (unsigned)total_failed,
-                (unsigned)total_errors,
-                (unsigned)total_skipped);
+    return global_phase_times_enabled;
+}
 
-    for (i = 0; i < total_executed; i++) {
-        struct CMUnitTestState *cmtest = &cm_tests[i];
+/****************************************************************************
+ * BENCHMARKS
+ ****************************************************************************/
 
-        fprintf(fp, "    <testcase name=\"%s\" time=\"%.3f\" >\n",
-                cmtest->test->name, cmtest->runtime);
+#define BENCHMARK_DEFAULT_ROUNDS 10
+#define BENCHMARK_WARMUP_ROUNDS 2
 
-        switch (cmtest->status) {
-        case CM_TEST_ERROR:
-        case CM_TEST_FAILED:
-            if (cmtest->error_message != NULL) {
-                fprintf(fp, "      <failure><![CDATA[%s]]></failure>\n",
-                        cmtest->error_message);
-            } else {
-                fprintf(fp, "      <failure message=\"Unknown error\" />\n");
-            }
-            break;
-        case CM_TEST_SKIPPED:
-            fprintf(fp, "      <skipped/>\n");
-            break;
+/* Minimum time of a round in microseconds. */
+#define BENCHMARK_DEFAULT_ROUND_TIME 10000
 
-        case CM_TEST_PASSED:
-        case CM_TEST_NOT_STARTED:
-            break;
-        }
+/* Keeps the growth of the iterations in benchmark_calibrate() in range. */
+#define BENCHMARK_MAX_ITERATIONS (SIZE_MAX / 128)
 
-        fprintf(fp, "    </testcase>\n");
+/* The test whose benchmark cmocka_run_benchmark() runs. */
+static CMOCKA_THREAD struct CMUnitTestState *global_benchmark_test;
+
+void cmocka_set_benchmark(size_t rounds, size_t round_time)
+{
+    if (!cm_env_is_set(CM_ENV_BENCHMARK_ROUNDS)) {
+        global_benchmark_rounds = rounds;
     }
+    if (!cm_env_is_set(CM_ENV_BENCHMARK_ROUND_TIME)) {
+        global_benchmark_round_time = round_time;
+    }
+}
 
-    fprintf(fp, "  </testsuite>\n");
-    fprintf(fp, "</testsuites>\n");
+static size_t cm_get_benchmark_rounds(void)
+{
+    cm_load_env();
 
-    if (file_opened) {
-        fclose(fp);
-    }
+    return global_benchmark_rounds > 0 ? global_benchmark_rounds :
+                                         BENCHMARK_DEFAULT_ROUNDS;
 }
 
-static void cmprintf_group_start_standard(const char *group_name,
-                                          const size_t num_tests)
+static uint64_t cm_get_benchmark_round_time_ns(void)
 {
-    print_message("[==========] %s: Running %zu test(s).\n",
-                  group_name,
-                  num_tests);
+    cm_load_env();
+
+    return (uint64_t)(global_benchmark_round_time > 0 ?
+                      global_benchmark_round_time :
+                      BENCHMARK_DEFAULT_ROUND_TIME) * 1000;
 }
 
-static void cmprintf_group_finish_standard(const char *group_name,
-                                           size_t total_executed,
-                                           size_t total_passed,
-                                           size_t total_failed,
-                                           size_t total_errors,
-                                           size_t total_skipped,
-                                           struct CMUnitTestState *cm_tests)
+void _cmocka_do_not_optimize(const volatile void *ptr)
+{
+    (void)ptr;
+}
+
+/* Square root by Newton's method, to not depend on libm. */
+static double cm_sqrt(const double x)
 {
+    double root = x;
     size_t i;
 
-    print_message("[==========] %s: %zu test(s) run.\n",
-                  group_name,
-                  total_executed);
-    print_error("[  PASSED  ] %u test(s).\n",
-                (unsigned)(total_passed));
+    if (x <= 0.0) {
+        return 0.0;
+    }
 
-    if (total_skipped) {
-        print_error("[  SKIPPED ] %s: %zu test(s), listed below:\n",
-                    group_name,
-                    total_skipped);
-        for (i = 0; i < total_executed; i++) {
-            struct CMUnitTestState *cmtest = &cm_tests[i];
+    for (i = 0; i < 64; i++) {
+        double next = (root + x / root) / 2.0;
 
-            if (cmtest->status == CM_TEST_SKIPPED) {
-                print_error("[  SKIPPED ] %s\n", cmtest->test->name);
-            }
+        if (next == root) {
+            break;
         }
-        print_error("\n %zu SKIPPED TEST(S)\n", total_skipped);
+        root = next;
     }
 
-    if (total_failed) {
-        print_error("[  FAILED  ] %s: %zu test(s), listed below:\n",
-                    group_name,
-                    total_failed);
-        for (i = 0; i < total_executed; i++) {
-            struct CMUnitTestState *cmtest = &cm_tests[i];
+    return root;
+}
 
-            if (cmtest->status == CM_TEST_FAILED) {
-                print_error("[  FAILED  ] %s\n", cmtest->test->name);
-            }
-        }
-        print_error("\n %zu FAILED TEST(S)\n",
-                    (total_failed + total_errors));
+static int compare_doubles(const void *a, const void *b)
+{
+    const double left = *(const double *)a;
+    const double right = *(const double *)b;
+
+    if (left < right) {
+        return -1;
     }
+
+    return left > right ? 1 : 0;
 }
 
-static void cmprintf_standard(enum cm_printf_type type,
-                              const char *test_name,
-                              const char *error_message)
+/* Time a round of iterations of a benchmark in nanoseconds. */
+static uint64_t benchmark_round(CMBenchmarkFunction benchmark_func,
+                                void **state,
+                                const size_t iterations)
 {
-    switch (type) {
-    case PRINTF_TEST_START:
-        print_message("[ RUN      ] %s\n", test_name);
-        break;
-    case PRINTF_TEST_SUCCESS:
-        print_message("[       OK ] %s\n", test_name);
-        break;
-    case PRINTF_TEST_FAILURE:
-        if (error_message != NULL) {
-            print_error("[  ERROR   ] --- %s\n", error_message);
+    const uint64_t start = cm_clock_ns();
+
+    benchmark_func(state, iterations);
+
+    return cm_clock_ns() - start;
+}
+
+/*
+ * Find the number of iterations which makes a round take at least the round
+ * time. This also warms up the caches for the following rounds.
+ */
+static size_t benchmark_calibrate(CMBenchmarkFunction benchmark_func,
+                                  void **state)
+{
+    const uint64_t round_time = cm_get_benchmark_round_time_ns();
+    size_t iterations = 1;
+    uint64_t elapsed;
+
+    elapsed = benchmark_round(benchmark_func, state, iterations);
+
+#ifdef HAVE_CLOCK_REALTIME
+    while (elapsed < round_time && iterations < BENCHMARK_MAX_ITERATIONS) {
+        size_t next = iterations * 100;
+
+        /* Aim a bit above the round time, but grow at most 100 times. */
+        if (elapsed > 0) {
+            double predicted = (double)iterations * 1.2 *
+                               (double)round_time / (double)elapsed;
+
+            if (predicted < (double)next) {
+                next = (size_t)predicted;
+            }
         }
-        print_message("[  FAILED  ] %s\n", test_name);
-        break;
-    case PRINTF_TEST_SKIPPED:
-        print_message("[  SKIPPED ] %s\n", test_name);
-        break;
-    case PRINTF_TEST_ERROR:
-        if (error_message != NULL) {
-            print_error("%s\n", error_message);
+        if (next <= iterations) {
+            next = iterations + 1;
         }
-        print_error("[  ERROR   ] %s\n", test_name);
-        break;
+        if (next > BENCHMARK_MAX_ITERATIONS) {
+            next = BENCHMARK_MAX_ITERATIONS;
+        }
+
+        iterations = next;
+        elapsed = benchmark_round(benchmark_func, state, iterations);
     }
+#else
+    /* Without a clock a single iteration is run per round. */
+    (void)round_time;
+    (void)elapsed;
+#endif
+
+    return iterations;
 }
 
-static void cmprintf_group_start_tap(const size_t num_tests)
+static void benchmark_statistics(CMBenchmarkResult *result)
 {
-    static bool version_printed = false;
-    if (!version_printed) {
-        print_message("TAP version 13\n");
-        version_printed = true;
+    const size_t n = result->rounds;
+    double sum = 0.0;
+    double squares = 0.0;
+    size_t i;
+
+    qsort(result->samples, n, sizeof(double), compare_doubles);
+
+    for (i = 0; i < n; i++) {
+        sum += result->samples[i];
     }
+    result->mean = sum / (double)n;
 
-    print_message("1..%u\n", (unsigned)num_tests);
+    for (i = 0; i < n; i++) {
+        double delta = result->samples[i] - result->mean;
+
+        squares += delta * delta;
+    }
+    result->stddev = n > 1 ? cm_sqrt(squares / (double)(n - 1)) : 0.0;
+
+    result->min = result->samples[0];
+    if (n % 2 == 0) {
+        result->median = (result->samples[n / 2 - 1] +
+                          result->samples[n / 2]) / 2.0;
+    } else {
+        result->median = result->samples[n / 2];
+    }
 }
 
-static void cmprintf_group_finish_tap(const char *group_name,
-                                      size_t total_executed,
-                                      size_t total_passed,
-                                      size_t total_skipped)
+/*
+ * Run the benchmark of global_benchmark_test in place of a test function,
+ * the leak check and the exception handling work like for tests.
+ */
+static void cmocka_run_benchmark(void **state)
 {
-    const char *status = "not ok";
-    if (total_passed + total_skipped == total_executed) {
-        status = "ok";
+    struct CMUnitTestState *test_state = global_benchmark_test;
+    CMBenchmarkFunction benchmark_func = test_state->test->benchmark_func;
+    CMBenchmarkResult *result = &test_state->benchmark;
+    const size_t rounds = cm_get_benchmark_rounds();
+    size_t i;
+
+    result->iterations = benchmark_calibrate(benchmark_func, state);
+
+    for (i = 0; i < BENCHMARK_WARMUP_ROUNDS; i++) {
+        benchmark_round(benchmark_func, state, result->iterations);
     }
-    print_message("# %s - %s\n", status, group_name);
+
+    libc_free(result->samples);
+    result->samples = libc_calloc(rounds, sizeof(double));
+    assert_non_null(result->samples);
+
+    for (i = 0; i < rounds; i++) {
+        uint64_t elapsed = benchmark_round(benchmark_func,
+                                           state,
+                                           result->iterations);
+
+        result->samples[i] = (double)elapsed / (double)result->iterations;
+    }
+
+    result->rounds = rounds;
+    benchmark_statistics(result);
 }
 
-static void cmprintf_tap(enum cm_printf_type type,
-                         size_t test_number,
-                         const char *test_name,
-                         const char *error_message)
+/* Rounds of a benchmark and a baseline compared, more are thinned out. */
+#define BENCHMARK_MAX_COMPARED_ROUNDS 256
+
+/* Results of a benchmark loaded from the baseline file. */
+typedef struct CMBenchmarkBaseline {
+    const char *group_name;
+    const char *test_name;
+    size_t rounds;
+    double *samples; /* Sorted. */
+} CMBenchmarkBaseline;
+
+static struct {
+    bool loaded;
+    char *text;
+    CMBenchmarkBaseline *entries;
+    size_t num_entries;
+} global_benchmark_baseline;
+
+void cmocka_set_benchmark_baseline(const char *baseline_file,
+                                   const char *save_file)
 {
-    switch (type) {
-    case PRINTF_TEST_START:
-        break;
-    case PRINTF_TEST_SUCCESS:
-        print_message("ok %u - %s\n", (unsigned)test_number, test_name);
-        break;
-    case PRINTF_TEST_FAILURE:
-        print_message("not ok %u - %s\n", (unsigned)test_number, test_name);
-        if (error_message != NULL) {
-            char *msg;
-            char *p;
+    if (!cm_env_is_set(CM_ENV_BENCHMARK_BASELINE)) {
+        global_benchmark_baseline_file = baseline_file;
+    }
+    if (!cm_env_is_set(CM_ENV_BENCHMARK_SAVE)) {
+        global_benchmark_save_file = save_file;
+    }
+}
 
-            msg = strdup(error_message);
-            if (msg == NULL) {
-                return;
-            }
-            p = msg;
+void cmocka_set_benchmark_threshold(double alpha, double slowdown)
+{
+    if (!cm_env_is_set(CM_ENV_BENCHMARK_ALPHA)) {
+        global_benchmark_alpha = alpha;
+    }
+    if (!cm_env_is_set(CM_ENV_BENCHMARK_SLOWDOWN)) {
+        global_benchmark_slowdown = slowdown;
+    }
+}
 
-            while (p[0] != '\0') {
-                char *q = p;
+/* Read a whole file into a NUL terminated buffer released with libc_free(). */
+static char *cm_read_file(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char *text = NULL;
+    size_t size = 0;
+    size_t capacity = 0;
 
-                p = strchr(q, '\n');
-                if (p != NULL) {
-                    p[0] = '\0';
-                }
+    if (fp == NULL) {
+        return NULL;
+    }
 
-                print_message("# %s\n", q);
+    for (;;) {
+        size_t n;
 
-                if (p == NULL) {
-                    break;
-                }
-                p++;
+        if (capacity - size < 4096) {
+            char *new_text = libc_realloc(text, capacity + 4096 + 1);
+
+            if (new_text == NULL) {
+                libc_free(text);
+                fclose(fp);
+                return NULL;
             }
-            libc_free(msg);
+            text = new_text;
+            capacity += 4096;
         }
-        break;
-    case PRINTF_TEST_SKIPPED:
-        print_message("ok %u # SKIP %s\n", (unsigned)test_number, test_name);
-        break;
-    case PRINTF_TEST_ERROR:
-        print_message("not ok %u - %s %s\n",
-                      (unsigned)test_number, test_name, error_message);
-        break;
-    }
-}
 
-static void cmprintf_subunit(enum cm_printf_type type,
-                             const char *test_name,
-                             const char *error_message)
-{
-    switch (type) {
-    case PRINTF_TEST_START:
-        print_message("test: %s\n", test_name);
-        break;
-    case PRINTF_TEST_SUCCESS:
-        print_message("success: %s\n", test_name);
-        break;
-    case PRINTF_TEST_FAILURE:
-        print_message("failure: %s", test_name);
-        if (error_message != NULL) {
-            print_message(" [\n%s\n]\n", error_message);
+        n = fread(text + size, 1, capacity - size, fp);
+        size += n;
+        if (n == 0) {
+            break;
         }
-        break;
-    case PRINTF_TEST_SKIPPED:
-        print_message("skip: %s\n", test_name);
-        break;
-    case PRINTF_TEST_ERROR:
-        print_message("error: %s [ %s ]\n", test_name, error_message);
-        break;
     }
+    fclose(fp);
+
+    text[size] = '\0';
+
+    return text;
 }
 
-static void cmprintf_group_start(const char *group_name,
-                                 const size_t num_tests)
+/*
+ * Load the baseline file once. Each line holds the group name, the test
+ * name, the number of rounds and the ns/op of each round, separated by tabs
+ * and the rounds by spaces.
+ */
+static void benchmark_baseline_load(void)
 {
-    uint32_t output;
+    char *line;
 
-    output = cm_get_output();
+    if (global_benchmark_baseline.loaded) {
+        return;
+    }
+    global_benchmark_baseline.loaded = true;
 
-    if (output & CM_OUTPUT_STANDARD) {
-        cmprintf_group_start_standard(group_name, num_tests);
+    if (global_benchmark_baseline_file == NULL) {
+        return;
     }
-    if (output & CM_OUTPUT_TAP) {
-        cmprintf_group_start_tap(num_tests);
+
+    global_benchmark_baseline.text =
+        cm_read_file(global_benchmark_baseline_file);
+    if (global_benchmark_baseline.text == NULL) {
+        print_error("[  ERROR   ] Could not read the benchmark baseline "
+                    "%s\n",
+                    global_benchmark_baseline_file);
+        return;
+    }
+
+    line = global_benchmark_baseline.text;
+    while (line[0] != '\0') {
+        CMBenchmarkBaseline entry;
+        CMBenchmarkBaseline *entries;
+        char *next = strchr(line, '\n');
+        char *test_name;
+        char *rounds;
+        char *p;
+        size_t i;
+
+        if (next != NULL) {
+            next[0] = '\0';
+            next++;
+        } else {
+            next = line + strlen(line);
+        }
+
+        test_name = strchr(line, '\t');
+        rounds = test_name != NULL ? strchr(test_name + 1, '\t') : NULL;
+        if (rounds == NULL) {
+            line = next;
+            continue;
+        }
+        test_name[0] = '\0';
+        rounds[0] = '\0';
+
+        entry.group_name = line;
+        entry.test_name = test_name + 1;
+        entry.rounds = strtoul(rounds + 1, &p, 10);
+        entry.samples = libc_calloc(entry.rounds > 0 ? entry.rounds : 1,
+                                    sizeof(double));
+        if (entry.samples == NULL) {
+            break;
+        }
+        for (i = 0; i < entry.rounds; i++) {
+            char *end;
+
+            entry.samples[i] = strtod(p, &end);
+            if (end == p) {
+                break;
+            }
+            p = end;
+        }
+        /* Skip lines which are cut short. */
+        if (i == 0 || i < entry.rounds) {
+            libc_free(entry.samples);
+            line = next;
+            continue;
+        }
+        qsort(entry.samples, entry.rounds, sizeof(double), compare_doubles);
+
+        entries = libc_realloc(global_benchmark_baseline.entries,
+                               (global_benchmark_baseline.num_entries + 1) *
+                               sizeof(*entries));
+        if (entries == NULL) {
+            libc_free(entry.samples);
+            break;
+        }
+        entries[global_benchmark_baseline.num_entries++] = entry;
+        global_benchmark_baseline.entries = entries;
+
+        line = next;
     }
 }
 
-static void cmprintf_group_finish(const char *group_name,
-                                  size_t total_executed,
-                                  size_t total_passed,
-                                  size_t total_failed,
-                                  size_t total_errors,
-                                  size_t total_skipped,
-                                  double total_runtime,
-                                  struct CMUnitTestState *cm_tests)
+static const CMBenchmarkBaseline *benchmark_baseline_find(
+    const char *group_name, const char *test_name)
 {
-    uint32_t output;
+    size_t i;
 
-    output = cm_get_output();
+    for (i = 0; i < global_benchmark_baseline.num_entries; i++) {
+        const CMBenchmarkBaseline *entry = &global_benchmark_baseline.entries[i];
 
-    if (output & CM_OUTPUT_STANDARD) {
-        cmprintf_group_finish_standard(group_name,
-                                       total_executed,
-                                       total_passed,
-                                       total_failed,
-                                       total_errors,
-                                       total_skipped,
-                                       cm_tests);
+        if (strcmp(entry->group_name, group_name) == 0 &&
+            strcmp(entry->test_name, test_name) == 0) {
+            return entry;
+        }
     }
-    if (output & CM_OUTPUT_TAP) {
-        cmprintf_group_finish_tap(group_name,
-                                  total_executed,
-                                  total_passed,
-                                  total_skipped);
+
+    return NULL;
+}
+
+/* Append the result of a benchmark to the file the baseline is saved to. */
+static void benchmark_baseline_save(const char *group_name,
+                                    const char *test_name,
+                                    const CMBenchmarkResult *result)
+{
+    static bool truncated = false;
+    FILE *fp;
+    size_t i;
+
+    /* The first result of the process replaces the previous baseline. */
+    fp = fopen(global_benchmark_save_file, truncated ? "a" : "w");
+    if (fp == NULL) {
+        print_error("[  ERROR   ] Could not save the benchmark baseline "
+                    "%s\n",
+                    global_benchmark_save_file);
+        return;
     }
-    if (output & CM_OUTPUT_XML) {
-        cmprintf_group_finish_xml(group_name,
-                                  total_executed,
-                                  total_failed,
-                                  total_errors,
-                                  total_skipped,
-                                  total_runtime,
-                                  cm_tests);
+    truncated = true;
+
+    fprintf(fp, "%s\t%s\t%zu\t", group_name, test_name, result->rounds);
+    for (i = 0; i < result->rounds; i++) {
+        fprintf(fp, i == 0 ? "%.3f" : " %.3f", result->samples[i]);
     }
+    fprintf(fp, "\n");
+
+    fclose(fp);
 }
 
-static void cmprintf(enum cm_printf_type type,
-                     size_t test_number,
-                     const char *test_name,
-                     const char *error_message)
+/*
+ * Probability that the Mann-Whitney U statistic of samples of the sizes n1
+ * and n2 is at most u if both come from the same distribution. The counts of
+ * each U are the coefficients of the Gaussian binomial coefficient
+ * [n1 + n2 choose n1], which is built up as the product of the factors
+ * (1 - q^(n2 + k)) / (1 - q^k) for k from 1 to n1.
+ */
+static double mann_whitney_cdf(const size_t n1, const size_t n2, size_t u)
 {
-    uint32_t output;
-
-    output = cm_get_output();
+    const size_t max_u = n1 * n2;
+    double *counts = libc_calloc(max_u + 1, sizeof(double));
+    double below = 0.0;
+    double total = 0.0;
+    size_t i;
+    size_t k;
 
-    if (output & CM_OUTPUT_STANDARD) {
-        cmprintf_standard(type, test_name, error_message);
+    if (counts == NULL) {
+        return 1.0;
     }
-    if (output & CM_OUTPUT_SUBUNIT) {
-        cmprintf_subunit(type, test_name, error_message);
+
+    counts[0] = 1.0;
+    for (k = 1; k <= n1; k++) {
+        for (i = max_u; i >= n2 + k; i--) {
+            counts[i] -= counts[i - (n2 + k)];
+        }
+        for (i = k; i <= max_u; i++) {
+            counts[i] += counts[i - k];
+        }
     }
-    if (output & CM_OUTPUT_TAP) {
-        cmprintf_tap(type, test_number, test_name, error_message);
+
+    for (i = 0; i <= max_u; i++) {
+        total += counts[i];
+        if (i <= u) {
+            below += counts[i];
+        }
     }
-}
+    libc_free(counts);
 
-void cmocka_set_message_output(uint32_t output)
-{
-    global_msg_output = output;
+    return below / total;
 }
 
-void cmocka_set_test_filter(const char *pattern)
+/* Pick up to BENCHMARK_MAX_COMPARED_ROUNDS evenly spaced sorted samples. */
+static size_t benchmark_thin_out(const double *samples,
+                                 const size_t n,
+                                 double *thinned)
 {
-    global_test_filter_pattern = pattern;
-}
+    const size_t m = MIN(n, BENCHMARK_MAX_COMPARED_ROUNDS);
+    size_t i;
 
-void cmocka_set_skip_filter(const char *pattern)
-{
-    global_skip_filter_pattern = pattern;
-}
+    for (i = 0; i < m; i++) {
+        thinned[i] = samples[i * n / m];
+    }
 
-/****************************************************************************
- * TIME CALCULATIONS
- ****************************************************************************/
+    return m;
+}
 
-#ifdef HAVE_STRUCT_TIMESPEC
-static struct timespec cm_tspecdiff(struct timespec time1,
-                                    struct timespec time0)
+/*
+ * Compare a benchmark with its baseline by a one-sided Mann-Whitney U test.
+ * It fails if the rounds are significantly slower than the ones of the
+ * baseline and the median slowed down by more than the threshold.
+ */
+static void benchmark_baseline_compare(const char *group_name,
+                                       struct CMUnitTestState *test_state)
 {
-    struct timespec ret;
-    int xsec = 0;
-    int sign = 1;
-
-    if (time0.tv_nsec > time1.tv_nsec) {
-        xsec = (int) ((time0.tv_nsec - time1.tv_nsec) / (1E9 + 1));
-        time0.tv_nsec -= (long int) (1E9 * xsec);
-        time0.tv_sec += xsec;
-    }
+    CMBenchmarkResult *result = &test_state->benchmark;
+    const CMBenchmarkBaseline *baseline;
+    double base[BENCHMARK_MAX_COMPARED_ROUNDS];
+    double current[BENCHMARK_MAX_COMPARED_ROUNDS];
+    double slower = 0.0;
+    size_t n1;
+    size_t n2;
+    size_t i;
+    size_t j;
 
-    if ((time1.tv_nsec - time0.tv_nsec) > 1E9) {
-        xsec = (int) ((time1.tv_nsec - time0.tv_nsec) / 1E9);
-        time0.tv_nsec += (long int) (1E9 * xsec);
-        time0.tv_sec -= xsec;
+    baseline = benchmark_baseline_find(group_name, test_state->test->name);
+    if (baseline == NULL) {
+        return;
     }
 
-    ret.tv_sec = time1.tv_sec - time0.tv_sec;
-    ret.tv_nsec = time1.tv_nsec - time0.tv_nsec;
+    n1 = benchmark_thin_out(baseline->samples, baseline->rounds, base);
+    n2 = benchmark_thin_out(result->samples, result->rounds, current);
 
-    if (time1.tv_sec < time0.tv_sec) {
-        sign = -1;
+    /* U counts the pairs of rounds where the current one is slower. */
+    for (i = 0; i < n1; i++) {
+        for (j = 0; j < n2; j++) {
+            if (current[j] > base[i]) {
+                slower += 1.0;
+            } else if (current[j] == base[i]) {
+                slower += 0.5;
+            }
+        }
     }
 
-    ret.tv_sec = ret.tv_sec * sign;
-
-    return ret;
+    result->compared = true;
+    if (baseline->rounds % 2 == 0) {
+        result->baseline_median = (baseline->samples[baseline->rounds / 2 - 1] +
+                                   baseline->samples[baseline->rounds / 2]) /
+                                  2.0;
+    } else {
+        result->baseline_median = baseline->samples[baseline->rounds / 2];
+    }
+    result->change = result->baseline_median > 0.0 ?
+                     result->median / result->baseline_median - 1.0 : 0.0;
+    /* U is symmetric, P(U >= slower) = P(U <= n1 * n2 - slower). */
+    result->p_value = mann_whitney_cdf(n1,
+                                       n2,
+                                       (size_t)((double)(n1 * n2) - slower));
+
+    if (test_state->status == CM_TEST_PASSED &&
+        result->p_value < global_benchmark_alpha &&
+        result->change > global_benchmark_slowdown) {
+        cmocka_print_error("%s is slower than its baseline: median %.2f "
+                           "ns/op, baseline %.2f ns/op (%+.1f%%), slower in "
+                           "%.0f%% of the pairs of rounds (p = %.4f)",
+                           test_state->test->name,
+                           result->median,
+                           result->baseline_median,
+                           result->change * 100.0,
+                           slower * 100.0 / (double)(n1 * n2),
+                           result->p_value);
+        vcm_free_error(discard_const_p(char, test_state->error_message));
+        test_state->error_message = cm_error_message;
+        cm_error_message = NULL;
+        test_state->status = CM_TEST_FAILED;
+    }
 }
 
-static double cm_secdiff(struct timespec clock1, struct timespec clock0)
+/* Compare a finished benchmark with the baseline and save it, if enabled. */
+static void benchmark_baseline(const char *group_name,
+                               struct CMUnitTestState *test_state)
 {
-    double ret;
-    struct timespec diff;
-
-    diff = cm_tspecdiff(clock1, clock0);
+    cm_load_env();
+    benchmark_baseline_load();
 
-    ret = (double) diff.tv_sec;
-    ret += (double) diff.tv_nsec / (double) 1E9;
+    benchmark_baseline_compare(group_name, test_state);
 
-    return ret;
+    if (global_benchmark_save_file != NULL) {
+        benchmark_baseline_save(group_name,
+                                test_state->test->name,
+                                &test_state->benchmark);
+    }
 }
-#endif /* HAVE_STRUCT_TIMESPEC */
 
 /****************************************************************************
  * CMOCKA TEST RUNNER
@@ -2968,11 +8489,13 @@ static int cmocka_run_one_test_or_fixture(const char *function_name,
                                           CMFixtureFunction setup_func,
                                           CMFixtureFunction teardown_func,
                                           void ** const volatile state,
-                                          const void *const heap_check_point)
+                                          const MallocCheckPoint *const heap_check_point,
+                                          double *const verify_time)
 {
-    const ListNode * const volatile check_point = (const ListNode*)
-        (heap_check_point != NULL ?
-         heap_check_point : check_point_allocated_blocks());
+    const volatile MallocCheckPoint check_point =
+        heap_check_point != NULL ? *heap_check_point :
+                                   check_point_allocated_blocks();
+    volatile uint64_t verify_start = 0;
     int handle_exceptions = 1;
     void *current_state = NULL;
     int rc = 0;
@@ -2991,10 +8514,24 @@ static int cmocka_run_one_test_or_fixture(const char *function_name,
     if (handle_exceptions) {
 #ifndef _WIN32
         unsigned int i;
+#ifdef HAVE_SIGACTION
+        struct sigaction action;
+
+        memset(&action, 0, sizeof(action));
+        action.sa_sigaction = exception_handler;
+        action.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        for (i = 0; i < ARRAY_SIZE(exception_signals); i++) {
+            sigaction(exception_signals[i],
+                      &action,
+                      &default_signal_actions[i]);
+        }
+#else
         for (i = 0; i < ARRAY_SIZE(exception_signals); i++) {
             default_signal_functions[i] = signal(
                     exception_signals[i], exception_handler);
         }
+#endif /* HAVE_SIGACTION */
 #else /* _WIN32 */
         previous_exception_filter = SetUnhandledExceptionFilter(
                 exception_filter);
@@ -3009,11 +8546,14 @@ static int cmocka_run_one_test_or_fixture(const char *function_name,
     if (cm_setjmp(global_run_test_env) == 0) {
         if (test_func != NULL) {
             test_func(state != NULL ? state : &current_state);
+            verify_start = cm_clock_ns();
 
             fail_if_blocks_allocated(check_point, function_name);
+            fail_if_quarantine_corrupt(function_name);
             rc = 0;
         } else if (setup_func != NULL) {
             rc = setup_func(state != NULL ? state : &current_state);
+            verify_start = cm_clock_ns();
 
             /*
              * For setup we can ignore any allocated blocks. We just need to
@@ -3021,8 +8561,10 @@ static int cmocka_run_one_test_or_fixture(const char *function_name,
              */
         } else if (teardown_func != NULL) {
             rc = teardown_func(state != NULL ? state : &current_state);
+            verify_start = cm_clock_ns();
 
             fail_if_blocks_allocated(check_point, function_name);
+            fail_if_quarantine_corrupt(function_name);
         } else {
             /* ERROR */
         }
@@ -3039,13 +8581,20 @@ static int cmocka_run_one_test_or_fixture(const char *function_name,
             global_stop_test = 0;
         }
     }
+    if (verify_time != NULL) {
+        *verify_time = verify_start != 0 ? cm_seconds_since(verify_start) : 0.0;
+    }
     teardown_testing(function_name);
 
     if (handle_exceptions) {
 #ifndef _WIN32
         unsigned int i;
         for (i = 0; i < ARRAY_SIZE(exception_signals); i++) {
+#ifdef HAVE_SIGACTION
+            sigaction(exception_signals[i], &default_signal_actions[i], NULL);
+#else
             signal(exception_signals[i], default_signal_functions[i]);
+#endif
         }
 #else /* _WIN32 */
         if (previous_exception_filter) {
@@ -3062,7 +8611,8 @@ static int cmocka_run_group_fixture(const char *function_name,
                                     CMFixtureFunction setup_func,
                                     CMFixtureFunction teardown_func,
                                     void **state,
-                                    const void *const heap_check_point)
+                                    const MallocCheckPoint *const heap_check_point,
+                                    double *const verify_time)
 {
     int rc;
 
@@ -3072,14 +8622,16 @@ static int cmocka_run_group_fixture(const char *function_name,
                                         setup_func,
                                         NULL,
                                         state,
-                                        heap_check_point);
+                                        heap_check_point,
+                                        verify_time);
     } else {
         rc = cmocka_run_one_test_or_fixture(function_name,
                                         NULL,
                                         NULL,
                                         teardown_func,
                                         state,
-                                        heap_check_point);
+                                        heap_check_point,
+                                        verify_time);
     }
 
     return rc;
@@ -3087,20 +8639,23 @@ static int cmocka_run_group_fixture(const char *function_name,
 
 static int cmocka_run_one_tests(struct CMUnitTestState *test_state)
 {
-#ifdef HAVE_STRUCT_TIMESPEC
-    struct timespec start = {
-        .tv_sec = 0,
-        .tv_nsec = 0,
-    };
-    struct timespec finish = {
-        .tv_sec = 0,
-        .tv_nsec = 0,
-    };
-#endif
+    CMPhaseTimes *phases = &test_state->phases;
+    const uint64_t test_start = cm_clock_ns();
+    uint64_t phase_start;
+    double verify_time = 0.0;
     int rc = 0;
 
+    memset(phases, 0, sizeof(*phases));
+    phases->valid = cm_get_phase_times();
+
+    /* Blocks of the setup, the test and the teardown go to the arena */
+    malloc_arena_begin();
+    resource_usage_sample(&test_state->rusage);
+
     /* Run setup */
     if (test_state->test->setup_func != NULL) {
+        phase_start = cm_clock_ns();
+
         /* Setup the memory check point, it will be evaluated on teardown */
         test_state->check_point = check_point_allocated_blocks();
 
@@ -3109,7 +8664,10 @@ static int cmocka_run_one_tests(struct CMUnitTestState *test_state)
                                             test_state->test->setup_func,
                                             NULL,
                                             &test_state->state,
-                                            test_state->check_point);
+                                            &test_state->check_point,
+                                            &verify_time);
+        phases->setup = cm_seconds_since(phase_start) - verify_time;
+        phases->verify += verify_time;
         if (rc != 0) {
             test_state->status = CM_TEST_ERROR;
             cmocka_print_error("Test setup failed");
@@ -3117,18 +8675,35 @@ static int cmocka_run_one_tests(struct CMUnitTestState *test_state)
     }
 
     /* Run test */
-#ifdef HAVE_STRUCT_TIMESPEC
-    CMOCKA_CLOCK_GETTIME(CLOCK_REALTIME, &start);
-#endif
-
     if (rc == 0) {
+        CMUnitTestFunction test_func = test_state->test->test_func;
+
+        if (test_state->test->benchmark_func != NULL) {
+            global_benchmark_test = test_state;
+            test_func = cmocka_run_benchmark;
+        }
+
+        malloc_profile_start(test_state->test->alloc_budget != NULL);
+        malloc_fail_start();
+        perf_counters_start();
+        phase_start = cm_clock_ns();
         rc = cmocka_run_one_test_or_fixture(test_state->test->name,
-                                            test_state->test->test_func,
+                                            test_func,
                                             NULL,
                                             NULL,
                                             &test_state->state,
-                                            NULL);
-        if (rc == 0) {
+                                            NULL,
+                                            &verify_time);
+        phases->test = cm_seconds_since(phase_start) - verify_time;
+        phases->verify += verify_time;
+        perf_counters_stop(&test_state->perf);
+        malloc_fail_stop();
+        malloc_profile_stop(&test_state->heap_profile);
+        if (rc == 0 && test_state->test->alloc_budget != NULL &&
+            !check_alloc_budget(test_state->test->name,
+                                test_state->test->alloc_budget)) {
+            test_state->status = CM_TEST_FAILED;
+        } else if (rc == 0) {
             test_state->status = CM_TEST_PASSED;
         } else {
             if (global_skip_test) {
@@ -3141,21 +8716,18 @@ static int cmocka_run_one_tests(struct CMUnitTestState *test_state)
         rc = 0;
     }
 
-    test_state->runtime = 0.0;
-
-#ifdef HAVE_STRUCT_TIMESPEC
-    CMOCKA_CLOCK_GETTIME(CLOCK_REALTIME, &finish);
-    test_state->runtime = cm_secdiff(finish, start);
-#endif
-
     /* Run teardown */
     if (rc == 0 && test_state->test->teardown_func != NULL) {
+        phase_start = cm_clock_ns();
         rc = cmocka_run_one_test_or_fixture(test_state->test->name,
                                             NULL,
                                             NULL,
                                             test_state->test->teardown_func,
                                             &test_state->state,
-                                            test_state->check_point);
+                                            &test_state->check_point,
+                                            &verify_time);
+        phases->teardown = cm_seconds_since(phase_start) - verify_time;
+        phases->verify += verify_time;
         if (rc != 0) {
             test_state->status = CM_TEST_ERROR;
             cmocka_print_error("Test teardown failed");
@@ -3165,9 +8737,264 @@ static int cmocka_run_one_tests(struct CMUnitTestState *test_state)
     test_state->error_message = cm_error_message;
     cm_error_message = NULL;
 
+    resource_usage_stop(&test_state->rusage);
+    malloc_arena_drop();
+
+    test_state->runtime = cm_seconds_since(test_start);
+
     return rc;
 }
 
+/* Outcome of a test run with its nth allocation failing. */
+struct MallocFailResult {
+    int rc;
+    enum CMUnitTestStatus status;
+    bool injected;   /* Whether the test made n allocations. */
+    char *message;
+};
+
+/* Run a test with its nth allocation failing, in the current process. */
+static void malloc_fail_run(const struct CMUnitTestState *test_state,
+                            const size_t n,
+                            struct MallocFailResult *result)
+{
+    struct CMUnitTestState run_state = *test_state;
+    const size_t nth = global_malloc_fail_nth;
+    const double probability = global_malloc_fail_probability;
+
+    run_state.error_message = NULL;
+    global_malloc_fail_nth = n;
+    global_malloc_fail_probability = 0.0;
+
+    result->rc = cmocka_run_one_tests(&run_state);
+    result->status = run_state.status;
+    result->injected = global_malloc_fail_injected;
+    result->message = discard_const_p(char, run_state.error_message);
+
+    global_malloc_fail_nth = nth;
+    global_malloc_fail_probability = probability;
+}
+
+#if defined(HAVE_FORK) && defined(HAVE_SYS_WAIT_H)
+/* Child of an allocation failure sweep, reports through a pipe. */
+CMOCKA_NORETURN static void malloc_fail_child(
+    const struct CMUnitTestState *test_state,
+    const size_t n,
+    const int fd)
+{
+    struct MallocFailResult result;
+    size_t len;
+    const char *data;
+
+#ifdef HAVE_SYS_RESOURCE_H
+    malloc_limit_process();
+#endif
+    malloc_fail_run(test_state, n, &result);
+    len = result.message != NULL ? strlen(result.message) : 0;
+
+    data = (const char *)&result;
+    if (write(fd, data, sizeof(result)) == (ssize_t)sizeof(result)) {
+        data = result.message;
+        while (len > 0) {
+            ssize_t nwritten = write(fd, data, len);
+
+            if (nwritten <= 0) {
+                break;
+            }
+            data += nwritten;
+            len -= (size_t)nwritten;
+        }
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    _exit(0);
+}
+
+/* Collect the result of a child started by malloc_fail_sweep_batch(). */
+static void malloc_fail_collect(const pid_t pid,
+                                const int fd,
+                                struct MallocFailResult *result)
+{
+    char buffer[1024];
+    char *message = NULL;
+    size_t message_len = 0;
+    size_t nread = 0;
+    ssize_t rc;
+    int wstatus = 0;
+
+    while (nread < sizeof(*result)) {
+        rc = read(fd, (char *)result + nread, sizeof(*result) - nread);
+        if (rc <= 0) {
+            break;
+        }
+        nread += (size_t)rc;
+    }
+
+    while (nread == sizeof(*result) &&
+           (rc = read(fd, buffer, sizeof(buffer))) > 0) {
+        char *tmp = libc_realloc(message, message_len + (size_t)rc + 1);
+
+        if (tmp == NULL) {
+            break;
+        }
+        message = tmp;
+        memcpy(message + message_len, buffer, (size_t)rc);
+        message_len += (size_t)rc;
+        message[message_len] = '\0';
+    }
+    close(fd);
+    waitpid(pid, &wstatus, 0);
+
+    if (nread != sizeof(*result)) {
+        result->rc = -1;
+        result->status = CM_TEST_ERROR;
+        result->injected = true;
+        libc_free(message);
+        message = NULL;
+        if (WIFSIGNALED(wstatus)) {
+            char crash[64];
+
+            snprintf(crash, sizeof(crash),
+                     "Test crashed with signal %d", WTERMSIG(wstatus));
+            message = libc_calloc(1, strlen(crash) + 1);
+            if (message != NULL) {
+                memcpy(message, crash, strlen(crash));
+            }
+        }
+    }
+    result->message = message;
+}
+
+/*
+ * Run the test with the allocations first to first + count - 1 failing, in
+ * parallel forked children, so a crash only takes down one of them.
+ */
+static void malloc_fail_sweep_batch(const struct CMUnitTestState *test_state,
+                                    const size_t first,
+                                    const size_t count,
+                                    struct MallocFailResult *results)
+{
+    pid_t pids[MALLOC_FAIL_SWEEP_MAX_JOBS];
+    int fds[MALLOC_FAIL_SWEEP_MAX_JOBS];
+    size_t i;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for (i = 0; i < count; i++) {
+        int pipefd[2];
+
+        pids[i] = -1;
+        if (pipe(pipefd) == 0) {
+            pids[i] = fork();
+            if (pids[i] == 0) {
+                close(pipefd[0]);
+                malloc_fail_child(test_state, first + i, pipefd[1]);
+            }
+            close(pipefd[1]);
+            fds[i] = pipefd[0];
+            if (pids[i] < 0) {
+                close(pipefd[0]);
+            }
+        }
+        if (pids[i] < 0) {
+            /* Could not fork, run this one in the current process. */
+            malloc_fail_run(test_state, first + i, &results[i]);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (pids[i] > 0) {
+            malloc_fail_collect(pids[i], fds[i], &results[i]);
+        }
+    }
+}
+#endif /* HAVE_FORK && HAVE_SYS_WAIT_H */
+
+static size_t malloc_fail_sweep_jobs(void)
+{
+#if defined(HAVE_FORK) && defined(HAVE_SYS_WAIT_H) && defined(_SC_NPROCESSORS_ONLN)
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (jobs > MALLOC_FAIL_SWEEP_MAX_JOBS) {
+        return MALLOC_FAIL_SWEEP_MAX_JOBS;
+    }
+    if (jobs > 1) {
+        return (size_t)jobs;
+    }
+#endif
+
+    return 1;
+}
+
+/*
+ * Run a test normally, then again with its first, second, ... allocation
+ * failing until it does not make that many allocations anymore. The test
+ * fails with the first allocation it did not handle.
+ */
+static int cmocka_run_one_tests_sweep(struct CMUnitTestState *test_state)
+{
+    struct MallocFailResult results[MALLOC_FAIL_SWEEP_MAX_JOBS];
+    const size_t max_allocations = cm_get_malloc_fail_sweep();
+    const size_t jobs = malloc_fail_sweep_jobs();
+    size_t first;
+    size_t i;
+    int rc;
+
+    rc = cmocka_run_one_tests(test_state);
+    if (rc != 0 || test_state->status != CM_TEST_PASSED) {
+        return rc;
+    }
+
+    for (first = 1; first <= max_allocations; first += jobs) {
+        size_t count = max_allocations - first + 1;
+        bool done = false;
+
+        if (count > jobs) {
+            count = jobs;
+        }
+
+#if defined(HAVE_FORK) && defined(HAVE_SYS_WAIT_H)
+        malloc_fail_sweep_batch(test_state, first, count, results);
+#else
+        for (i = 0; i < count; i++) {
+            malloc_fail_run(test_state, first + i, &results[i]);
+        }
+#endif
+
+        for (i = 0; i < count; i++) {
+            struct MallocFailResult *result = &results[i];
+
+            if (!done && !result->injected) {
+                /* The test does not make this many allocations. */
+                done = true;
+            } else if (!done &&
+                       (result->rc != 0 ||
+                        (result->status != CM_TEST_PASSED &&
+                         result->status != CM_TEST_SKIPPED))) {
+                cmocka_print_error("Failing allocation %zu of the test: %s",
+                                   first + i,
+                                   result->message != NULL ?
+                                   result->message : "Unknown error");
+                vcm_free_error(discard_const_p(char,
+                                               test_state->error_message));
+                test_state->error_message = cm_error_message;
+                cm_error_message = NULL;
+                test_state->status = CM_TEST_FAILED;
+                done = true;
+            }
+            vcm_free_error(result->message);
+        }
+
+        if (done) {
+            break;
+        }
+    }
+
+    return 0;
+}
+
 int _cmocka_run_group_tests(const char *group_name,
                             const struct CMUnitTest * const tests,
                             const size_t num_tests,
@@ -3175,7 +9002,14 @@ int _cmocka_run_group_tests(const char *group_name,
                             CMFixtureFunction group_teardown)
 {
     struct CMUnitTestState *cm_tests;
-    const ListNode *group_check_point = check_point_allocated_blocks();
+    MallocRun *group_run;
+    MallocCheckPoint group_check_point;
+    uint64_t group_start;
+    uint64_t phase_start;
+    CMPhaseTimes group_phases = {
+        .valid = cm_get_phase_times(),
+    };
+    double verify_time = 0.0;
     void *group_state = NULL;
     size_t total_tests = 0;
     size_t total_failed = 0;
@@ -3187,6 +9021,9 @@ int _cmocka_run_group_tests(const char *group_name,
     size_t i;
     int rc;
 
+    /* Read the settings of the environment before anything else. */
+    cm_load_env();
+
     /* Make sure uintmax_t is at least the size of a pointer. */
     assert_true(sizeof(uintmax_t) >= sizeof(void*));
 
@@ -3195,10 +9032,15 @@ int _cmocka_run_group_tests(const char *group_name,
         return -1;
     }
 
+    /* The blocks of the group are tracked apart from concurrent groups. */
+    group_run = malloc_run_begin();
+    group_check_point = check_point_allocated_blocks();
+
     /* Setup cmocka test array */
     for (i = 0; i < num_tests; i++) {
         if (tests[i].name != NULL &&
             (tests[i].test_func != NULL
+             || tests[i].benchmark_func != NULL
              || tests[i].setup_func != NULL
              || tests[i].teardown_func != NULL)) {
             if (global_test_filter_pattern != NULL) {
@@ -3229,14 +9071,19 @@ int _cmocka_run_group_tests(const char *group_name,
     cmprintf_group_start(group_name, total_tests);
 
     rc = 0;
+    group_start = cm_clock_ns();
 
     /* Run group setup */
     if (group_setup != NULL) {
+        phase_start = cm_clock_ns();
         rc = cmocka_run_group_fixture("cmocka_group_setup",
                                       group_setup,
                                       NULL,
                                       &group_state,
-                                      group_check_point);
+                                      &group_check_point,
+                                      &verify_time);
+        group_phases.setup = cm_seconds_since(phase_start) - verify_time;
+        group_phases.verify += verify_time;
     }
 
     if (rc == 0) {
@@ -3253,9 +9100,24 @@ int _cmocka_run_group_tests(const char *group_name,
                 cmtest->state = cmtest->test->initial_state;
             }
 
-            rc = cmocka_run_one_tests(cmtest);
+            if (cm_get_malloc_fail_sweep() > 0) {
+                rc = cmocka_run_one_tests_sweep(cmtest);
+            } else {
+                rc = cmocka_run_one_tests(cmtest);
+            }
             total_executed++;
-            total_runtime += cmtest->runtime;
+            group_phases.test += cmtest->runtime;
+            if (cmtest->phases.valid) {
+                cmprintf_phase_times(test_number,
+                                     cmtest->test->name,
+                                     &cmtest->phases);
+            }
+            if (cmtest->benchmark.rounds > 0) {
+                benchmark_baseline(group_name, cmtest);
+                cmprintf_benchmark(test_number,
+                                   cmtest->test->name,
+                                   &cmtest->benchmark);
+            }
             if (rc == 0) {
                 switch (cmtest->status) {
                     case CM_TEST_PASSED:
@@ -3314,11 +9176,15 @@ int _cmocka_run_group_tests(const char *group_name,
 
     /* Run group teardown */
     if (group_teardown != NULL) {
+        phase_start = cm_clock_ns();
         rc = cmocka_run_group_fixture("cmocka_group_teardown",
                                       NULL,
                                       group_teardown,
                                       &group_state,
-                                      group_check_point);
+                                      &group_check_point,
+                                      &verify_time);
+        group_phases.teardown = cm_seconds_since(phase_start) - verify_time;
+        group_phases.verify += verify_time;
         if (rc != 0) {
             if (cm_error_message != NULL) {
                 print_error("[  ERROR   ] --- %s\n", cm_error_message);
@@ -3330,6 +9196,8 @@ int _cmocka_run_group_tests(const char *group_name,
         }
     }
 
+    total_runtime = cm_seconds_since(group_start);
+
     cmprintf_group_finish(group_name,
                           total_executed,
                           total_passed,
@@ -3337,13 +9205,20 @@ int _cmocka_run_group_tests(const char *group_name,
                           total_errors,
                           total_skipped,
                           total_runtime,
+                          &group_phases,
                           cm_tests);
 
     for (i = 0; i < total_tests; i++) {
         vcm_free_error(discard_const_p(char, cm_tests[i].error_message));
+        libc_free(cm_tests[i].benchmark.samples);
     }
     libc_free(cm_tests);
     fail_if_blocks_allocated(group_check_point, "cmocka_group_tests");
 
+    /* Hand the quarantined blocks back, they have been checked by now. */
+    quarantine_evict(group_run, 0);
+    malloc_run_end(group_run);
+    malloc_slab_release();
+
     return (int)(total_failed + total_errors);
 }
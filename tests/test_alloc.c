@@ -8,8 +8,12 @@
 #include <cmocka_private.h>
 
 #include <stdlib.h>
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 static void torture_test_malloc(void **state)
 {
@@ -81,12 +85,835 @@ static void torture_test_realloc_set0(void **state)
     assert_null(str);
 }
 
+static void torture_test_realloc_grow(void **state)
+{
+    char *buf = NULL;
+    size_t i;
+
+    (void)state; /* unsused */
+
+    /* Grow the buffer one byte at a time like a dynamic array append. */
+    for (i = 0; i < 1024; i++) {
+        buf = (char *)test_realloc(buf, i + 1);
+        assert_non_null(buf);
+        buf[i] = (char)(i % 128);
+    }
+
+    for (i = 0; i < 1024; i++) {
+        assert_int_equal(buf[i], (char)(i % 128));
+    }
+
+    buf = (char *)test_realloc(buf, 16);
+    assert_non_null(buf);
+    for (i = 0; i < 16; i++) {
+        assert_int_equal(buf[i], (char)i);
+    }
+
+    test_free(buf);
+}
+
+static void torture_test_malloc_guard_size(void **state)
+{
+    char *str;
+
+    (void)state; /* unsused */
+
+    cmocka_set_malloc_guard_size(64);
+
+    str = (char *)test_malloc(10);
+    assert_non_null(str);
+
+    memset(str, 'x', 10);
+
+    test_free(str);
+
+    cmocka_set_malloc_guard_size(16);
+}
+
+static void torture_test_malloc_poison(void **state)
+{
+    enum cm_malloc_poison modes[] = {
+        CM_MALLOC_POISON_FULL,
+        CM_MALLOC_POISON_GUARDS,
+        CM_MALLOC_POISON_CACHELINE,
+        CM_MALLOC_POISON_OFF,
+    };
+    unsigned char *buf;
+    size_t i;
+
+    (void)state; /* unsused */
+
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        cmocka_set_malloc_poison(modes[i]);
+
+        buf = (unsigned char *)test_malloc(256);
+        assert_non_null(buf);
+
+        if (modes[i] == CM_MALLOC_POISON_FULL) {
+            assert_int_equal(buf[128], 0xBA);
+        }
+        if (modes[i] == CM_MALLOC_POISON_FULL ||
+            modes[i] == CM_MALLOC_POISON_CACHELINE) {
+            assert_int_equal(buf[0], 0xBA);
+            assert_int_equal(buf[255], 0xBA);
+        }
+
+        memset(buf, 0, 256);
+        buf = (unsigned char *)test_realloc(buf, 512);
+        assert_non_null(buf);
+        assert_int_equal(buf[255], 0);
+
+        test_free(buf);
+    }
+
+    cmocka_set_malloc_poison(CM_MALLOC_POISON_FULL);
+}
+
+static void torture_test_malloc_quarantine(void **state)
+{
+    char *blocks[64];
+    char *held;
+    char *reused;
+    size_t i;
+
+    (void)state; /* unsused */
+
+    cmocka_set_malloc_quarantine(1024);
+
+    /* A block in the quarantine is filled and its memory is not reused. */
+    held = (char *)test_malloc(32);
+    assert_non_null(held);
+    memset(held, 'x', 32);
+    test_free(held);
+    for (i = 0; i < 32; i++) {
+        assert_int_equal((unsigned char)held[i], 0xCD);
+    }
+    reused = (char *)test_malloc(32);
+    assert_non_null(reused);
+    assert_ptr_not_equal(reused, held);
+    test_free(reused);
+
+    /* Push more freed blocks than the budget to force evictions. */
+    for (i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+        blocks[i] = (char *)test_malloc(32);
+        assert_non_null(blocks[i]);
+        memset(blocks[i], 'x', 32);
+    }
+    for (i = 0; i < sizeof(blocks) / sizeof(blocks[0]); i++) {
+        test_free(blocks[i]);
+    }
+
+    /* The newest block is still held, the check at the end finds it intact. */
+    held = blocks[(sizeof(blocks) / sizeof(blocks[0])) - 1];
+    for (i = 0; i < 32; i++) {
+        assert_int_equal((unsigned char)held[i], 0xCD);
+    }
+
+    cmocka_set_malloc_quarantine(0);
+}
+
+static char *alloc_string(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = (char *)test_malloc(len);
+
+    if (copy != NULL) {
+        memcpy(copy, str, len);
+    }
+
+    return copy;
+}
+
+static void torture_test_malloc_backtrace(void **state)
+{
+    char *strings[8];
+    size_t i;
+
+    (void)state; /* unsused */
+
+    cmocka_set_malloc_backtrace(2);
+
+    for (i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        strings[i] = alloc_string("test string");
+        assert_non_null(strings[i]);
+    }
+    for (i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        test_free(strings[i]);
+    }
+
+    cmocka_set_malloc_backtrace(0);
+}
+
+static void torture_test_alloc_region(void **state)
+{
+    char *str;
+    size_t i;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    cmocka_alloc_region_begin();
+    for (i = 0; i < 16; i++) {
+        str[i] = 'a';
+    }
+    assert_alloc_region_end(0, 0);
+
+    cmocka_alloc_region_begin();
+    str = (char *)test_realloc(str, 32);
+    assert_non_null(str);
+    assert_alloc_region_end(1, 32);
+
+    test_free(str);
+}
+
+static void torture_test_alloc_budget(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = alloc_string("budget");
+    test_free(str);
+}
+
+static void torture_test_malloc_slab(void **state)
+{
+    char *small[32];
+    char *large;
+    char *str;
+    size_t i;
+
+    (void)state; /* unused */
+
+    cmocka_set_malloc_slab(1);
+
+    for (i = 0; i < 32; i++) {
+        small[i] = (char *)test_malloc(i + 1);
+        assert_non_null(small[i]);
+        memset(small[i], 'x', i + 1);
+    }
+    large = (char *)test_malloc(8192);
+    assert_non_null(large);
+
+    /* Grow within the slab, then out of it. */
+    str = alloc_string("slab");
+    str = (char *)test_realloc(str, 16);
+    assert_non_null(str);
+    assert_string_equal(str, "slab");
+    str = (char *)test_realloc(str, 8192);
+    assert_non_null(str);
+    assert_string_equal(str, "slab");
+    test_free(str);
+
+    for (i = 0; i < 32; i++) {
+        test_free(small[i]);
+    }
+    test_free(large);
+
+    /* Freed blocks are reused. */
+    str = alloc_string("reused");
+    assert_string_equal(str, "reused");
+    test_free(str);
+
+    cmocka_set_malloc_slab(0);
+}
+
+static void torture_test_aligned_alloc(void **state)
+{
+    char *buf;
+    void *mem = NULL;
+    size_t i;
+    int rc;
+
+    (void)state; /* unused */
+
+    for (i = 16; i <= 256; i *= 2) {
+        buf = (char *)test_aligned_alloc(i, 100);
+        assert_non_null(buf);
+        assert_int_equal((uintptr_t)buf % i, 0);
+        memset(buf, 'x', 100);
+
+        /* Resizing keeps the alignment. */
+        buf = (char *)test_realloc(buf, 1000);
+        assert_non_null(buf);
+        assert_int_equal((uintptr_t)buf % i, 0);
+        assert_int_equal(buf[99], 'x');
+        test_free(buf);
+    }
+
+    rc = test_posix_memalign(&mem, 64, 32);
+    assert_int_equal(rc, 0);
+    assert_non_null(mem);
+    assert_int_equal((uintptr_t)mem % 64, 0);
+    test_free(mem);
+
+    rc = test_posix_memalign(&mem, 24, 32);
+    assert_int_equal(rc, EINVAL);
+
+    buf = (char *)test_memalign(32, 8);
+    assert_non_null(buf);
+    assert_int_equal((uintptr_t)buf % 32, 0);
+    test_free(buf);
+
+    assert_null(test_aligned_alloc(3, 8));
+}
+
+static void torture_test_malloc_page_guard(void **state)
+{
+    char *str;
+    char *small;
+    void *mem = NULL;
+    int rc;
+
+    (void)state; /* unused */
+
+    cmocka_set_malloc_page_guard(CM_MALLOC_PAGE_GUARD_RIGHT, 64);
+
+    small = alloc_string("small");
+    str = (char *)test_malloc(100);
+    assert_non_null(str);
+    memset(str, 'x', 100);
+
+    str = (char *)test_realloc(str, 5000);
+    assert_non_null(str);
+    assert_int_equal(str[99], 'x');
+    memset(str, 'y', 5000);
+    test_free(str);
+
+    rc = test_posix_memalign(&mem, 64, 200);
+    assert_int_equal(rc, 0);
+    assert_int_equal((uintptr_t)mem % 64, 0);
+    memset(mem, 'z', 200);
+    test_free(mem);
+
+    cmocka_set_malloc_page_guard(CM_MALLOC_PAGE_GUARD_LEFT, 64);
+
+    str = (char *)test_calloc(1, 100);
+    assert_non_null(str);
+    assert_int_equal(str[0], 0);
+    memset(str, 'x', 100);
+    test_free(str);
+
+    cmocka_set_malloc_page_guard(CM_MALLOC_PAGE_GUARD_OFF, 0);
+
+    test_free(small);
+}
+
+static void torture_test_malloc_page_guard_sampling(void **state)
+{
+    char *str;
+    char *spare;
+    size_t i;
+
+    (void)state; /* unused */
+
+    /*
+     * Only sampled blocks get a guard page. Three allocations per round
+     * alternate which of them is sampled, so a guarded block is moved to an
+     * unsampled one as well.
+     */
+    cmocka_set_malloc_page_guard(CM_MALLOC_PAGE_GUARD_RIGHT, 4096);
+    cmocka_set_malloc_sampling(2, 0);
+
+    for (i = 0; i < 2; i++) {
+        str = (char *)test_malloc(8192);
+        assert_non_null(str);
+        memset(str, 'x', 8192);
+
+        str = (char *)test_realloc(str, 100);
+        assert_non_null(str);
+        assert_int_equal(str[99], 'x');
+
+        spare = (char *)test_malloc(16);
+        assert_non_null(spare);
+
+        test_free(spare);
+        test_free(str);
+    }
+
+    cmocka_set_malloc_sampling(0, 0);
+    cmocka_set_malloc_page_guard(CM_MALLOC_PAGE_GUARD_OFF, 0);
+}
+
+static void torture_test_malloc_fail_nth(void **state)
+{
+    char *first;
+    char *second;
+
+    (void)state; /* unused */
+
+    cmocka_set_malloc_fail_nth(2);
+
+    first = (char *)test_malloc(16);
+    assert_non_null(first);
+    assert_false(cmocka_malloc_failure_injected());
+
+    /* A failing realloc leaves the block alone. */
+    second = (char *)test_realloc(first, 32);
+    assert_null(second);
+    assert_true(cmocka_malloc_failure_injected());
+
+    second = (char *)test_malloc(16);
+    assert_non_null(second);
+
+    test_free(first);
+    test_free(second);
+
+    cmocka_set_malloc_fail_nth(0);
+}
+
+struct list {
+    struct list *next;
+    char *name;
+};
+
+static void free_list(struct list *list)
+{
+    while (list != NULL) {
+        struct list *next = list->next;
+
+        test_free(list->name);
+        test_free(list);
+        list = next;
+    }
+}
+
+/* Build a list of 3 named entries, handling allocation failures. */
+static int build_list(struct list **plist)
+{
+    struct list *list = NULL;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        struct list *entry = (struct list *)test_malloc(sizeof(*entry));
+
+        if (entry == NULL) {
+            free_list(list);
+            return ENOMEM;
+        }
+        entry->name = alloc_string("entry");
+        if (entry->name == NULL) {
+            test_free(entry);
+            free_list(list);
+            return ENOMEM;
+        }
+        entry->next = list;
+        list = entry;
+    }
+
+    *plist = list;
+
+    return 0;
+}
+
+static void torture_test_malloc_fail_sweep(void **state)
+{
+    struct list *list = NULL;
+    int rc;
+
+    (void)state; /* unused */
+
+    rc = build_list(&list);
+    if (rc == ENOMEM && cmocka_malloc_failure_injected()) {
+        return;
+    }
+    assert_int_equal(rc, 0);
+
+    free_list(list);
+}
+
+static void torture_test_malloc_sampling(void **state)
+{
+    unsigned char *blocks[8];
+    size_t i;
+
+    (void)state; /* unused */
+
+    cmocka_set_malloc_sampling(4, 0);
+
+    cmocka_alloc_region_begin();
+    for (i = 0; i < 8; i++) {
+        blocks[i] = (unsigned char *)test_malloc(64);
+        assert_non_null(blocks[i]);
+    }
+    /* Every fourth block is poisoned, the others take the fast path. */
+    assert_int_equal(blocks[3][0], 0xBA);
+    assert_int_equal(blocks[7][63], 0xBA);
+
+    memset(blocks[0], 'x', 64);
+    blocks[0] = (unsigned char *)test_realloc(blocks[0], 128);
+    assert_non_null(blocks[0]);
+    assert_int_equal(blocks[0][63], 'x');
+    assert_alloc_region_end(9, 8 * 64 + 128);
+
+    for (i = 0; i < 8; i++) {
+        test_free(blocks[i]);
+    }
+
+    /* Without a region the unsampled blocks are only counted. */
+    for (i = 0; i < 8; i++) {
+        cmocka_set_malloc_slab(i % 2);
+        blocks[i] = (unsigned char *)test_malloc(64);
+        assert_non_null(blocks[i]);
+        memset(blocks[i], (int)i, 64);
+    }
+    blocks[1] = (unsigned char *)test_realloc(blocks[1], 256);
+    assert_non_null(blocks[1]);
+    assert_int_equal(blocks[1][63], 1);
+
+    for (i = 0; i < 8; i++) {
+        test_free(blocks[i]);
+    }
+
+    cmocka_set_malloc_slab(0);
+    cmocka_set_malloc_sampling(0, 0);
+}
+
+static void torture_test_malloc_churn(void **state)
+{
+    char *str;
+    size_t i;
+
+    (void)state; /* unused */
+
+    /* Short lived blocks of the same size, a candidate for pooling. */
+    for (i = 0; i < 10; i++) {
+        str = (char *)test_malloc(48);
+        assert_non_null(str);
+        test_free(str);
+    }
+
+    str = NULL;
+    for (i = 1; i <= 3; i++) {
+        str = (char *)test_realloc(str, i * 64);
+        assert_non_null(str);
+    }
+    test_free(str);
+}
+
+static void torture_test_malloc_sanitizer(void **state)
+{
+    char *blocks[3];
+    size_t i;
+
+    (void)state; /* unused */
+
+    /* Only makes a difference in builds with a sanitizer. */
+    cmocka_set_malloc_sanitizer(1);
+
+    for (i = 0; i < 2; i++) {
+        cmocka_set_malloc_slab(i == 1);
+
+        blocks[0] = (char *)test_malloc(24);
+        assert_non_null(blocks[0]);
+        memset(blocks[0], 'a', 24);
+
+        blocks[1] = (char *)test_calloc(3, 8);
+        assert_non_null(blocks[1]);
+        assert_int_equal(blocks[1][23], 0);
+
+        blocks[0] = (char *)test_realloc(blocks[0], 200);
+        assert_non_null(blocks[0]);
+        assert_int_equal(blocks[0][23], 'a');
+        memset(blocks[0], 'b', 200);
+
+        blocks[0] = (char *)test_realloc(blocks[0], 8);
+        assert_non_null(blocks[0]);
+        assert_int_equal(blocks[0][7], 'b');
+
+        test_free(blocks[1]);
+        blocks[2] = (char *)test_malloc(24);
+        assert_non_null(blocks[2]);
+        memset(blocks[2], 'c', 24);
+
+        test_free(blocks[2]);
+        test_free(blocks[0]);
+    }
+
+    cmocka_set_malloc_slab(0);
+    cmocka_set_malloc_sanitizer(0);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *free_in_thread(void *arg)
+{
+    test_free(arg);
+
+    return test_malloc(16);
+}
+
+static void torture_test_malloc_threads(void **state)
+{
+    pthread_t threads[4];
+    void *blocks[4];
+    size_t i;
+    int rc;
+
+    (void)state; /* unused */
+
+    /* The workers free blocks from the slab cache of this thread. */
+    cmocka_set_malloc_slab(1);
+
+    cmocka_alloc_region_begin();
+    for (i = 0; i < 4; i++) {
+        blocks[i] = test_malloc(32);
+        assert_non_null(blocks[i]);
+        rc = pthread_create(&threads[i], NULL, free_in_thread, blocks[i]);
+        assert_int_equal(rc, 0);
+    }
+    for (i = 0; i < 4; i++) {
+        rc = pthread_join(threads[i], &blocks[i]);
+        assert_int_equal(rc, 0);
+        assert_non_null(blocks[i]);
+    }
+    /* Blocks allocated by the workers are counted as well. */
+    assert_alloc_region_end(8, 4 * 32 + 4 * 16);
+
+    for (i = 0; i < 4; i++) {
+        test_free(blocks[i]);
+    }
+
+    cmocka_set_malloc_slab(0);
+}
+
+/* Handshake between a test and a test group it runs on another thread. */
+static pthread_mutex_t concurrent_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t concurrent_cond = PTHREAD_COND_INITIALIZER;
+static int concurrent_step;
+
+static void concurrent_wait(int step)
+{
+    pthread_mutex_lock(&concurrent_lock);
+    while (concurrent_step < step) {
+        pthread_cond_wait(&concurrent_cond, &concurrent_lock);
+    }
+    pthread_mutex_unlock(&concurrent_lock);
+}
+
+static void concurrent_signal(int step)
+{
+    pthread_mutex_lock(&concurrent_lock);
+    concurrent_step = step;
+    pthread_cond_broadcast(&concurrent_cond);
+    pthread_mutex_unlock(&concurrent_lock);
+}
+
+static void torture_test_malloc_nested_group(void **state)
+{
+    char *block;
+
+    (void)state; /* unused */
+
+    block = (char *)test_malloc(24);
+    assert_non_null(block);
+
+    /* The outer test allocates while this one is running. */
+    concurrent_signal(1);
+    concurrent_wait(2);
+
+    test_free(block);
+}
+
+static void *run_group_in_thread(void *arg)
+{
+    const struct CMUnitTest nested_tests[] = {
+        cmocka_unit_test(torture_test_malloc_nested_group),
+    };
+    int *rc = (int *)arg;
+
+    *rc = cmocka_run_group_tests_name("alloc_nested_tests",
+                                      nested_tests,
+                                      NULL,
+                                      NULL);
+
+    return NULL;
+}
+
+static void torture_test_malloc_concurrent_groups(void **state)
+{
+    pthread_t thread;
+    char *block;
+    int nested_rc = -1;
+    int rc;
+
+    (void)state; /* unused */
+
+    concurrent_step = 0;
+    rc = pthread_create(&thread, NULL, run_group_in_thread, &nested_rc);
+    assert_int_equal(rc, 0);
+
+    concurrent_wait(1);
+    block = (char *)test_malloc(32);
+    assert_non_null(block);
+    concurrent_signal(2);
+
+    rc = pthread_join(thread, NULL);
+    assert_int_equal(rc, 0);
+
+    /* Neither test takes the block of the other one for a leak. */
+    assert_int_equal(nested_rc, 0);
+    test_free(block);
+}
+#endif /* HAVE_PTHREAD_H */
+
+static int setup_arena(void **state)
+{
+    *state = alloc_string("arena state");
+
+    return 0;
+}
+
+static int teardown_arena(void **state)
+{
+    test_free(*state);
+
+    return 0;
+}
+
+/* Page guarded block of the group, allocated before any arena. */
+static char *arena_group_block;
+
+static int setup_arena_group(void **state)
+{
+    (void)state; /* unused */
+
+    cmocka_set_malloc_page_guard(CM_MALLOC_PAGE_GUARD_RIGHT, 4096);
+    arena_group_block = (char *)test_malloc(8192);
+    cmocka_set_malloc_page_guard(CM_MALLOC_PAGE_GUARD_OFF, 0);
+    if (arena_group_block == NULL) {
+        return -1;
+    }
+    memset(arena_group_block, 'g', 8192);
+
+    return 0;
+}
+
+static int teardown_arena_group(void **state)
+{
+    (void)state; /* unused */
+
+    assert_int_equal(arena_group_block[99], 'g');
+    test_free(arena_group_block);
+
+    return 0;
+}
+
+static void torture_test_malloc_arena_group_block(void **state)
+{
+    (void)state; /* unused */
+
+    /* The moved block outlives the arena of the test. */
+    arena_group_block = (char *)test_realloc(arena_group_block, 100);
+    assert_non_null(arena_group_block);
+    assert_int_equal(arena_group_block[99], 'g');
+}
+
+static void torture_test_malloc_arena(void **state)
+{
+    char *blocks[1024];
+    char *large;
+    char *str;
+    size_t i;
+
+    assert_string_equal((const char *)*state, "arena state");
+
+    /* A moved block of the setup is not a block of the test. */
+    *state = test_realloc(*state, 64);
+    assert_non_null(*state);
+    assert_string_equal((const char *)*state, "arena state");
+
+    /* Spread over several chunks. */
+    cmocka_alloc_region_begin();
+    for (i = 0; i < 1024; i++) {
+        blocks[i] = (char *)test_malloc(100);
+        assert_non_null(blocks[i]);
+        memset(blocks[i], 'x', 100);
+    }
+    large = (char *)test_calloc(1, 256 * 1024);
+    assert_non_null(large);
+    assert_alloc_region_end(1025, 1024 * 100 + 256 * 1024);
+
+    for (i = 0; i < 1024; i += 2) {
+        test_free(blocks[i]);
+    }
+    test_free(large);
+
+    /* Blocks are moved when resized. */
+    str = alloc_string("arena");
+    str = (char *)test_realloc(str, 4096);
+    assert_non_null(str);
+    assert_string_equal(str, "arena");
+    test_free(str);
+
+    str = (char *)test_aligned_alloc(256, 100);
+    assert_non_null(str);
+    assert_int_equal((uintptr_t)str % 256, 0);
+    str = (char *)test_realloc(str, 1000);
+    assert_non_null(str);
+    assert_int_equal((uintptr_t)str % 256, 0);
+    test_free(str);
+
+    for (i = 1; i < 1024; i += 2) {
+        test_free(blocks[i]);
+    }
+}
+
 int main(void) {
+    static const struct CMAllocBudget one_alloc = { 1, 64 };
     const struct CMUnitTest alloc_tests[] = {
         cmocka_unit_test(torture_test_malloc),
         cmocka_unit_test(torture_test_realloc),
         cmocka_unit_test(torture_test_realloc_set0),
+        cmocka_unit_test(torture_test_realloc_grow),
+        cmocka_unit_test(torture_test_malloc_guard_size),
+        cmocka_unit_test(torture_test_malloc_poison),
+        cmocka_unit_test(torture_test_malloc_quarantine),
+        cmocka_unit_test(torture_test_malloc_backtrace),
+        cmocka_unit_test(torture_test_alloc_region),
+        cmocka_unit_test(torture_test_malloc_slab),
+        cmocka_unit_test(torture_test_aligned_alloc),
+        cmocka_unit_test(torture_test_malloc_page_guard),
+        cmocka_unit_test(torture_test_malloc_page_guard_sampling),
+        cmocka_unit_test_alloc_budget(torture_test_alloc_budget, &one_alloc),
+        cmocka_unit_test(torture_test_malloc_fail_nth),
+        cmocka_unit_test(torture_test_malloc_sampling),
+        cmocka_unit_test(torture_test_malloc_churn),
+        cmocka_unit_test(torture_test_malloc_sanitizer),
+#ifdef HAVE_PTHREAD_H
+        cmocka_unit_test(torture_test_malloc_threads),
+        cmocka_unit_test(torture_test_malloc_concurrent_groups),
+#endif
+    };
+    const struct CMUnitTest alloc_arena_tests[] = {
+        cmocka_unit_test_setup_teardown(torture_test_malloc_arena,
+                                        setup_arena,
+                                        teardown_arena),
+        cmocka_unit_test(torture_test_malloc_arena_group_block),
+#ifdef HAVE_PTHREAD_H
+        /* Each group carves from and drops an arena of its own. */
+        cmocka_unit_test(torture_test_malloc_concurrent_groups),
+#endif
+    };
+    const struct CMUnitTest alloc_sweep_tests[] = {
+        cmocka_unit_test(torture_test_malloc_fail_sweep),
     };
+    int rc;
+
+    /* Test the checks of cmocka itself, also in sanitizer builds. */
+    cmocka_set_malloc_sanitizer(0);
+
+    rc = cmocka_run_group_tests(alloc_tests, NULL, NULL);
+
+    cmocka_set_malloc_arena(1);
+    rc += cmocka_run_group_tests(alloc_arena_tests,
+                                 setup_arena_group,
+                                 teardown_arena_group);
+    cmocka_set_malloc_arena(0);
+
+    cmocka_set_malloc_fail_sweep(16);
+    rc += cmocka_run_group_tests(alloc_sweep_tests, NULL, NULL);
 
-    return cmocka_run_group_tests(alloc_tests, NULL, NULL);
+    return rc;
 }
@@ -0,0 +1,386 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <cmocka.h>
+#include <cmocka_private.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+static void torture_test_double_free(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    test_free(str);
+    test_free(str);
+}
+
+static int setup_unsampled(void **state)
+{
+    (void)state; /* unused */
+
+    /* Without the limit unsampled blocks take the thin path. */
+    cmocka_set_malloc_limit(0, 0);
+    cmocka_set_malloc_sampling(1000, 0);
+
+    return 0;
+}
+
+static int teardown_unsampled(void **state)
+{
+    (void)state; /* unused */
+
+    cmocka_set_malloc_sampling(0, 0);
+    cmocka_set_malloc_limit(16 * 1024, 0);
+
+    return 0;
+}
+
+static void torture_test_unsampled_double_free(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    test_free(str);
+    test_free(str);
+}
+
+static void torture_test_invalid_free(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    test_free(str + 1);
+}
+
+static void torture_test_guard_overflow(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    cmocka_set_malloc_guard_size(64);
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    cmocka_set_malloc_guard_size(16);
+
+    /* Skip over the first bytes past the end of the buffer. */
+    str[16 + 40] = 'x';
+
+    test_free(str);
+}
+
+static int setup_quarantine(void **state)
+{
+    (void)state; /* unused */
+
+    cmocka_set_malloc_quarantine(1024);
+
+    return 0;
+}
+
+static int teardown_quarantine(void **state)
+{
+    (void)state; /* unused */
+
+    cmocka_set_malloc_quarantine(0);
+
+    return 0;
+}
+
+static void torture_test_use_after_free(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    test_free(str);
+
+    /* The block is still in the quarantine, so this is caught. */
+    str[4] = 'x';
+}
+
+static void torture_test_use_after_free_evicted(void **state)
+{
+    char *str;
+    char *other;
+    size_t i;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(16);
+    assert_non_null(str);
+
+    test_free(str);
+    str[4] = 'x';
+
+    /* Freeing more blocks pushes the modified one out of the quarantine. */
+    for (i = 0; i < 64; i++) {
+        other = (char *)test_malloc(16);
+        assert_non_null(other);
+        test_free(other);
+    }
+}
+
+static void torture_test_alloc_region(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    cmocka_alloc_region_begin();
+    str = (char *)test_malloc(16);
+    test_free(str);
+    assert_alloc_region_end(0, 0);
+}
+
+static void torture_test_alloc_budget(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    str = (char *)test_malloc(32);
+    test_free(str);
+}
+
+static void torture_test_page_guard_overflow(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    cmocka_set_malloc_page_guard(CM_MALLOC_PAGE_GUARD_RIGHT, 0);
+
+    str = (char *)test_malloc(100);
+    assert_non_null(str);
+
+    cmocka_set_malloc_page_guard(CM_MALLOC_PAGE_GUARD_OFF, 0);
+
+    /* Faults right away, or corrupts the guard if pages are unsupported. */
+    str[100 + 32] = 'x';
+
+    test_free(str);
+}
+
+static void torture_test_page_guard_underflow(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    cmocka_set_malloc_page_guard(CM_MALLOC_PAGE_GUARD_LEFT, 0);
+
+    str = (char *)test_malloc(100);
+    assert_non_null(str);
+
+    cmocka_set_malloc_page_guard(CM_MALLOC_PAGE_GUARD_OFF, 0);
+
+    str[-1] = 'x';
+
+    test_free(str);
+}
+
+static void torture_test_leak_loop(void **state)
+{
+    size_t i;
+
+    (void)state; /* unused */
+
+    for (i = 0; i < 100; i++) {
+        assert_non_null(test_malloc(16));
+    }
+    assert_non_null(test_malloc(8));
+}
+
+static void torture_test_malloc_fail_sweep(void **state)
+{
+    char *first;
+    char *second;
+
+    (void)state; /* unused */
+
+    first = (char *)test_malloc(16);
+    if (first == NULL) {
+        return;
+    }
+
+    /* Leaks the first block when the second allocation fails. */
+    second = (char *)test_malloc(16);
+    if (second == NULL) {
+        return;
+    }
+
+    test_free(second);
+    test_free(first);
+}
+
+static void torture_test_malloc_limit(void **state)
+{
+    size_t i;
+
+    (void)state; /* unused */
+
+    /* Runs into the limit of 16 KiB set in main(). */
+    for (i = 0; i < 64; i++) {
+        assert_non_null(test_malloc(1024));
+    }
+}
+
+static void torture_test_sampled_leak(void **state)
+{
+    size_t i;
+
+    (void)state; /* unused */
+
+    /* None of these blocks is sampled, they are still reported as leaks. */
+    cmocka_set_malloc_sampling(1000, 0);
+    for (i = 0; i < 3; i++) {
+        assert_non_null(test_malloc(40));
+    }
+    cmocka_set_malloc_sampling(0, 0);
+}
+
+static void torture_test_unsampled_leak(void **state)
+{
+    size_t i;
+
+    (void)state; /* unused */
+
+    /* Without the limit the unsampled blocks are only counted. */
+    cmocka_set_malloc_limit(0, 0);
+    cmocka_set_malloc_sampling(1000, 0);
+    for (i = 0; i < 2; i++) {
+        assert_non_null(test_malloc(56));
+    }
+    cmocka_set_malloc_sampling(0, 0);
+    cmocka_set_malloc_limit(16 * 1024, 0);
+}
+
+static void *leak_block(size_t size)
+{
+    return test_malloc(size);
+}
+
+static void torture_test_backtrace_leak(void **state)
+{
+    (void)state; /* unused */
+
+    /* The leak is reported with the call stack of the allocation. */
+    cmocka_set_malloc_backtrace(1);
+    assert_non_null(leak_block(48));
+    cmocka_set_malloc_backtrace(0);
+}
+
+static void torture_test_arena_leak(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    /* The arena reclaims the blocks, they are still reported as leaks. */
+    str = (char *)test_malloc(72);
+    assert_non_null(str);
+    str = (char *)test_malloc(8);
+    assert_non_null(str);
+}
+
+#ifdef HAVE_PTHREAD_H
+static void *leak_in_thread(void *arg)
+{
+    (void)arg; /* unused */
+
+    return test_malloc(24);
+}
+
+static void torture_test_thread_leak(void **state)
+{
+    pthread_t thread;
+    void *block = NULL;
+    int rc;
+
+    (void)state; /* unused */
+
+    rc = pthread_create(&thread, NULL, leak_in_thread, NULL);
+    assert_int_equal(rc, 0);
+    rc = pthread_join(thread, &block);
+    assert_int_equal(rc, 0);
+    assert_non_null(block);
+}
+#endif /* HAVE_PTHREAD_H */
+
+int main(void) {
+    static const struct CMAllocBudget one_small_alloc = { 1, 16 };
+    const struct CMUnitTest alloc_fail_tests[] = {
+        cmocka_unit_test(torture_test_double_free),
+        cmocka_unit_test_setup_teardown(torture_test_unsampled_double_free,
+                                        setup_unsampled,
+                                        teardown_unsampled),
+        cmocka_unit_test(torture_test_invalid_free),
+        cmocka_unit_test(torture_test_guard_overflow),
+        cmocka_unit_test_setup_teardown(torture_test_use_after_free,
+                                        setup_quarantine,
+                                        teardown_quarantine),
+        cmocka_unit_test_setup_teardown(torture_test_use_after_free_evicted,
+                                        setup_quarantine,
+                                        teardown_quarantine),
+        cmocka_unit_test(torture_test_alloc_region),
+        cmocka_unit_test_alloc_budget(torture_test_alloc_budget,
+                                      &one_small_alloc),
+        cmocka_unit_test(torture_test_page_guard_overflow),
+        cmocka_unit_test(torture_test_page_guard_underflow),
+        cmocka_unit_test(torture_test_leak_loop),
+        cmocka_unit_test(torture_test_malloc_fail_sweep),
+        cmocka_unit_test(torture_test_malloc_limit),
+        cmocka_unit_test(torture_test_sampled_leak),
+        cmocka_unit_test(torture_test_unsampled_leak),
+        cmocka_unit_test(torture_test_backtrace_leak),
+#ifdef HAVE_PTHREAD_H
+        cmocka_unit_test(torture_test_thread_leak),
+#endif
+    };
+    const struct CMUnitTest alloc_arena_fail_tests[] = {
+        cmocka_unit_test(torture_test_arena_leak),
+    };
+    int rc;
+
+    /* Test the checks of cmocka itself, also in sanitizer builds. */
+    cmocka_set_malloc_sanitizer(0);
+
+    /* Only tests which pass on their own are swept. */
+    cmocka_set_malloc_fail_sweep(16);
+    cmocka_set_malloc_limit(16 * 1024, 0);
+
+    cmocka_set_malloc_arena(1);
+    rc = cmocka_run_group_tests(alloc_arena_fail_tests, NULL, NULL);
+    cmocka_set_malloc_arena(0);
+
+    rc += cmocka_run_group_tests(alloc_fail_tests, NULL, NULL);
+
+    return rc;
+}
@@ -0,0 +1,97 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* asprintf() */
+#endif
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+ * This file isn't compiled with UNIT_TESTING, the allocator calls below reach
+ * cmocka through the linker option --wrap only.
+ */
+
+static char *global_untracked;
+
+static void torture_wrap_malloc(void **state)
+{
+    char *str;
+
+    (void)state; /* unused */
+
+    cmocka_alloc_region_begin();
+    str = (char *)malloc(16);
+    assert_non_null(str);
+    memset(str, 'a', 16);
+    str = (char *)realloc(str, 32);
+    assert_non_null(str);
+    assert_alloc_region_end(2, 48);
+
+    free(str);
+
+    cmocka_alloc_region_begin();
+    str = (char *)calloc(4, 8);
+    assert_non_null(str);
+    assert_alloc_region_end(1, 32);
+
+    free(str);
+}
+
+static void torture_wrap_strdup(void **state)
+{
+    char *str;
+    char *copy;
+    int len;
+
+    (void)state; /* unused */
+
+    cmocka_alloc_region_begin();
+    str = strdup("cmocka");
+    assert_non_null(str);
+    assert_string_equal(str, "cmocka");
+
+    copy = strndup(str, 3);
+    assert_non_null(copy);
+    assert_string_equal(copy, "cmo");
+    free(copy);
+
+    len = asprintf(&copy, "%s-%d", str, 2);
+    assert_int_equal(len, 8);
+    assert_string_equal(copy, "cmocka-2");
+    assert_alloc_region_end(3, 7 + 4 + 9);
+
+    free(copy);
+    free(str);
+}
+
+static void torture_wrap_untracked(void **state)
+{
+    (void)state; /* unused */
+
+    /* Blocks allocated before the test are passed on to the C library. */
+    global_untracked = (char *)realloc(global_untracked, 64);
+    assert_non_null(global_untracked);
+    free(global_untracked);
+    global_untracked = NULL;
+}
+
+int main(void) {
+    const struct CMUnitTest alloc_wrap_tests[] = {
+        cmocka_unit_test(torture_wrap_malloc),
+        cmocka_unit_test(torture_wrap_strdup),
+        cmocka_unit_test(torture_wrap_untracked),
+    };
+
+    global_untracked = strdup("untracked");
+    if (global_untracked == NULL) {
+        return 1;
+    }
+
+    return cmocka_run_group_tests(alloc_wrap_tests, NULL, NULL);
+}
@@ -0,0 +1,91 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <cmocka.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_SIZE 256
+
+static int setup_buffer(void **state)
+{
+    *state = test_malloc(BUFFER_SIZE);
+    if (*state == NULL) {
+        return -1;
+    }
+    memset(*state, 'x', BUFFER_SIZE);
+
+    return 0;
+}
+
+static int teardown_buffer(void **state)
+{
+    test_free(*state);
+
+    return 0;
+}
+
+static void bench_sum(void **state, size_t iterations)
+{
+    size_t i;
+
+    (void)state; /* unused */
+
+    for (i = 0; i < iterations; i++) {
+        size_t sum = i * 3 + 1;
+
+        cmocka_do_not_optimize(sum);
+    }
+}
+
+static void bench_memset(void **state, size_t iterations)
+{
+    unsigned char *buffer = (unsigned char *)*state;
+    size_t i;
+
+    for (i = 0; i < iterations; i++) {
+        memset(buffer, (int)(i & 0xff), BUFFER_SIZE);
+        cmocka_clobber_memory();
+    }
+
+    assert_int_equal(buffer[0], (iterations - 1) & 0xff);
+}
+
+static void bench_malloc(void **state, size_t iterations)
+{
+    size_t i;
+
+    (void)state; /* unused */
+
+    for (i = 0; i < iterations; i++) {
+        void *block = test_malloc(32);
+
+        cmocka_do_not_optimize(block);
+        test_free(block);
+    }
+}
+
+static void test_plain(void **state)
+{
+    (void)state; /* unused */
+}
+
+int main(void) {
+    const struct CMUnitTest benchmark_tests[] = {
+        cmocka_unit_benchmark(bench_sum),
+        cmocka_unit_benchmark_setup_teardown(bench_memset,
+                                             setup_buffer,
+                                             teardown_buffer),
+        cmocka_unit_test(test_plain),
+        cmocka_unit_benchmark(bench_malloc),
+    };
+
+    /* Keep the rounds short, this only tests the runner. */
+    cmocka_set_benchmark(5, 1000);
+
+    return cmocka_run_group_tests(benchmark_tests, NULL, NULL);
+}
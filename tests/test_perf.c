@@ -0,0 +1,104 @@
+#include "config.h"
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <cmocka.h>
+
+#include <stdbool.h>
+#include <string.h>
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/* Check if the instructions of this thread can be counted at all. */
+static bool perf_instructions_available(void)
+{
+#if defined(HAVE_LINUX_PERF_EVENT_H) && defined(SYS_perf_event_open)
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd == -1) {
+        return false;
+    }
+    close(fd);
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+static void sum_numbers(void)
+{
+    volatile size_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < 1000; i++) {
+        sum += i;
+    }
+    assert_int_equal(sum, 999 * 1000 / 2);
+}
+
+static void torture_perf_counters(void **state)
+{
+    (void)state; /* unused */
+
+    if (!perf_instructions_available()) {
+        skip();
+    }
+
+    sum_numbers();
+
+    assert_perf_counter_below(CM_PERF_INSTRUCTIONS, 1000 * 1000);
+}
+
+static void torture_perf_counter_exceeded(void **state)
+{
+    (void)state; /* unused */
+
+    if (!perf_instructions_available()) {
+        skip();
+    }
+
+    sum_numbers();
+
+    /* The loop alone retires more than a single instruction. */
+    assert_perf_counter_below(CM_PERF_INSTRUCTIONS, 1);
+}
+
+int main(void) {
+    const struct CMUnitTest perf_tests[] = {
+        cmocka_unit_test(torture_perf_counters),
+    };
+    const struct CMUnitTest perf_fail_tests[] = {
+        cmocka_unit_test(torture_perf_counter_exceeded),
+    };
+    int expected_failures;
+    int rc;
+
+    cmocka_set_perf_counters(1);
+
+    rc = cmocka_run_group_tests(perf_tests, NULL, NULL);
+
+    /* The exceeded counter has to fail the test if it can be counted. */
+    expected_failures = perf_instructions_available() ? 1 : 0;
+    if (cmocka_run_group_tests(perf_fail_tests, NULL, NULL) !=
+        expected_failures) {
+        rc++;
+    }
+
+    return rc;
+}